@@ -11,4 +11,60 @@ struct __attribute__((packed)) rc_udp_packet {
     uint16_t pwms[RCINPUT_UDP_NUM_CHANNELS];
 };
 
+/*
+ * Version 3, only sent once the vehicle has advertised it with a
+ * rc_udp_v3_caps datagram. Each datagram carries the last n_frames frames,
+ * oldest first, so that a lost datagram doesn't lose its update. After the
+ * header comes a little endian bit stream, padded to a byte :
+ * - the oldest frame, n_channels values of RCINPUT_UDP_V3_VALUE_BITS bits,
+ *   pwm - RCINPUT_UDP_V3_PWM_BASE, 0 for an unused channel at a 0 pwm;
+ * - for each newer frame, a n_channels bits mask of the changed channels,
+ *   then for each of them the zigzag encoded difference with the previous
+ *   frame, in groups of 3 bits followed by a continuation bit.
+ */
+#define RCINPUT_UDP_VERSION_3 3
+#define RCINPUT_UDP_V3_MAX_CHANNELS 16
+#define RCINPUT_UDP_V3_MAX_FRAMES 8
+#define RCINPUT_UDP_V3_PWM_BASE 900
+#define RCINPUT_UDP_V3_VALUE_BITS 11
+/* header, a full frame and the largest possible deltas */
+#define RCINPUT_UDP_V3_MAX_SIZE \
+    (sizeof(struct rc_udp_v3_header) + \
+     (RCINPUT_UDP_V3_MAX_CHANNELS * RCINPUT_UDP_V3_VALUE_BITS + \
+      (RCINPUT_UDP_V3_MAX_FRAMES - 1) * RCINPUT_UDP_V3_MAX_CHANNELS * 17 + 7) / 8)
+
+struct __attribute__((packed)) rc_udp_v3_header {
+    uint32_t version;
+    /* low 32 bits of the time of the newest frame */
+    uint32_t timestamp_us;
+    /* sequence of the newest frame, the older ones are the previous ones */
+    uint16_t sequence;
+    uint8_t n_channels;
+    uint8_t n_frames;
+};
+
+/* sent by the vehicle to the ground station to switch it to version 3 */
+#define RCINPUT_UDP_V3_CAPS 0x43335652
+
+struct __attribute__((packed)) rc_udp_v3_caps {
+    uint32_t magic;
+    uint8_t max_channels;
+    uint8_t max_frames;
+};
+
+/*
+ * Sent back by a vehicle asked to echo, for each datagram received, so that
+ * the ground station gets the round trip and the offset of the vehicle
+ * clock, NTP style. The sequence of the datagram is the probe id.
+ */
+#define RCINPUT_UDP_ECHO 0x4f484345
+
+struct __attribute__((packed)) rc_udp_echo {
+    uint32_t magic;
+    uint16_t sequence;
+    /* vehicle clock, when the datagram arrived and when the echo left */
+    uint64_t receive_us;
+    uint64_t send_us;
+};
+
 #endif
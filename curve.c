@@ -0,0 +1,116 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "curve.h"
+
+void curve_default_config(struct curve_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->min = CURVE_PWM_MIN;
+    config->max = CURVE_PWM_MAX;
+}
+
+int curve_parse_option(struct curve_config *config, const char *option)
+{
+    const char *value;
+    char *end;
+    long n;
+
+    value = strchr(option, '=');
+    if (value == NULL)
+        return -1;
+    value++;
+    n = strtol(value, &end, 10);
+    if (end == value || *end != '\0')
+        return -1;
+
+    if (!strncmp(option, "deadband=", 9) && n >= 0 && n < 32767) {
+        config->deadband = n;
+    } else if (!strncmp(option, "expo=", 5) && n >= 0 && n <= 100) {
+        config->expo = n;
+    } else if (!strncmp(option, "trim=", 5) && n > -500 && n < 500) {
+        config->trim = n;
+    } else if (!strncmp(option, "min=", 4) && n >= 800 && n <= 2200) {
+        config->min = n;
+    } else if (!strncmp(option, "max=", 4) && n >= 800 && n <= 2200) {
+        config->max = n;
+    } else if (!strncmp(option, "reverse=", 8) && (n == 0 || n == 1)) {
+        config->reverse = n;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int curve_check_config(const struct curve_config *config)
+{
+    int center = CURVE_PWM_CENTER + config->trim;
+
+    if (config->min < center && center < config->max)
+        return 0;
+
+    return -1;
+}
+
+/* runs at startup or reload only, float is fine here */
+void curve_compile(const struct curve_config *config, int8_t direction,
+                   struct curve *curve)
+{
+    float deadband = config->deadband / 32767.0f;
+    float expo = config->expo / 100.0f;
+    float center = CURVE_PWM_CENTER + config->trim;
+    float x, magnitude, out;
+    int i;
+
+    curve->min = config->min;
+    curve->max = config->max;
+
+    for (i = 0; i < CURVE_LUT_SIZE; i++) {
+        x = ((i << CURVE_LUT_SHIFT) - 32768) / 32767.0f;
+        if (x < -1.0f)
+            x = -1.0f;
+        else if (x > 1.0f)
+            x = 1.0f;
+        if ((direction < 0) != (config->reverse != 0))
+            x = -x;
+
+        magnitude = x < 0 ? -x : x;
+        if (magnitude <= deadband)
+            magnitude = 0;
+        else
+            magnitude = (magnitude - deadband) / (1.0f - deadband);
+        magnitude = (1.0f - expo) * magnitude +
+                    expo * magnitude * magnitude * magnitude;
+
+        if (x >= 0)
+            out = center + magnitude * (config->max - center);
+        else
+            out = center - magnitude * (center - config->min);
+        if (out < config->min)
+            out = config->min;
+        else if (out > config->max)
+            out = config->max;
+        curve->lut[i] = (uint16_t)(out + 0.5f);
+    }
+}
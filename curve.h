@@ -0,0 +1,74 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _CURVE_H_
+#define _CURVE_H_
+
+/*
+ * The response curve of an axis is compiled into a table of
+ * CURVE_LUT_SIZE points evenly spaced over the int16_t range, values in
+ * between are linearly interpolated in fixed point.
+ */
+#define CURVE_LUT_SHIFT 8
+#define CURVE_LUT_SIZE ((1 << (16 - CURVE_LUT_SHIFT)) + 1)
+
+#define CURVE_PWM_MIN    1100
+#define CURVE_PWM_CENTER 1500
+#define CURVE_PWM_MAX    1900
+
+struct curve_config {
+    /* in axis units, from 0 to 32767 */
+    uint16_t deadband;
+    /* from 0 (linear) to 100 (cubic) */
+    uint8_t expo;
+    /* offset of the center, in us */
+    int16_t trim;
+    /* endpoints, in us */
+    uint16_t min;
+    uint16_t max;
+    uint8_t reverse;
+};
+
+struct curve {
+    uint16_t lut[CURVE_LUT_SIZE];
+    /* endpoints of the output, never exceeded by the stick prediction */
+    uint16_t min;
+    uint16_t max;
+};
+
+void curve_default_config(struct curve_config *config);
+/* parses a "key=value" option, returns -1 if it is invalid */
+int curve_parse_option(struct curve_config *config, const char *option);
+/* the trimmed center must be between the endpoints, returns -1 if not */
+int curve_check_config(const struct curve_config *config);
+/* direction is 1 or -1, as in the joystick types */
+void curve_compile(const struct curve_config *config, int8_t direction,
+                   struct curve *curve);
+
+static inline uint16_t curve_apply(const struct curve *curve, int16_t value)
+{
+    uint32_t x = (uint32_t)(value + 32768);
+    uint32_t index = x >> CURVE_LUT_SHIFT;
+    int32_t frac = x & ((1 << CURVE_LUT_SHIFT) - 1);
+    int32_t a = curve->lut[index];
+    int32_t b = curve->lut[index + 1];
+
+    return a + (((b - a) * frac) >> CURVE_LUT_SHIFT);
+}
+
+#endif // _CURVE_H_
@@ -0,0 +1,77 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "histogram.h"
+
+void histogram_init(struct histogram *histogram, const char *name)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->name = name;
+}
+
+/* highest value falling in bucket */
+static uint64_t histogram_bucket_max(unsigned int bucket)
+{
+    unsigned int shift;
+    uint64_t sub;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    sub = bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram,
+                              double percentile)
+{
+    uint64_t count, target, seen = 0, max;
+    unsigned int i;
+
+    count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+    if (count == 0)
+        return 0;
+    target = count * percentile / 100.0;
+    if (target == 0)
+        target = 1;
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    for (i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+        if (seen >= target)
+            return histogram_bucket_max(i) < max ? histogram_bucket_max(i) : max;
+    }
+
+    return max;
+}
+
+void histogram_print(const struct histogram *histogram, FILE *file)
+{
+    fprintf(file, "%s : count %" PRIu64 ", p50 %" PRIu64 ", p99 %" PRIu64
+            ", p99.9 %" PRIu64 ", max %" PRIu64 "\n", histogram->name,
+            __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+            histogram_percentile(histogram, 50.0),
+            histogram_percentile(histogram, 99.0),
+            histogram_percentile(histogram, 99.9),
+            __atomic_load_n(&histogram->max, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,77 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _HISTOGRAM_H_
+#define _HISTOGRAM_H_
+
+/*
+ * Log-linear histogram : values below 2^HISTOGRAM_SUB_BITS have their own
+ * bucket, above each power of two is split in 2^HISTOGRAM_SUB_BITS
+ * buckets, so percentiles are within 1/16th of the real value. Recording
+ * is a few instructions, without any lock; there must be a single writer,
+ * readers may run concurrently.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+/* values are clamped to 2^HISTOGRAM_MAX_BITS - 1 */
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_NUM_BUCKETS \
+    ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    const char *name;
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_NUM_BUCKETS];
+};
+
+void histogram_init(struct histogram *histogram, const char *name);
+/* percentile between 0 and 100, returns the upper bound of its bucket */
+uint64_t histogram_percentile(const struct histogram *histogram,
+                              double percentile);
+/* one line with the count, p50, p99, p99.9 and max */
+void histogram_print(const struct histogram *histogram, FILE *file);
+
+static inline unsigned int histogram_bucket(uint64_t value)
+{
+    unsigned int msb, shift;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+    if (value >> HISTOGRAM_MAX_BITS)
+        value = (1ULL << HISTOGRAM_MAX_BITS) - 1;
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HISTOGRAM_SUB_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+           ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static inline void histogram_record(struct histogram *histogram,
+                                    uint64_t value)
+{
+    uint64_t *bucket = &histogram->buckets[histogram_bucket(value)];
+
+    /* single writer, plain stores are enough for the readers */
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+    if (value > histogram->max)
+        __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+#endif // _HISTOGRAM_H_
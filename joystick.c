@@ -27,11 +27,21 @@
 #include <poll.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <linux/joystick.h>
+#include <linux/input.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <libgen.h>
 
+#include "curve.h"
 #include "joystick.h"
-#include "joystick_remote.h"
+#include "timebase.h"
+#include "recorder.h"
+#include "log.h"
 
 static uint8_t skycontroller_buttons[JOYSTICK_NUM_MODES] = { 8, 9, 2, 0, 1, 3};
 static uint8_t xbox360_buttons[JOYSTICK_NUM_MODES] = { 0, 1, 2, 3, 4, 5};
@@ -40,180 +50,785 @@ static struct joystick_axis skycontroller_axes[JOYSTICK_NUM_AXIS] = {{2, 1}, {3,
 static struct joystick_axis xbox360_axes[JOYSTICK_NUM_AXIS] = {{3, 1}, {4, 1}, {1, -1}, {0, 1}};
 static struct joystick_axis ps3_axes[JOYSTICK_NUM_AXIS] = { {2, 1}, {3, -1}, {1, -1}, {0, 1}};
 
-#define JOYSTICK_AXIS_MIN -32767.0f
-#define JOYSTICK_AXIS_MAX  32767.0f
-#define JOYSTICK_PWM_MIN   1100.0f
-#define JOYSTICK_PWM_MAX   1900.0f
-
 static const struct joystick_pwms def_pwms = {1500, 1500, 1500, 1500, 1500};
 /* these values are in the middle of the ranges that are documented
  * in the arducopter parameter list as Flight Mode 1-6 */
 static const uint16_t mode_pwm_values[JOYSTICK_NUM_MODES] = { 1165, 1295, 1425, 1555, 1685, 1815 };
 
-static uint16_t axis_to_pwm(int16_t value)
+/* returns 1 if the raw value or the pwm value of the mapped channel changed */
+static int joystick_handle_axis(struct joystick *joystick,
+                                const struct joystick_curves *curves,
+                                uint8_t number, int16_t value,
+                                uint64_t event_usec)
 {
-    float value_fl = value;
-
-    return (uint16_t)((value_fl - JOYSTICK_AXIS_MIN)/
-            (JOYSTICK_AXIS_MAX - JOYSTICK_AXIS_MIN) *
-            (JOYSTICK_PWM_MAX - JOYSTICK_PWM_MIN) + JOYSTICK_PWM_MIN);
-}
+    int8_t channel = joystick->axis_channels[number];
+    int changed = 0;
+    uint16_t *pwm;
+    uint16_t new_pwm;
 
-static void joystick_handle_axis(struct joystick *joystick, 
-                                 uint8_t number, int16_t value)
-{
-    debug_printf("joystick_handle_axis : %d, %d\n", number, value);
-    pthread_mutex_lock(&joystick->mutex);
+    log_printf(LOG_JOYSTICK, LOG_DEBUG, "joystick_handle_axis : %d, %d\n",
+               number, value);
 
-    if (number == joystick->axes[JOYSTICK_AXIS_ROLL].number) {
-        joystick->pwms.roll = 
-            axis_to_pwm(joystick->axes[JOYSTICK_AXIS_ROLL].direction * value);
-    } else if (number == joystick->axes[JOYSTICK_AXIS_PITCH].number) {
-        joystick->pwms.pitch = 
-            axis_to_pwm(joystick->axes[JOYSTICK_AXIS_PITCH].direction * value);
-    } else if (number == joystick->axes[JOYSTICK_AXIS_THROTTLE].number) {
-        joystick->pwms.throttle =
-            axis_to_pwm(joystick->axes[JOYSTICK_AXIS_THROTTLE].direction * value);
-    } else if (number == joystick->axes[JOYSTICK_AXIS_YAW].number) {
-        joystick->pwms.yaw = 
-            axis_to_pwm(joystick->axes[JOYSTICK_AXIS_YAW].direction * value);
+    /* raw values, for the mixer */
+    if (number < JOYSTICK_NUM_RAW_AXES &&
+        joystick->state.axes[number] != value) {
+        joystick->state.axes[number] = value;
+        changed = 1;
+    }
+    if (channel < 0) {
+        log_printf(LOG_JOYSTICK, LOG_DEBUG, "joystick_handle_axis : unmapped axis\n");
+        return changed;
     }
-    else {
-        debug_printf("joystick_handle_axis : unmapped axis\n");
+    /* the pwms fields are in the JOYSTICK_AXIS_* order */
+    pwm = &((uint16_t *) &joystick->state.pwms)[channel];
+    new_pwm = curve_apply(&curves->curves[channel], value);
+    /* published with the next change, for the sender predictor */
+    if (joystick->track_sticks && event_usec != 0) {
+        joystick->state.rates[channel] =
+            predictor_track(&joystick->tracks[channel], new_pwm, event_usec);
+        joystick->state.axis_usec[channel] = event_usec;
+        joystick->state.pwm_min[channel] = curves->curves[channel].min;
+        joystick->state.pwm_max[channel] = curves->curves[channel].max;
     }
-    pthread_mutex_unlock(&joystick->mutex);
+    if (*pwm == new_pwm)
+        return changed;
+    *pwm = new_pwm;
+
+    return 1;
 }
 
-static void joystick_handle_button(struct joystick *joystick,
-                                   uint8_t number, int16_t value)
+/* returns 1 if the mode pwm value has changed */
+static int joystick_handle_button(struct joystick *joystick,
+                                  uint8_t number, int16_t value)
 {
-    debug_printf("joystick_handle_button : %d, %d\n", number, value);
-    pthread_mutex_lock(&joystick->mutex);
+    uint16_t mode;
+    int changed = 0;
+
+    log_printf(LOG_JOYSTICK, LOG_DEBUG, "joystick_handle_button : %d, %d\n",
+               number, value);
 
     /* only take button presses into account */
     if (value != 1)
-        goto end;
-
-    if (number == joystick->buttons[JOYSTICK_BUTTON_MODE1]) {
-        joystick->pwms.mode = mode_pwm_values[JOYSTICK_BUTTON_MODE1];
-    } else if (number == joystick->buttons[JOYSTICK_BUTTON_MODE2]) {
-        joystick->pwms.mode = mode_pwm_values[JOYSTICK_BUTTON_MODE2];
-    } else if (number == joystick->buttons[JOYSTICK_BUTTON_MODE3]) {
-        joystick->pwms.mode = mode_pwm_values[JOYSTICK_BUTTON_MODE3];
-    } else if (number == joystick->buttons[JOYSTICK_BUTTON_MODE4]) {
-        joystick->pwms.mode = mode_pwm_values[JOYSTICK_BUTTON_MODE4];
-    } else if (number == joystick->buttons[JOYSTICK_BUTTON_MODE5]) {
-        joystick->pwms.mode = mode_pwm_values[JOYSTICK_BUTTON_MODE5];
-    } else if (number == joystick->buttons[JOYSTICK_BUTTON_MODE6]) {
-        joystick->pwms.mode = mode_pwm_values[JOYSTICK_BUTTON_MODE6];
-    } else {
-        debug_printf("joystick_handle_button : unmapped button\n");
+        return 0;
+
+    if (joystick->button_modes[number] < 0) {
+        log_printf(LOG_JOYSTICK, LOG_DEBUG,
+                   "joystick_handle_button : unmapped button\n");
+        return 0;
     }
-end:
-    pthread_mutex_unlock(&joystick->mutex);
+    mode = mode_pwm_values[joystick->button_modes[number]];
+    if (joystick->state.pwms.mode != mode) {
+        joystick->state.pwms.mode = mode;
+        changed = 1;
+    }
+    return changed;
 }
 
-static void *joystick_thread(void *arg)
+/*
+ * Publish the state written by the joystick thread to the sender. The
+ * joystick thread is the only writer, so a seqlock is enough : the writer
+ * never waits and the sender retries if it raced with an update.
+ */
+static void joystick_publish(struct joystick *joystick, uint64_t event_usec)
 {
-    struct js_event event;
-    struct pollfd pollfd;
-    struct joystick *joystick = (struct joystick *) arg;
-    int ret;
-    
-    debug_printf("starting joystick event listener\n");
+    const uint32_t *src = (const uint32_t *) &joystick->state;
+    uint32_t *dst = (uint32_t *) &joystick->shared.state;
+    uint32_t seq = joystick->shared.seq;
+    unsigned int i;
 
-    pollfd.fd = joystick->fd;
-    pollfd.events = POLLIN | POLLHUP;
+    joystick->state.event_usec = event_usec;
+    __atomic_store_n(&joystick->shared.seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < sizeof(joystick->state) / sizeof(*src); i++)
+        __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&joystick->shared.seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-    while (1) {
-        /* wait for an event on the joystick, no timeout */
-        ret = poll(&pollfd, 1, -1);
-        if (ret == -1) {
-            perror("joystick_thread - poll");
-            break;
-        } else if (ret == 0) {
-            fprintf(stderr, "joystick_thread : unexpected timeout\n");
-            break;
-        } else if (pollfd.revents & POLLHUP) {
-            fprintf(stderr, "joystick disconnected\n");
-            break;
+/* wake up the sender if it waits for changes, see joystick_wait_change */
+static void joystick_notify_change(struct joystick *joystick)
+{
+    int fd = __atomic_load_n(&joystick->change_fd, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+
+    if (fd == -1)
+        return;
+    if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        perror("joystick_notify_change - write");
+}
+
+/*
+ * Events are accumulated in a frame and only published when the frame ends,
+ * so that all the channels changed by a single motion go out together.
+ * Only the last value of each axis is converted. Button presses are
+ * handled in order since each one selects a mode.
+ */
+static void joystick_frame_axis(struct joystick *joystick,
+                                uint8_t number, int16_t value)
+{
+    struct joystick_frame *frame = &joystick->frame;
+
+    frame->axis_values[number] = value;
+    frame->dirty_axes[number / 64] |= 1ULL << (number % 64);
+}
+
+static void joystick_frame_button(struct joystick *joystick,
+                                  uint8_t number, int16_t value)
+{
+    uint32_t buttons = joystick->state.buttons;
+
+    /* raw state, for the mixer */
+    if (number < JOYSTICK_NUM_RAW_BUTTONS) {
+        if (value)
+            buttons |= 1U << number;
+        else
+            buttons &= ~(1U << number);
+        if (buttons != joystick->state.buttons) {
+            joystick->state.buttons = buttons;
+            joystick->frame.changed = 1;
         }
-        ret = read(joystick->fd, &event, sizeof(event));
-        if (ret < 0) {
-            perror("joystick_thread - read\n");
-            break;
+    }
+    if (value == 1)
+        joystick->frame.changed |= joystick_handle_button(joystick, number, 1);
+}
+
+/* event_usec is the CLOCK_MONOTONIC time of the frame, 0 if unknown */
+static int joystick_frame_end(struct joystick *joystick, uint64_t event_usec)
+{
+    struct joystick_frame *frame = &joystick->frame;
+    const struct joystick_curves *curves;
+    unsigned int word;
+    uint8_t number;
+    int changed;
+
+    /*
+     * may be swapped by joystick_load_curves, which waits for curves_seq
+     * to move before freeing the previous ones. Both are seq_cst, so that
+     * either the reloader sees the odd seq or this loads the new curves.
+     */
+    __atomic_store_n(&joystick->curves_seq, joystick->curves_seq + 1,
+                     __ATOMIC_SEQ_CST);
+    curves = __atomic_load_n(&joystick->curves, __ATOMIC_SEQ_CST);
+    for (word = 0; word < JOYSTICK_MAX_EVENT_NUMBER / 64; word++) {
+        while (frame->dirty_axes[word]) {
+            number = word * 64 + __builtin_ctzll(frame->dirty_axes[word]);
+            frame->dirty_axes[word] &= frame->dirty_axes[word] - 1;
+            frame->changed |= joystick_handle_axis(joystick, curves, number,
+                                                   frame->axis_values[number],
+                                                   event_usec);
         }
+    }
+    __atomic_store_n(&joystick->curves_seq, joystick->curves_seq + 1,
+                     __ATOMIC_RELEASE);
+    changed = frame->changed;
+    if (changed)
+        joystick_publish(joystick, event_usec);
+    frame->changed = 0;
+
+    return changed;
+}
 
+static void joystick_count_read(struct joystick *joystick, unsigned int n)
+{
+    metrics_add(&joystick->counters, METRICS_READS, 1);
+    metrics_add(&joystick->counters, METRICS_EVENTS, n);
+}
+
+/*
+ * joydev has no frame boundaries, all the events pending are read with a
+ * single read, up to JOYSTICK_EVENT_BATCH, and handled as one frame. The
+ * joydev timestamps are in ms on an unspecified clock, the frame is
+ * stamped with the time of the read instead.
+ */
+static void joydev_handle_events(struct joystick *joystick,
+                                 const struct js_event *events, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
         /* remove init flag in order not to differentiate between
          * initial virtual events and joystick events */
-        event.type &= ~JS_EVENT_INIT;
-
-        switch (event.type) {
+        switch (events[i].type & ~JS_EVENT_INIT) {
         case JS_EVENT_AXIS:
-            joystick_handle_axis(joystick, event.number, event.value);
+            joystick_frame_axis(joystick, events[i].number, events[i].value);
             break;
         case JS_EVENT_BUTTON:
-            joystick_handle_button(joystick, event.number, event.value);
+            joystick_frame_button(joystick, events[i].number, events[i].value);
             break;
         default:
-            fprintf(stderr, "joystick_thread : unexpected event %d\n", event.type);
+            fprintf(stderr, "joydev_handle_events : unexpected event %d\n",
+                    events[i].type);
         }
     }
-    
-    exit(EXIT_SUCCESS);
+}
 
-    return NULL;
+static int joydev_process_events(struct joystick *joystick)
+{
+    struct js_event events[JOYSTICK_EVENT_BATCH];
+    uint64_t now;
+    unsigned int n;
+    int ret;
+
+    ret = read(joystick->fd, events, sizeof(events));
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        perror("joydev_process_events - read");
+        return -1;
+    } else if (ret == 0 || ret % sizeof(events[0]) != 0) {
+        fprintf(stderr, "joystick disconnected\n");
+        return -1;
+    }
+    n = ret / sizeof(events[0]);
+    joystick_count_read(joystick, n);
+    now = timebase_now_usec();
+    if (joystick->recorder != NULL)
+        recorder_push_js_events(joystick->recorder, now, events, n);
+
+    return joystick_handle_events(joystick, events, n, now);
+}
+
+int joystick_handle_events(struct joystick *joystick,
+                           const struct js_event *events, unsigned int n,
+                           uint64_t event_usec)
+{
+    joydev_handle_events(joystick, events, n);
+
+    return joystick_frame_end(joystick, event_usec);
+}
+
+/* when a recorded event has to be replayed, 0 if as fast as possible */
+static uint64_t replay_due_usec(struct joystick_replay *replay,
+                                struct js_event *event)
+{
+    if (replay->speed == 0)
+        return 0;
+    /* the js_event times are in ms and wrap around */
+    return replay->start_usec +
+           (uint32_t)(event->time - replay->first_time) * 1000ULL /
+           replay->speed;
 }
 
-int joystick_start(char *path, struct joystick *joystick)
+uint64_t joystick_replay_next_usec(struct joystick *joystick)
 {
+    struct joystick_replay *replay = &joystick->replay;
+
+    if (replay->offset == replay->len)
+        return 0;
+    return replay_due_usec(replay, &replay->events[replay->offset]);
+}
+
+/*
+ * The recorded session is read ahead by batches, the events that are due
+ * are handled as one frame, stamped with the time they are replayed at so
+ * that the input to wire latency is measured like with a device.
+ */
+static int replay_process_events(struct joystick *joystick)
+{
+    struct joystick_replay *replay = &joystick->replay;
+    uint64_t now = timebase_now_usec();
+    unsigned int first;
     int ret;
-    pthread_attr_t attr;
-    uint8_t n_axes, n_buttons;
 
-    memset(joystick, 0, sizeof(struct joystick));
-    memcpy(&joystick->pwms, &def_pwms, sizeof(joystick->pwms));
+    if (replay->offset == replay->len) {
+        ret = read(joystick->fd, replay->events, sizeof(replay->events));
+        if (ret == -1) {
+            if (errno == EINTR)
+                return 0;
+            perror("replay_process_events - read");
+            return -1;
+        } else if (ret < (int) sizeof(replay->events[0])) {
+            fprintf(stderr, "end of replay\n");
+            return -1;
+        }
+        /* a truncated last event is ignored */
+        replay->len = ret / sizeof(replay->events[0]);
+        replay->offset = 0;
+        joystick_count_read(joystick, replay->len);
+        if (!replay->started) {
+            replay->started = 1;
+            replay->start_usec = now;
+            replay->first_time = replay->events[0].time;
+        }
+    }
 
-    joystick->fd = open(path, O_RDONLY);
+    first = replay->offset;
+    while (replay->offset < replay->len &&
+           replay_due_usec(replay, &replay->events[replay->offset]) <= now) {
+        replay->offset++;
+        /* as fast as possible still keeps the recorded frames */
+        if (replay->speed == 0 && replay->offset < replay->len &&
+            replay->events[replay->offset].time != replay->events[first].time)
+            break;
+    }
+    if (replay->offset == first)
+        return 0;
+    if (joystick->recorder != NULL)
+        recorder_push_js_events(joystick->recorder, now,
+                                &replay->events[first], replay->offset - first);
+    joydev_handle_events(joystick, &replay->events[first],
+                         replay->offset - first);
 
-    if (joystick->fd == -1) {
-        perror("joystick_start - open");
+    return joystick_frame_end(joystick, now);
+}
+
+/* scales an evdev axis to the joydev range using the kernel calibration */
+static int16_t evdev_scale_axis(struct joystick_evdev *evdev,
+                                uint16_t code, int32_t value)
+{
+    int64_t scaled;
+
+    if (evdev->abs_range[code] <= 0)
+        return 0;
+    scaled = (int64_t)(value - evdev->abs_min[code]) * 65534 /
+             evdev->abs_range[code] - 32767;
+    if (scaled < -32767)
+        scaled = -32767;
+    else if (scaled > 32767)
+        scaled = 32767;
+
+    return scaled;
+}
+
+#define BITS_PER_LONG (sizeof(long) * 8)
+#define NLONGS(x) (((x) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define TEST_BIT(bit, array) \
+    ((array[(bit) / BITS_PER_LONG] >> ((bit) % BITS_PER_LONG)) & 1)
+
+/*
+ * reads the current value of all the axes and buttons, after an open or a
+ * SYN_DROPPED
+ */
+static int evdev_sync_state(struct joystick *joystick)
+{
+    struct joystick_evdev *evdev = &joystick->evdev;
+    unsigned long key_state[NLONGS(KEY_CNT)] = {0};
+    struct input_absinfo absinfo;
+    uint8_t number, value;
+    uint16_t code;
+
+    for (code = 0; code < ABS_CNT; code++) {
+        if (evdev->abs_map[code] == JOYSTICK_EVDEV_UNMAPPED)
+            continue;
+        if (ioctl(joystick->fd, EVIOCGABS(code), &absinfo) == -1) {
+            perror("evdev_sync_state - EVIOCGABS");
+            return -1;
+        }
+        evdev->abs_min[code] = absinfo.minimum;
+        evdev->abs_range[code] = absinfo.maximum - absinfo.minimum;
+        joystick_frame_axis(joystick, evdev->abs_map[code],
+                            evdev_scale_axis(evdev, code, absinfo.value));
+    }
+    if (ioctl(joystick->fd, EVIOCGKEY(sizeof(key_state)), key_state) == -1) {
+        perror("evdev_sync_state - EVIOCGKEY");
+        return -1;
+    }
+    /* only the buttons which changed, a held mode button isn't pressed again */
+    for (code = 0; code < KEY_CNT; code++) {
+        number = evdev->key_map[code];
+        if (number == JOYSTICK_EVDEV_UNMAPPED)
+            continue;
+        value = TEST_BIT(code, key_state);
+        if (number < JOYSTICK_NUM_RAW_BUTTONS &&
+            value == ((joystick->state.buttons >> number) & 1))
+            continue;
+        joystick_frame_button(joystick, number, value);
+    }
+
+    return 0;
+}
+
+/*
+ * evdev groups the events in frames terminated by a SYN_REPORT, the frame
+ * is only published when it is complete, a partial frame at the end of the
+ * read is kept for the next one.
+ */
+static int evdev_process_events(struct joystick *joystick)
+{
+    struct joystick_evdev *evdev = &joystick->evdev;
+    struct input_event events[JOYSTICK_EVENT_BATCH];
+    unsigned int i, n;
+    uint64_t event_usec;
+    int changed = 0;
+    int ret;
+
+    ret = read(joystick->fd, events, sizeof(events));
+    if (ret == -1) {
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+        perror("evdev_process_events - read");
+        return -1;
+    } else if (ret == 0 || ret % sizeof(events[0]) != 0) {
+        fprintf(stderr, "joystick disconnected\n");
         return -1;
     }
+    n = ret / sizeof(events[0]);
+    joystick_count_read(joystick, n);
+    if (joystick->recorder != NULL)
+        recorder_push_input_events(joystick->recorder, events, n);
+
+    for (i = 0; i < n; i++) {
+        struct input_event *event = &events[i];
+
+        if (event->type == EV_SYN && event->code == SYN_DROPPED) {
+            /* the kernel buffer overflowed, drop until the next report */
+            memset(&joystick->frame, 0, sizeof(joystick->frame));
+            evdev->dropped = 1;
+            continue;
+        }
+        if (event->type == EV_SYN && event->code == SYN_REPORT) {
+            if (evdev->dropped) {
+                evdev->dropped = 0;
+                if (evdev_sync_state(joystick) == -1)
+                    return -1;
+                /* the buttons of the discarded frame are already in the state */
+                joystick->frame.changed = 1;
+            }
+            /* timestamps are CLOCK_MONOTONIC, see evdev_open */
+            event_usec = event->input_event_sec * 1000000ULL +
+                         event->input_event_usec;
+            changed |= joystick_frame_end(joystick, event_usec);
+            continue;
+        }
+        if (evdev->dropped)
+            continue;
+
+        switch (event->type) {
+        case EV_ABS:
+            if (event->code >= ABS_CNT ||
+                evdev->abs_map[event->code] == JOYSTICK_EVDEV_UNMAPPED)
+                break;
+            joystick_frame_axis(joystick, evdev->abs_map[event->code],
+                                evdev_scale_axis(evdev, event->code,
+                                                 event->value));
+            break;
+        case EV_KEY:
+            if (event->code >= KEY_CNT ||
+                evdev->key_map[event->code] == JOYSTICK_EVDEV_UNMAPPED)
+                break;
+            joystick_frame_button(joystick, evdev->key_map[event->code],
+                                  event->value);
+            break;
+        }
+    }
+
+    return changed;
+}
+
+int joystick_process_events(struct joystick *joystick)
+{
+    if (joystick->source == JOYSTICK_SOURCE_REPLAY)
+        return replay_process_events(joystick);
+
+    switch (joystick->backend) {
+    case JOYSTICK_BACKEND_EVDEV:
+        return evdev_process_events(joystick);
+    case JOYSTICK_BACKEND_JOYDEV:
+    default:
+        return joydev_process_events(joystick);
+    }
+}
+
+/*
+ * sleeps until the next recorded event is due, instead of polling, or at
+ * speed 0 until the last state published has been read
+ */
+static int replay_wait(struct joystick *joystick)
+{
+    uint64_t next_usec = joystick_replay_next_usec(joystick);
+    struct joystick_replay *replay = &joystick->replay;
+
+    uint32_t read_seq;
+
+    if (replay->speed == 0) {
+        /*
+         * sleeps on a futex, a SCHED_FIFO reader spinning would starve a
+         * lower priority sender on the same cpu. read_waiting and read_seq
+         * are seq_cst, either the sender sees the flag or this sees the seq.
+         */
+        while ((read_seq = __atomic_load_n(&replay->read_seq,
+                                           __ATOMIC_ACQUIRE)) !=
+               joystick->shared.seq) {
+            __atomic_store_n(&replay->read_waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&replay->read_seq, __ATOMIC_SEQ_CST) == read_seq &&
+                syscall(SYS_futex, &replay->read_seq, FUTEX_WAIT_PRIVATE,
+                        read_seq, NULL, NULL, 0) == -1 &&
+                errno != EAGAIN && errno != EINTR) {
+                perror("replay_wait - futex");
+                return -1;
+            }
+            __atomic_store_n(&replay->read_waiting, 0, __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+    if (next_usec == 0)
+        return 0;
+
+    return timebase_sleep_until(next_usec);
+}
+
+/* waits for events on a device or a stream, no timeout */
+static int joystick_poll(struct pollfd *pollfd)
+{
+    int ret;
+
+    ret = poll(pollfd, 1, -1);
+    if (ret == -1) {
+        if (errno == EINTR)
+            return 0;
+        perror("joystick_poll - poll");
+        return -1;
+    } else if (ret == 0) {
+        fprintf(stderr, "joystick_poll : unexpected timeout\n");
+        return -1;
+    } else if ((pollfd->revents & POLLHUP) && !(pollfd->revents & POLLIN)) {
+        /* the events still buffered in a stream are read first */
+        fprintf(stderr, "joystick disconnected\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the device is gone, blocks until it is back */
+static int joystick_wait_reconnect(struct joystick *joystick)
+{
+    struct pollfd pollfd;
+    int ret;
+
+    pollfd.fd = joystick->hotplug.inotify_fd;
+    pollfd.events = POLLIN;
+    while ((ret = joystick_reconnect(joystick)) == 0) {
+        if (joystick_poll(&pollfd) == -1)
+            return -1;
+    }
+
+    return ret;
+}
+
+static void *joystick_thread(void *arg)
+{
+    struct pollfd pollfd;
+    struct joystick *joystick = (struct joystick *) arg;
+    int ret;
+    
+    /* not on the first event */
+    log_register_thread();
+    log_printf(LOG_JOYSTICK, LOG_INFO, "starting joystick event listener\n");
+
+    pollfd.fd = joystick->fd;
+    pollfd.events = POLLIN | POLLHUP;
+
+    while (1) {
+        /* regular files are always readable, replays sleep instead */
+        if (joystick->source == JOYSTICK_SOURCE_REPLAY)
+            ret = replay_wait(joystick);
+        else
+            ret = joystick_poll(&pollfd);
+        if (ret != -1)
+            ret = joystick_process_events(joystick);
+        if (ret == 1) {
+            joystick_notify_change(joystick);
+        } else if (ret == -1) {
+            /* only the devices come back, the streams and replays end */
+            if (joystick_disconnect(joystick) == -1 ||
+                joystick_wait_reconnect(joystick) == -1)
+                break;
+            pollfd.fd = joystick->fd;
+        }
+    }
+    
+    exit(EXIT_SUCCESS);
+
+    return NULL;
+}
+
+static int joydev_open(struct joystick *joystick)
+{
+    int ret;
+    uint8_t n_axes, n_buttons;
 
     ret = ioctl(joystick->fd, JSIOCGNAME(sizeof(joystick->name)),
                 &joystick->name);
     if (ret == -1) {
-        perror("joystick_start - JSIOCGNAME");
+        perror("joydev_open - JSIOCGNAME");
         return -1;
     }
-    debug_printf("Joystick : %s\n", joystick->name);
+    log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick : %s\n", joystick->name);
 
     ret = ioctl(joystick->fd, JSIOCGAXES, &n_axes);
     if (ret == -1) {
-        perror("joystick_start - JSIOCGAXES");
+        perror("joydev_open - JSIOCGAXES");
         return -1;
     }
-    debug_printf("Joystick has %d axes\n", n_axes);
+    log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick has %d axes\n", n_axes);
 
     ret = ioctl(joystick->fd, JSIOCGBUTTONS, &n_buttons);
     if (ret == -1) {
-        perror("joystick_start - JSIOCGBUTTONS");
+        perror("joydev_open - JSIOCGBUTTONS");
         return -1;
     }
-    debug_printf("Joystick has %d buttons\n", n_buttons);
-    ret = pthread_mutex_init(&joystick->mutex, NULL);
-    if (ret != 0) {
-        perror("joystick_start - pthread_mutex_init");
+    log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick has %d buttons\n", n_buttons);
+
+    return 0;
+}
+
+/*
+ * Numbers the axes and buttons the same way joydev does, so that the
+ * joystick types mappings apply to both backends.
+ */
+static int evdev_open(struct joystick *joystick)
+{
+    struct joystick_evdev *evdev = &joystick->evdev;
+    unsigned long abs_bits[NLONGS(ABS_CNT)] = {0};
+    unsigned long key_bits[NLONGS(KEY_CNT)] = {0};
+    int clock_id = CLOCK_MONOTONIC;
+    unsigned int n_axes = 0, n_buttons = 0;
+    unsigned int code;
+
+    if (ioctl(joystick->fd, EVIOCGNAME(sizeof(joystick->name)),
+              joystick->name) == -1) {
+        perror("evdev_open - EVIOCGNAME");
         return -1;
     }
-    ret = pthread_attr_init(&attr);
-    if (ret != 0) {
-        perror("joystick_start - pthread_attr_init");
+    log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick : %s\n", joystick->name);
+
+    /* timestamp the events on the same clock as the sender */
+    if (ioctl(joystick->fd, EVIOCSCLOCKID, &clock_id) == -1) {
+        perror("evdev_open - EVIOCSCLOCKID");
+        return -1;
+    }
+
+    if (ioctl(joystick->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits) == -1 ||
+        ioctl(joystick->fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) == -1) {
+        perror("evdev_open - EVIOCGBIT");
+        return -1;
+    }
+
+    memset(evdev->abs_map, JOYSTICK_EVDEV_UNMAPPED, sizeof(evdev->abs_map));
+    memset(evdev->key_map, JOYSTICK_EVDEV_UNMAPPED, sizeof(evdev->key_map));
+    for (code = 0; code < ABS_CNT; code++) {
+        if (TEST_BIT(code, abs_bits))
+            evdev->abs_map[code] = n_axes++;
+    }
+    /* joydev numbers the joystick buttons first */
+    for (code = BTN_MISC; code < KEY_CNT; code++) {
+        if (TEST_BIT(code, key_bits) && n_buttons < JOYSTICK_MAX_EVENT_NUMBER)
+            evdev->key_map[code] = n_buttons++;
+    }
+    for (code = 0; code < BTN_MISC; code++) {
+        if (TEST_BIT(code, key_bits) && n_buttons < JOYSTICK_MAX_EVENT_NUMBER)
+            evdev->key_map[code] = n_buttons++;
+    }
+    log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick has %d axes\n", n_axes);
+    log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick has %d buttons\n", n_buttons);
+
+    /* initial state, like the JS_EVENT_INIT events of joydev */
+    if (evdev_sync_state(joystick) == -1)
+        return -1;
+    joystick_frame_end(joystick, 0);
+
+    return 0;
+}
+
+int joystick_attach(int fd, char *type, enum joystick_backend backend,
+                    struct joystick *joystick)
+{
+    int i;
+
+    memset(joystick, 0, sizeof(struct joystick));
+    memcpy(&joystick->state.pwms, &def_pwms, sizeof(joystick->state.pwms));
+    memcpy(&joystick->shared.state.pwms, &def_pwms,
+           sizeof(joystick->shared.state.pwms));
+    joystick->fd = fd;
+    joystick->change_fd = -1;
+    joystick->backend = backend;
+    joystick->source = JOYSTICK_SOURCE_STREAM;
+    joystick->replay.speed = 1;
+    joystick->hotplug.failsafe = JOYSTICK_FAILSAFE_NEUTRAL;
+    joystick->hotplug.inotify_fd = -1;
+    strncpy(joystick->hotplug.type, type, sizeof(joystick->hotplug.type) - 1);
+    histogram_init(&joystick->hotplug.recover_time, "time to recover (us)");
+    for (i = 0; i < JOYSTICK_NUM_AXIS; i++)
+        curve_default_config(&joystick->curve_configs[i]);
+
+    /* the mapping is only read by the joystick thread, set it before */
+    if (joystick_set_type(joystick, type) == -1) {
+        fprintf(stderr, "joystick_attach : bad joystick type %s\n", type);
         return -1;
     }
-    ret = pthread_create(&joystick->thread, &attr, &joystick_thread, joystick);
+
+    return 0;
+}
+
+int joystick_open(char *path, char *type, enum joystick_backend backend,
+                  struct joystick *joystick)
+{
+    struct stat st;
+    int fd;
+
+    /* non blocking so that events can be read from an event loop */
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+
+    if (fd == -1) {
+        perror("joystick_open - open");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("joystick_open - fstat");
+        goto err_close;
+    }
+    if (joystick_attach(fd, type, backend, joystick) == -1)
+        goto err_close;
+
+    if (S_ISCHR(st.st_mode)) {
+        joystick->source = JOYSTICK_SOURCE_DEVICE;
+        strncpy(joystick->hotplug.path, path, sizeof(joystick->hotplug.path) - 1);
+    } else {
+        joystick->source = S_ISREG(st.st_mode) ? JOYSTICK_SOURCE_REPLAY :
+                                                 JOYSTICK_SOURCE_STREAM;
+        /* without the device, there is no evdev calibration */
+        if (backend != JOYSTICK_BACKEND_JOYDEV) {
+            fprintf(stderr, "joystick_open : %s is not a device, "
+                    "only js_event streams are supported\n", path);
+            goto err_close;
+        }
+        strncpy(joystick->name, path, sizeof(joystick->name) - 1);
+        log_printf(LOG_JOYSTICK, LOG_INFO, "Joystick : %s, %s\n",
+                   joystick->name, joystick->source == JOYSTICK_SOURCE_REPLAY ?
+                   "replayed" : "streamed");
+        return 0;
+    }
+
+    switch (backend) {
+    case JOYSTICK_BACKEND_EVDEV:
+        if (evdev_open(joystick) == -1)
+            goto err_close;
+        break;
+    case JOYSTICK_BACKEND_JOYDEV:
+    default:
+        if (joydev_open(joystick) == -1)
+            goto err_close;
+        break;
+    }
+
+    return 0;
+err_close:
+    close(fd);
+    return -1;
+}
+
+void joystick_set_replay_speed(struct joystick *joystick, unsigned int speed)
+{
+    joystick->replay.speed = speed;
+}
+
+int joystick_start(struct joystick *joystick, const pthread_attr_t *attr)
+{
+    int ret;
+
+    ret = pthread_create(&joystick->thread, attr, &joystick_thread, joystick);
     if (ret != 0) {
+        errno = ret;
         perror("joystick_start - pthread_create");
         return -1;
     }
@@ -221,21 +836,200 @@ int joystick_start(char *path, struct joystick *joystick)
     return 0;
 }
 
-void joystick_get_pwms(struct joystick *joystick, uint16_t *pwms, uint8_t *len)
+void joystick_get_state(struct joystick *joystick, struct joystick_state *state)
 {
-    pthread_mutex_lock(&joystick->mutex);
-    *len = sizeof(joystick->pwms);
-    memcpy(pwms, &joystick->pwms, *len);
-    pthread_mutex_unlock(&joystick->mutex);
+    const uint32_t *src = (const uint32_t *) &joystick->shared.state;
+    uint32_t *dst = (uint32_t *) state;
+    uint32_t seq;
+    unsigned int i;
+
+    while (1) {
+        seq = __atomic_load_n(&joystick->shared.seq, __ATOMIC_ACQUIRE);
+        if (!(seq & 1)) {
+            for (i = 0; i < sizeof(*state) / sizeof(*src); i++)
+                dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&joystick->shared.seq, __ATOMIC_RELAXED) == seq)
+                break;
+        }
+        __atomic_fetch_add(&joystick->shared.retries, 1, __ATOMIC_RELAXED);
+    }
+    /* paces the replays at speed 0, speed is set before the thread starts */
+    if (joystick->source == JOYSTICK_SOURCE_REPLAY && joystick->replay.speed == 0) {
+        __atomic_store_n(&joystick->replay.read_seq, seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&joystick->replay.read_waiting, __ATOMIC_SEQ_CST))
+            syscall(SYS_futex, &joystick->replay.read_seq, FUTEX_WAKE_PRIVATE,
+                    1, NULL, NULL, 0);
+    }
 
     return;
 }
 
-int joystick_set_type(struct joystick *joystick, char *type)
+uint64_t joystick_get_retries(struct joystick *joystick)
+{
+    return __atomic_load_n(&joystick->shared.retries, __ATOMIC_RELAXED);
+}
+
+void joystick_get_read_stats(struct joystick *joystick,
+                             uint64_t *events, uint64_t *reads)
+{
+    *events = metrics_get(&joystick->counters, METRICS_EVENTS);
+    *reads = metrics_get(&joystick->counters, METRICS_READS);
+}
+
+int joystick_enable_change_notify(struct joystick *joystick)
+{
+    int fd;
+
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd == -1) {
+        perror("joystick_enable_change_notify - eventfd");
+        return -1;
+    }
+    /* the joystick thread may already be running */
+    __atomic_store_n(&joystick->change_fd, fd, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+void joystick_share_change_notify(struct joystick *joystick,
+                                  const struct joystick *notified)
+{
+    __atomic_store_n(&joystick->change_fd, notified->change_fd,
+                     __ATOMIC_RELAXED);
+}
+
+int joystick_wait_change(struct joystick *joystick, uint64_t timeout_usec)
+{
+    struct pollfd pollfd;
+    struct timespec ts;
+    uint64_t count;
+    int ret;
+
+    pollfd.fd = joystick->change_fd;
+    pollfd.events = POLLIN;
+    timebase_usec_to_timespec(timeout_usec, &ts);
+
+    ret = ppoll(&pollfd, 1, &ts, NULL);
+    if (ret == -1) {
+        if (errno == EINTR)
+            return 0;
+        perror("joystick_wait_change - ppoll");
+        return -1;
+    } else if (ret == 0) {
+        return 0;
+    }
+    /* reset the counter, several changes are sent in a single packet */
+    if (read(joystick->change_fd, &count, sizeof(count)) == -1 &&
+        errno != EAGAIN) {
+        perror("joystick_wait_change - read");
+        return -1;
+    }
+
+    return 1;
+}
+
+/* compiles the curves and publishes them to the joystick thread */
+static int joystick_compile_curves(struct joystick *joystick)
+{
+    struct joystick_curves *curves, *old_curves;
+    struct timespec pause = {0, 100000};
+    uint32_t seq;
+    int i;
+
+    curves = malloc(sizeof(*curves));
+    if (curves == NULL) {
+        perror("joystick_compile_curves - malloc");
+        return -1;
+    }
+    for (i = 0; i < JOYSTICK_NUM_AXIS; i++)
+        curve_compile(&joystick->curve_configs[i],
+                      joystick->axes[i].direction, &curves->curves[i]);
+
+    old_curves = __atomic_exchange_n(&joystick->curves, curves,
+                                     __ATOMIC_SEQ_CST);
+    /*
+     * grace period : a frame in progress may still use the old curves,
+     * the next frames load the new ones. A frame takes a few us, but the
+     * joystick thread may be preempted in the middle.
+     */
+    seq = __atomic_load_n(&joystick->curves_seq, __ATOMIC_SEQ_CST);
+    while ((seq & 1) &&
+           __atomic_load_n(&joystick->curves_seq, __ATOMIC_ACQUIRE) == seq)
+        nanosleep(&pause, NULL);
+    free(old_curves);
+
+    return 0;
+}
+
+/*
+ * Each line of the file configures a channel, e.g.
+ * roll deadband=500 expo=30 trim=-10 min=1100 max=1900 reverse=0
+ * Unspecified options and channels keep their default values.
+ */
+int joystick_load_curves(struct joystick *joystick, const char *path)
+{
+    static const char *channels[JOYSTICK_NUM_AXIS] = {
+        "roll", "pitch", "throttle", "yaw"
+    };
+    struct curve_config configs[JOYSTICK_NUM_AXIS];
+    char line[256], *token, *saveptr;
+    int i, channel, line_number = 0;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror("joystick_load_curves - fopen");
+        return -1;
+    }
+    for (i = 0; i < JOYSTICK_NUM_AXIS; i++)
+        curve_default_config(&configs[i]);
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        token = strtok_r(line, " \t\n", &saveptr);
+        if (token == NULL || token[0] == '#')
+            continue;
+        channel = -1;
+        for (i = 0; i < JOYSTICK_NUM_AXIS; i++) {
+            if (!strcmp(token, channels[i]))
+                channel = i;
+        }
+        if (channel == -1) {
+            fprintf(stderr, "%s:%d : unknown channel %s\n",
+                    path, line_number, token);
+            goto err;
+        }
+        while ((token = strtok_r(NULL, " \t\n", &saveptr)) != NULL) {
+            if (curve_parse_option(&configs[channel], token) == -1) {
+                fprintf(stderr, "%s:%d : bad option %s\n",
+                        path, line_number, token);
+                goto err;
+            }
+        }
+        if (curve_check_config(&configs[channel]) == -1) {
+            fprintf(stderr, "%s:%d : min %u, center %d and max %u "
+                    "are not in order\n", path, line_number,
+                    configs[channel].min,
+                    CURVE_PWM_CENTER + configs[channel].trim,
+                    configs[channel].max);
+            goto err;
+        }
+    }
+    fclose(file);
+
+    memcpy(joystick->curve_configs, configs, sizeof(configs));
+    return joystick_compile_curves(joystick);
+err:
+    fclose(file);
+    return -1;
+}
+
+/* only the tables read by the joystick thread, not the curves */
+static int joystick_map_type(struct joystick *joystick, const char *type)
 {
-    int ret = 0;
+    int i;
 
-    pthread_mutex_lock(&joystick->mutex);
     if (!strcmp(type, "x") || !strcmp(type, "xbox360")) {
         memcpy(&joystick->buttons, xbox360_buttons, sizeof(joystick->buttons));
         memcpy(&joystick->axes, xbox360_axes, sizeof(joystick->axes));
@@ -246,10 +1040,158 @@ int joystick_set_type(struct joystick *joystick, char *type)
         memcpy(&joystick->buttons, ps3_buttons, sizeof(joystick->buttons));
         memcpy(&joystick->axes, ps3_axes, sizeof(joystick->axes));
     } else {
-        debug_printf("bad joystick type\n");
-        ret = -1;
+        log_printf(LOG_JOYSTICK, LOG_INFO, "bad joystick type\n");
+        return -1;
     }
-    pthread_mutex_unlock(&joystick->mutex);
-    return ret;
+
+    /* number to channel dispatch tables, the first mapping wins */
+    memset(joystick->axis_channels, -1, sizeof(joystick->axis_channels));
+    for (i = JOYSTICK_NUM_AXIS - 1; i >= 0; i--)
+        joystick->axis_channels[joystick->axes[i].number] = i;
+    memset(joystick->button_modes, -1, sizeof(joystick->button_modes));
+    for (i = JOYSTICK_NUM_MODES - 1; i >= 0; i--)
+        joystick->button_modes[joystick->buttons[i]] = i;
+
+    return 0;
+}
+
+int joystick_set_type(struct joystick *joystick, char *type)
+{
+    if (joystick_map_type(joystick, type) == -1)
+        return -1;
+
+    return joystick_compile_curves(joystick);
 }
     
+
+void joystick_set_recorder(struct joystick *joystick,
+                           struct recorder_ring *recorder)
+{
+    joystick->recorder = recorder;
+}
+
+void joystick_set_failsafe(struct joystick *joystick,
+                           enum joystick_failsafe failsafe)
+{
+    joystick->hotplug.failsafe = failsafe;
+}
+
+void joystick_set_tracking(struct joystick *joystick, uint8_t enabled)
+{
+    joystick->track_sticks = enabled;
+}
+
+int joystick_disconnect(struct joystick *joystick)
+{
+    struct joystick_hotplug *hotplug = &joystick->hotplug;
+    char dir[PATH_MAX];
+    int i;
+
+    if (joystick->source != JOYSTICK_SOURCE_DEVICE)
+        return -1;
+    close(joystick->fd);
+    joystick->fd = -1;
+    hotplug->disconnect_usec = timebase_now_usec();
+    metrics_add(&joystick->counters, METRICS_DISCONNECTS, 1);
+    fprintf(stderr, "joystick : waiting for %s to come back\n", hotplug->path);
+
+    /* a partial frame would be mixed with the first events of the new fd */
+    memset(&joystick->frame, 0, sizeof(joystick->frame));
+    joystick->evdev.dropped = 0;
+    /* nothing to extrapolate from a stick which is gone */
+    memset(joystick->state.rates, 0, sizeof(joystick->state.rates));
+    memset(joystick->tracks, 0, sizeof(joystick->tracks));
+    if (hotplug->failsafe == JOYSTICK_FAILSAFE_NEUTRAL) {
+        /* a mode or button pwm of 1500 could switch the flight mode */
+        joystick->state.pwms.roll = def_pwms.roll;
+        joystick->state.pwms.pitch = def_pwms.pitch;
+        joystick->state.pwms.throttle = def_pwms.throttle;
+        joystick->state.pwms.yaw = def_pwms.yaw;
+        for (i = 0; i < JOYSTICK_NUM_AXIS; i++)
+            joystick->state.axes[joystick->axes[i].number] = 0;
+        joystick_publish(joystick, hotplug->disconnect_usec);
+        joystick_notify_change(joystick);
+    }
+
+    /* the node and its by-id links are created by udev in that directory */
+    strcpy(dir, hotplug->path);
+    hotplug->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (hotplug->inotify_fd == -1) {
+        perror("joystick_disconnect - inotify_init1");
+        return -1;
+    }
+    if (inotify_add_watch(hotplug->inotify_fd, dirname(dir),
+                          IN_CREATE | IN_ATTRIB | IN_MOVED_TO) == -1) {
+        perror("joystick_disconnect - inotify_add_watch");
+        close(hotplug->inotify_fd);
+        hotplug->inotify_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the device may be there but not usable yet, e.g. before udev chmods it */
+static int joystick_reopen(struct joystick *joystick)
+{
+    int ret;
+
+    joystick->fd = open(joystick->hotplug.path, O_RDONLY | O_NONBLOCK);
+    if (joystick->fd == -1) {
+        log_printf(LOG_JOYSTICK, LOG_INFO, "joystick_reopen : %s\n",
+                   strerror(errno));
+        return 0;
+    }
+    switch (joystick->backend) {
+    case JOYSTICK_BACKEND_EVDEV:
+        ret = evdev_open(joystick);
+        break;
+    case JOYSTICK_BACKEND_JOYDEV:
+    default:
+        ret = joydev_open(joystick);
+        break;
+    }
+    if (ret == -1) {
+        close(joystick->fd);
+        joystick->fd = -1;
+        return 0;
+    }
+
+    return 1;
+}
+
+int joystick_reconnect(struct joystick *joystick)
+{
+    struct joystick_hotplug *hotplug = &joystick->hotplug;
+    char events[4096]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    int ret;
+
+    /* the device is tried on any change, an open is cheap */
+    while ((ret = read(hotplug->inotify_fd, events, sizeof(events))) > 0)
+        ;
+    if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+        perror("joystick_reconnect - read");
+        return -1;
+    }
+    if (joystick_reopen(joystick) == 0)
+        return 0;
+
+    /*
+     * The mapping is set again for the new fd, the curves don't depend on
+     * the device and may be reloaded concurrently, they are kept.
+     */
+    if (joystick_map_type(joystick, hotplug->type) == -1) {
+        close(joystick->fd);
+        joystick->fd = -1;
+        return -1;
+    }
+    close(hotplug->inotify_fd);
+    hotplug->inotify_fd = -1;
+    histogram_record(&hotplug->recover_time,
+                     timebase_now_usec() - hotplug->disconnect_usec);
+    metrics_add(&joystick->counters, METRICS_RECONNECTS, 1);
+    fprintf(stderr, "joystick : %s is back\n", hotplug->path);
+
+    return 1;
+}
@@ -18,8 +18,25 @@
 
 #ifndef _JOYSTICK_H_
 #define _JOYSTICK_H_
+#include <limits.h>
+#include <linux/input.h>
+#include <linux/joystick.h>
+#include "curve.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "predictor.h"
+
+struct recorder_ring;
 
 #define MAX_NAME_LEN 128
+/* max number of events read with a single read() */
+#define JOYSTICK_EVENT_BATCH 64
+/* js_event.number is an uint8_t */
+#define JOYSTICK_MAX_EVENT_NUMBER 256
+#define JOYSTICK_EVDEV_UNMAPPED 0xff
+/* raw axes and buttons published for the mixer */
+#define JOYSTICK_NUM_RAW_AXES 16
+#define JOYSTICK_NUM_RAW_BUTTONS 32
 
 enum {
     JOYSTICK_AXIS_ROLL,
@@ -39,6 +56,7 @@ enum {
     JOYSTICK_NUM_MODES
 };
 
+/* the axes fields are in the JOYSTICK_AXIS_* order */
 struct joystick_pwms {
     uint16_t roll;
     uint16_t pitch;
@@ -47,19 +65,134 @@ struct joystick_pwms {
     uint16_t mode;
 };
 
+/* published by the joystick thread, copied as 32 bits words */
+struct joystick_state {
+    struct joystick_pwms pwms;
+    int16_t axes[JOYSTICK_NUM_RAW_AXES];
+    /* bit n is set while button n is pressed */
+    uint32_t buttons;
+    /* CLOCK_MONOTONIC time of the last change, 0 if unknown */
+    uint64_t event_usec;
+    /* pwm us per second of each stick channel, at the time of its last event */
+    int32_t rates[JOYSTICK_NUM_AXIS];
+    uint64_t axis_usec[JOYSTICK_NUM_AXIS];
+    /* curve endpoints of each stick channel, the bounds of the prediction */
+    uint16_t pwm_min[JOYSTICK_NUM_AXIS];
+    uint16_t pwm_max[JOYSTICK_NUM_AXIS];
+} __attribute__((aligned(8)));
+
 struct joystick_axis {
     uint8_t number;
     /* 1 or -1 */
     int8_t direction;
 };
 
+enum joystick_backend {
+    /* legacy /dev/input/jsN api */
+    JOYSTICK_BACKEND_JOYDEV,
+    /* /dev/input/eventN, SYN_REPORT delimited frames */
+    JOYSTICK_BACKEND_EVDEV,
+};
+
+enum joystick_source {
+    /* character device, queried with the backend ioctls */
+    JOYSTICK_SOURCE_DEVICE,
+    /* pipe or socket streaming events in the backend format */
+    JOYSTICK_SOURCE_STREAM,
+    /* regular file of recorded js_event, paced by their timestamps */
+    JOYSTICK_SOURCE_REPLAY,
+};
+
+struct joystick_replay {
+    /*
+     * 1 replays in real time, N N times faster, 0 as fast as the states
+     * are read, one recorded timestamp at a time
+     */
+    unsigned int speed;
+    /* CLOCK_MONOTONIC time at which the first event was replayed */
+    uint64_t start_usec;
+    uint32_t first_time;
+    uint8_t started;
+    struct js_event events[JOYSTICK_EVENT_BATCH];
+    unsigned int len;
+    unsigned int offset;
+    /* last seq read by joystick_get_state, when replaying at speed 0 */
+    uint32_t read_seq __attribute__((aligned(64)));
+    /* set while the joystick thread sleeps on the read_seq futex */
+    uint32_t read_waiting;
+};
+
+enum joystick_failsafe {
+    /* the last state read keeps being sent */
+    JOYSTICK_FAILSAFE_HOLD,
+    /* centered sticks, the mode and the buttons are kept as they were */
+    JOYSTICK_FAILSAFE_NEUTRAL,
+};
+
+/* reopens an unplugged device when it shows up again */
+struct joystick_hotplug {
+    char path[PATH_MAX];
+    char type[32];
+    enum joystick_failsafe failsafe;
+    /* watches the directory of path while disconnected, -1 otherwise */
+    int inotify_fd;
+    uint64_t disconnect_usec;
+    struct histogram recover_time;
+};
+
+struct joystick_curves {
+    struct curve curves[JOYSTICK_NUM_AXIS];
+};
+
+/* events not yet published, see joystick_frame_end */
+struct joystick_frame {
+    int16_t axis_values[JOYSTICK_MAX_EVENT_NUMBER];
+    uint64_t dirty_axes[JOYSTICK_MAX_EVENT_NUMBER / 64];
+    int changed;
+};
+
+struct joystick_evdev {
+    /* evdev codes to joydev numbers */
+    uint8_t abs_map[ABS_CNT];
+    uint8_t key_map[KEY_CNT];
+    /* kernel calibration, from EVIOCGABS */
+    int32_t abs_min[ABS_CNT];
+    int32_t abs_range[ABS_CNT];
+    /* events are dropped until the next SYN_REPORT */
+    uint8_t dropped;
+};
+
+/* state published by the joystick thread, protected by a seqlock */
+struct joystick_shared {
+    /* odd while the joystick thread is updating the state */
+    uint32_t seq;
+    struct joystick_state state;
+    /* number of times joystick_get_state raced with an update */
+    uint64_t retries;
+} __attribute__((aligned(64)));
+
 struct joystick {
     char name[MAX_NAME_LEN];
     int fd;
+    enum joystick_backend backend;
+    enum joystick_source source;
     pthread_t thread;
-    pthread_mutex_t mutex;
+    /* eventfd signaled on state changes, -1 unless change notify is enabled */
+    int change_fd;
+    /* the events read are recorded there, NULL if not recording */
+    struct recorder_ring *recorder;
+    /* events, reads, disconnects and reconnects of the joystick thread */
+    struct metrics_counters counters;
 
-    struct joystick_pwms pwms;
+    /* only accessed by the joystick thread */
+    struct joystick_state state;
+    struct joystick_frame frame;
+    struct joystick_evdev evdev;
+    struct joystick_replay replay;
+    struct joystick_hotplug hotplug;
+    struct predictor_track tracks[JOYSTICK_NUM_AXIS];
+    /* the rates and endpoints are only published for the predictor */
+    uint8_t track_sticks;
 
     /* buttons mapping */
     uint8_t buttons[JOYSTICK_NUM_MODES];
@@ -69,10 +202,81 @@ struct joystick {
     
     /* modes pwm mapping */
     uint16_t mode_pwms[JOYSTICK_NUM_MODES];
+
+    /* axis number to JOYSTICK_AXIS_*, button number to mode, -1 if unmapped */
+    int8_t axis_channels[JOYSTICK_MAX_EVENT_NUMBER];
+    int8_t button_modes[JOYSTICK_MAX_EVENT_NUMBER];
+
+    struct curve_config curve_configs[JOYSTICK_NUM_AXIS];
+    /* compiled from curve_configs, swapped atomically on reload */
+    struct joystick_curves *curves;
+    /* odd while the joystick thread uses the curves, see joystick_frame_end */
+    uint32_t curves_seq;
+
+    struct joystick_shared shared;
 };
 
-int joystick_start(char *path, struct joystick *joystick);
-void joystick_get_pwms(struct joystick *joystick, uint16_t *pwms, uint8_t *len);
+/*
+ * uses an already opened, non blocking, fd streaming events in the backend
+ * format, without querying the device
+ */
+int joystick_attach(int fd, char *type, enum joystick_backend backend,
+                    struct joystick *joystick);
+/*
+ * opens a device, a fifo or a recorded session without starting the
+ * joystick thread, the source is picked from the file type
+ */
+int joystick_open(char *path, char *type, enum joystick_backend backend,
+                  struct joystick *joystick);
+/* starts the joystick thread on an opened joystick, attr may be NULL */
+int joystick_start(struct joystick *joystick, const pthread_attr_t *attr);
+/* must be called before the joystick thread is started, 1 by default */
+void joystick_set_replay_speed(struct joystick *joystick, unsigned int speed);
+/* must be called before the joystick thread is started */
+void joystick_set_recorder(struct joystick *joystick,
+                           struct recorder_ring *recorder);
+/* state sent while the device is unplugged, neutral by default */
+void joystick_set_failsafe(struct joystick *joystick,
+                           enum joystick_failsafe failsafe);
+/* must be called before the joystick thread is started, off by default */
+void joystick_set_tracking(struct joystick *joystick, uint8_t enabled);
+/*
+ * To be called when joystick_process_events fails or the fd hangs up :
+ * closes the device, publishes the failsafe state and watches for the
+ * device to come back. Returns -1 if the source can't come back, that is
+ * if it is not a device. joystick_reconnect must then be called when
+ * hotplug.inotify_fd is readable, and once right away.
+ */
+int joystick_disconnect(struct joystick *joystick);
+/* returns 1 once the device is opened again, 0 if not yet, -1 on error */
+int joystick_reconnect(struct joystick *joystick);
+/*
+ * CLOCK_MONOTONIC time at which the next recorded event is due, 0 if
+ * joystick_process_events should be called right away
+ */
+uint64_t joystick_replay_next_usec(struct joystick *joystick);
+/* reads the pending events, returns 1 if the state changed, 0 if not, -1 on error */
+int joystick_process_events(struct joystick *joystick);
+/*
+ * handles js_events already read as one frame, as joystick_process_events
+ * does after its read, returns 1 if the state changed
+ */
+int joystick_handle_events(struct joystick *joystick,
+                           const struct js_event *events, unsigned int n,
+                           uint64_t event_usec);
+void joystick_get_state(struct joystick *joystick, struct joystick_state *state);
+uint64_t joystick_get_retries(struct joystick *joystick);
+void joystick_get_read_stats(struct joystick *joystick,
+                             uint64_t *events, uint64_t *reads);
+/* must be called before the joystick thread is started */
 int joystick_set_type(struct joystick *joystick, char *type);
+/* can be called at any time to reload the response curves */
+int joystick_load_curves(struct joystick *joystick, const char *path);
+int joystick_enable_change_notify(struct joystick *joystick);
+/* signals the change notifications of notified, one wait covers both */
+void joystick_share_change_notify(struct joystick *joystick,
+                                  const struct joystick *notified);
+/* returns 1 if the state changed, 0 on timeout and -1 on error */
+int joystick_wait_change(struct joystick *joystick, uint64_t timeout_usec);
 
 #endif // _JOYSTICK_H_
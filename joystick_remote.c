@@ -26,15 +26,31 @@
 #include <getopt.h>
 #include <stdint.h>
 #include <time.h>
-#include <stdarg.h>
 #include <string.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
 
 #include "joystick.h"
 #include "remote.h"
-#include "joystick_remote.h"
+#include "mixer.h"
+#include "swarm.h"
+#include "histogram.h"
+#include "rt.h"
+#include "timebase.h"
+#include "pacer.h"
+#include "trainer.h"
+#include "recorder.h"
+#include "log.h"
+#include "metrics.h"
+#include "predictor.h"
 
-static struct timespec start_time;
+/* TIMEBASE_CLOCK time of the start, micro64 times are relative to it */
+static uint64_t start_usec;
+/* the same time on the clock of the packet timestamps */
+static uint64_t stamp_start_usec;
 
 static struct option long_options[] = {
     {"list",      no_argument, 0,           'l' },
@@ -43,86 +59,1040 @@ static struct option long_options[] = {
     {"verbose",   no_argument, 0,           'v' },
     {"remote",    required_argument, 0,     'r' },
     {"type",      required_argument, 0,     't' },
+    {"on-change", no_argument, 0,           's' },
+    {"min-gap",   required_argument, 0,     'g' },
+    {"epoll",     no_argument, 0,           'e' },
+    {"input",     required_argument, 0,     'i' },
+    {"curves",    required_argument, 0,     'C' },
+    {"mixer",     required_argument, 0,     'M' },
+    {"swarm",     required_argument, 0,     'S' },
+    {"speed",     required_argument, 0,     'x' },
+    {"rt",        no_argument, 0,           'R' },
+    {"priorities", required_argument, 0,    'P' },
+    {"affinity",  required_argument, 0,     'A' },
+    {"timestamps", required_argument, 0,    'T' },
+    {"rate",      required_argument, 0,     'a' },
+    {"protocol",  required_argument, 0,     'p' },
+    {"history",   required_argument, 0,     'H' },
+    {"failsafe",  required_argument, 0,     'F' },
+    {"controller", required_argument, 0,    'j' },
+    {"takeover",  required_argument, 0,     'o' },
+    {"channels",  required_argument, 0,     'u' },
+    {"record",    required_argument, 0,     'w' },
+    {"log",       required_argument, 0,     'L' },
+    {"metrics",   required_argument, 0,     'k' },
+    {"predict",   required_argument, 0,     'f' },
+    {"slew",      required_argument, 0,     'b' },
+    {"tx-timestamps", no_argument, 0,       'q' },
+    {"txtime",    required_argument, 0,     'Q' },
+    {"probe",     no_argument, 0,           'E' },
     {"help",      no_argument, 0,           'h' },
     {0, 0, 0, 0 }
 };
 
 static struct joystick joystick;
+/* the student ones, the instructor is joystick */
+static struct joystick controllers[TRAINER_MAX_CONTROLLERS - 1];
+static struct trainer trainer;
+static struct recorder recorder;
+/* the packets sent, NULL if not recording */
+static struct recorder_ring *packet_ring;
 static struct remote remote;
+static struct mixer mixer;
+static struct pacer pacer;
+static struct metrics metrics;
+/* lost sync of the sender, its packets are counted by the remote */
+static struct metrics_counters sender_counters;
+static struct metrics_pwms sent_pwms;
+static struct predictor predictor;
+/* with --txtime, the sender wakes up that early and the qdisc holds the packets */
+static uint32_t txtime_lead_usec;
 
 static const char usage[] = "usage:\n\tjoystick_remote -d your_device "
                             "-t joystick_type -r remote_address:remote_port\n\n"
-                            "\tjoystick types: xbox360, skycontroller and ps3\n\n";
-static uint8_t verbose = 0;
+                            "\t-r can be repeated or take a comma separated list, "
+                            "to send to several destinations\n\n"
+                            "\tjoystick types: xbox360, skycontroller and ps3\n\n"
+                            "\t-s, --on-change\tsend as soon as the sticks move, "
+                            "the 10ms tick is kept as a keepalive\n"
+                            "\t-g, --min-gap usec\tminimum gap between two packets "
+                            "in on-change mode (default 2000)\n"
+                            "\t-e, --epoll\tsingle threaded engine, "
+                            "paced by a timerfd\n"
+                            "\t-i, --input api\tjoydev (/dev/input/jsN, default) "
+                            "or evdev (/dev/input/eventN)\n"
+                            "\t-C, --curves file\tper channel deadband, expo, trim, "
+                            "endpoints and reversal, reloaded on SIGHUP\n"
+                            "\t-M, --mixer file\tmixes axes and buttons to all the "
+                            "channels, reloaded on SIGHUP\n"
+                            "\t-S, --swarm your_device,joystick_type,"
+                            "remote_address:remote_port\n"
+                            "\t\tdrives one more vehicle from this process, "
+                            "can be repeated, -d, -t and -r are then ignored\n"
+                            "\t\tand -C, -s, -g, -e, -x, -a, -j, -o and -u "
+                            "are refused\n"
+                            "\t-x, --speed N\treplay speed when -d is a recorded "
+                            "js_event file, 1 for real time (default), "
+                            "0 as fast as the states are sent\n"
+                            "\t-R, --rt\treal time mode : memory locked, "
+                            "SCHED_FIFO reader and sender, see -P\n"
+                            "\t-P, --priorities reader,sender\tSCHED_FIFO "
+                            "priorities (default 60,50), implies --rt\n"
+                            "\t-A, --affinity reader_cpu,sender_cpu\tpins the "
+                            "joystick and the sending threads\n"
+                            "\t-T, --timestamps clock\tclock of the packet "
+                            "timestamps, monotonic (default) or raw\n"
+                            "\t-a, --rate idle_hz,moving_hz\tadapts the send "
+                            "rate to the stick movements (default fixed 100Hz)\n"
+                            "\t-p, --protocol version\t2, 3 or auto (default), "
+                            "auto switches to 3 when the receiver answers\n"
+                            "\t-H, --history K\tprevious frames repeated in the "
+                            "version 3 packets (default 2)\n"
+                            "\t-F, --failsafe state\tsent while the joystick "
+                            "is unplugged, neutral (default) or hold\n"
+                            "\t-j, --controller your_device,joystick_type\t"
+                            "one more controller, e.g. a student one, "
+                            "can be repeated\n"
+                            "\t\tthe -d one is the instructor, the first one "
+                            "added gets all the channels\n"
+                            "\t-o, --takeover button\tthe instructor drives "
+                            "all the channels while holding it\n"
+                            "\t-u, --channels channel=controller,...\troll, "
+                            "pitch, throttle, yaw, mode, raw or all,\n"
+                            "\t\tthe instructor is 0, the others are numbered "
+                            "in the -j order\n"
+                            "\t-w, --record dir\trecords the events read and "
+                            "the packets sent in dir, see rec_dump\n"
+                            "\t-v, --verbose\tlogs everything, same as "
+                            "--log all=debug\n"
+                            "\t-L, --log subsystem=level,...\tmain, joystick, "
+                            "remote, pacer, rt, trainer, recorder or all,\n"
+                            "\t\tat off, info or debug, e.g. "
+                            "remote=info,joystick=debug\n"
+                            "\t-k, --metrics socket_path\tserves the counters "
+                            "as JSON, or Prometheus text when sent\n"
+                            "\t\t\"prometheus\" or \"GET /metrics\", on a unix "
+                            "socket\n"
+                            "\t-f, --predict horizon_usec[,clamp_us]\t"
+                            "extrapolates the sticks to the send time, from\n"
+                            "\t\tevents up to horizon_usec old, by at most "
+                            "clamp_us (50)\n"
+                            "\t-b, --slew us_per_second\tlimits the stick "
+                            "pwm changes, against jitter\n"
+                            "\t-q, --tx-timestamps\tmeasures the time from "
+                            "sendmmsg to the kernel tx timestamp\n"
+                            "\t-Q, --txtime lead_usec\tperiodic mode, sends "
+                            "lead_usec early with SO_TXTIME, the fq qdisc\n"
+                            "\t\treleases the packets on the tick, e.g. "
+                            "tc qdisc replace dev eth0 root fq\n"
+                            "\t-E, --probe\tmeasures the round trips and the "
+                            "clock offsets, from the echoes\n"
+                            "\t\tof the receivers started with rc_receiver "
+                            "--echo\n\n";
 
-void debug_printf(const char *fmt, ...)
+static char *curves_path = NULL;
+static char *mixer_path = NULL;
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t dump_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+/* time from the joystick event to the sendmmsg, once per state change */
+static struct histogram input_latency;
+/* time from the tick deadline to the wakeup of the sender */
+static struct histogram tick_lateness;
+
+#define SEND_PERIOD_USEC 10000
+#define DEFAULT_MIN_GAP_USEC 2000
+
+static uint64_t get_micro64(void)
+{
+    return timebase_now_usec() - start_usec;
+}
+
+static void sighup_handler(int signum)
+{
+    (void) signum;
+    reload_requested = 1;
+}
+
+static void sigusr1_handler(int signum)
+{
+    (void) signum;
+    dump_requested = 1;
+}
+
+static void stop_handler(int signum)
 {
-    va_list arglist;
+    (void) signum;
+    stop_requested = 1;
+}
+
+static void dump_stats(void)
+{
+    struct rusage usage;
+    uint64_t events, reads, packets, bytes;
+    double elapsed, cpu;
 
-    if (verbose == 1) {
-        va_start(arglist, fmt);
-        vprintf(fmt, arglist);
-        va_end(arglist);
+    /* nothing was measured yet */
+    if (start_usec == 0)
+        return;
+    elapsed = get_micro64() * 1.0e-6;
+    getrusage(RUSAGE_SELF, &usage);
+    cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1.0e-6 +
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1.0e-6;
+    joystick_get_read_stats(&joystick, &events, &reads);
+    if (elapsed <= 0)
+        elapsed = 1.0e-9;
+    fprintf(stderr, "elapsed %.3fs, cpu %.3fs (%.1f%%)\n",
+            elapsed, cpu, 100.0 * cpu / elapsed);
+    fprintf(stderr, "events %" PRIu64 " in %" PRIu64 " reads, %.0f/s\n",
+            events, reads, events / elapsed);
+    packets = metrics_get(&remote.counters, METRICS_PACKETS);
+    bytes = metrics_get(&remote.counters, METRICS_BYTES);
+    fprintf(stderr, "packets %" PRIu64 ", %.0f/s, send errors %" PRIu64
+            ", lost sync %" PRIu64 "\n", packets, packets / elapsed,
+            metrics_get(&remote.counters, METRICS_SEND_ERRORS),
+            metrics_get(&sender_counters, METRICS_LOST_SYNC));
+    fprintf(stderr, "bytes %" PRIu64 ", %.0f/s, protocol %s\n",
+            bytes, bytes / elapsed,
+            remote.n_destinations > 0 ? remote_protocol_name(&remote, 0) : "-");
+    if (joystick.source == JOYSTICK_SOURCE_DEVICE) {
+        fprintf(stderr, "disconnects %" PRIu64 "\n",
+                metrics_get(&joystick.counters, METRICS_DISCONNECTS));
+        histogram_print(&joystick.hotplug.recover_time, stderr);
     }
+    trainer_print(&trainer, stderr);
+    if (recorder.n_rings > 0)
+        fprintf(stderr, "recorded %" PRIu64 " records in %u segments, "
+                "dropped %" PRIu64 "\n",
+                __atomic_load_n(&recorder.written, __ATOMIC_RELAXED),
+                __atomic_load_n(&recorder.n_segments, __ATOMIC_RELAXED),
+                recorder_dropped(&recorder));
+    if (log_dropped() > 0)
+        fprintf(stderr, "log dropped %" PRIu64 "\n", log_dropped());
+    histogram_print(&input_latency, stderr);
+    histogram_print(&tick_lateness, stderr);
+    if (remote.tx_timestamps)
+        histogram_print(&remote.tx_delay, stderr);
+    if (remote.txtime)
+        fprintf(stderr, "txtime errors %" PRIu64 "\n",
+                metrics_get(&remote.counters, METRICS_TXTIME_ERRORS));
+    remote_print_probes(&remote, stderr);
+    pacer_print(&pacer, bytes, stderr);
+    predictor_print(&predictor, stderr);
 }
 
-static void microsleep(uint32_t usec) {
-    struct timespec ts;
+/* deadline_usec is when the tick should have happened */
+static void record_tick_lateness(uint64_t deadline_usec, uint64_t now)
+{
+    histogram_record(&tick_lateness, now > deadline_usec ? now - deadline_usec : 0);
+}
+
+/* the calling thread is the sender one, before the reader is created */
+static void rt_setup_sender(struct rt_config *rt)
+{
+    if (rt->lock_memory)
+        rt_lock_memory();
+    rt_apply_self(&rt->sender);
+    log_register_thread();
+}
+
+static int rt_start_reader(struct rt_config *rt, struct joystick *reader)
+{
+    struct rt_thread_config fallback = rt->reader;
+    pthread_attr_t attr;
+    int ret;
+
+    if (rt_thread_attr(&rt->reader, &attr) == -1)
+        return joystick_start(reader, NULL);
+    ret = joystick_start(reader, &attr);
+    pthread_attr_destroy(&attr);
+    if (ret == 0 || rt->reader.priority == 0)
+        return ret;
+
+    /* not allowed to be SCHED_FIFO, the self check will report it */
+    fallback.priority = 0;
+    if (rt_thread_attr(&fallback, &attr) == -1)
+        return joystick_start(reader, NULL);
+    ret = joystick_start(reader, &attr);
+    pthread_attr_destroy(&attr);
 
-    ts.tv_sec = 0;
-    ts.tv_nsec = usec * 1000UL;
-    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+    return ret;
 }
 
-static uint64_t get_micro64()
+/* one reader thread per controller, all with the same settings */
+static int rt_start_readers(struct rt_config *rt)
 {
-    struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return 1.0e6*((ts.tv_sec + (ts.tv_nsec*1.0e-9)) - 
-                  (start_time.tv_sec +
-                   (start_time.tv_nsec*1.0e-9)));
+    unsigned int i;
+
+    for (i = 0; i < trainer.n_controllers; i++) {
+        if (rt_start_reader(rt, trainer.controllers[i]) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void rt_self_check(struct rt_config *rt, uint8_t with_reader)
+{
+    unsigned int i;
+    int failures = 0;
+
+    if (rt->lock_memory)
+        failures += rt_check_memory();
+    failures += rt_check("sender", pthread_self(), &rt->sender);
+    for (i = 0; with_reader && i < trainer.n_controllers; i++)
+        failures += rt_check("reader", trainer.controllers[i]->thread,
+                             &rt->reader);
+    if (failures)
+        fprintf(stderr, "rt : %d settings could not be applied, "
+                "running without them\n", failures);
+}
+
+/* the same curves for all the controllers */
+static int load_curves(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < trainer.n_controllers; i++) {
+        if (joystick_load_curves(trainer.controllers[i], curves_path) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void record_packet(uint64_t micro64, uint64_t timestamp_us,
+                          const uint16_t *pwms, unsigned int n_channels)
+{
+    struct recorder_packet packet;
+
+    packet.timestamp_us = timestamp_us;
+    packet.sequence = remote.destinations[0].packet.sequence;
+    packet.version = remote.destinations[0].version;
+    packet.n_channels = n_channels;
+    memcpy(packet.pwms, pwms, n_channels * sizeof(*pwms));
+    recorder_push_packet(packet_ring, micro64 + start_usec, &packet);
+}
+
+/* micro64 is the clock read of the tick, returned for the callers */
+static uint64_t send_pwms(uint64_t micro64)
+{
+    int16_t inputs[MIXER_NUM_INPUTS] __attribute__((aligned(32)));
+    uint16_t pwms[MIXER_NUM_OUTPUTS];
+    struct joystick_state state;
+    static uint64_t last_event_usec;
+    uint64_t timestamp_us, wire_usec;
+
+    if (dump_requested) {
+        dump_requested = 0;
+        dump_stats();
+    }
+    if (reload_requested) {
+        reload_requested = 0;
+        if (curves_path != NULL && load_curves() == -1)
+            fprintf(stderr, "reloading %s failed, keeping the curves\n", curves_path);
+        /* the mixer is only used from here, no need to synchronize */
+        if (mixer_path != NULL && mixer_load(&mixer, mixer_path) == -1)
+            fprintf(stderr, "reloading %s failed, keeping the mixer\n", mixer_path);
+    }
+
+    trainer_merge(&trainer, &state);
+    if (predictor.horizon_usec != 0 || predictor.slew_rate != 0)
+        predictor_apply(&predictor, &state, micro64 + start_usec);
+    mixer_inputs(&state, inputs);
+    mixer_run(&mixer, inputs, pwms);
+    timestamp_us = timebase_stamp_usec(micro64 + start_usec) - stamp_start_usec;
+    remote_send_pwms(&remote, pwms, mixer.n_outputs * sizeof(*pwms),
+                     timestamp_us);
+    /*
+     * after the send : an event published after the tick read is newer
+     * than micro64. With --txtime the packets leave at micro64.
+     */
+    wire_usec = timebase_now_usec();
+    if (wire_usec < micro64 + start_usec)
+        wire_usec = micro64 + start_usec;
+    if (packet_ring != NULL)
+        record_packet(micro64, timestamp_us, pwms, mixer.n_outputs);
+    pacer_update(&pacer, pwms, mixer.n_outputs, micro64);
+    if (metrics.started)
+        metrics_set_pwms(&sent_pwms, pwms, mixer.n_outputs);
+    /* the keepalives of an unchanged state are not input latency */
+    if (state.event_usec != last_event_usec) {
+        last_event_usec = state.event_usec;
+        /* clamped, a wrapped sample would ruin the max */
+        histogram_record(&input_latency, wire_usec > state.event_usec ?
+                         wire_usec - state.event_usec : 0);
+    }
+    if (log_enabled(LOG_MAIN, LOG_DEBUG)) {
+        uint64_t events, reads;
+
+        joystick_get_read_stats(&joystick, &events, &reads);
+        /* a single record, the lines of the threads are not mixed */
+        log_write("Micros : %" PRIu64", Roll : %d, Pitch : %d, Throttle : %d, Yaw : %d, Mode : %d, Aux : %d %d %d, Retries : %" PRIu64", Events : %" PRIu64" in %" PRIu64" reads, Input age : %" PRIu64" us\n",
+                micro64, pwms[0], pwms[1], pwms[2], pwms[3], pwms[4],
+                pwms[5], pwms[6], pwms[7],
+                joystick_get_retries(&joystick), events, reads,
+                /* unknown before the first event */
+                state.event_usec != 0 && wire_usec > state.event_usec ?
+                wire_usec - state.event_usec : 0);
+    }
+
+    return micro64;
+}
+
+/*
+ * slowed down by the pacer, a change of the joystick state only wakes it
+ * up if its pwms moved fast enough for a faster rate since the last send,
+ * not for the noise or an unmapped axis. No prediction, it has state.
+ */
+static int move_wakes_pacer(uint64_t micro64)
+{
+    int16_t inputs[MIXER_NUM_INPUTS] __attribute__((aligned(32)));
+    uint16_t pwms[MIXER_NUM_OUTPUTS];
+    struct joystick_state state;
+
+    trainer_merge(&trainer, &state);
+    mixer_inputs(&state, inputs);
+    mixer_run(&mixer, inputs, pwms);
+
+    return pacer_wake(&pacer, pwms, mixer.n_outputs, micro64);
+}
+
+/*
+ * waits for a move that wakes the pacer up until wakeup_usec, returns 1 if
+ * there was one, 0 if not and -1 on error
+ */
+static int wait_move(uint64_t wakeup_usec)
+{
+    uint64_t now;
+    int ret;
+
+    if (joystick.change_fd == -1)
+        return 0;
+    /* the first wait drains the count of the changes already sent */
+    while (pacer.level > 0 && (now = get_micro64()) < wakeup_usec) {
+        ret = joystick_wait_change(&joystick, wakeup_usec - now);
+        if (ret != 1)
+            return ret;
+        if (move_wakes_pacer(get_micro64()))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * periodic mode : send every pacer period, SEND_PERIOD_USEC by default.
+ * With --txtime the packets are built txtime_lead_usec before the tick and
+ * stamped with it, the qdisc sends them on the tick whatever the wakeup
+ * jitter. With --rate, the first move after idling is sent at once.
+ */
+static void send_loop(void)
+{
+    uint64_t next_run_usec, wakeup_usec, now;
+    int ret;
+
+    next_run_usec = get_micro64() + pacer_period(&pacer);
+    while (!stop_requested) {
+        wakeup_usec = next_run_usec - txtime_lead_usec;
+        ret = wait_move(wakeup_usec);
+        if (ret == -1)
+            return;
+        if (ret == 1) {
+            /* the fast ticks start from this send, not a late tick */
+            now = wakeup_usec = get_micro64();
+            next_run_usec = now + txtime_lead_usec;
+        } else {
+            if (timebase_sleep_until(start_usec + wakeup_usec) == -1)
+                return;
+            now = get_micro64();
+            record_tick_lateness(wakeup_usec, now);
+        }
+        if (now - wakeup_usec > 2 * pacer_period(&pacer)) {
+            // we've lost sync - restart
+            metrics_add(&sender_counters, METRICS_LOST_SYNC, 1);
+            next_run_usec = now + txtime_lead_usec;
+        }
+        if (txtime_lead_usec == 0) {
+            send_pwms(now);
+        } else {
+            /* woken up after the tick, sent at once */
+            if (now > next_run_usec)
+                next_run_usec = now;
+            remote_set_txtime(&remote, (start_usec + next_run_usec) * 1000);
+            send_pwms(next_run_usec);
+        }
+        next_run_usec += pacer_period(&pacer);
+    }
+}
+
+/*
+ * on-change mode : send as soon as the joystick thread reports a change,
+ * but never more often than every min_gap_usec. The periodic send is kept
+ * as a keepalive when the sticks don't move.
+ */
+static void send_on_change_loop(uint32_t min_gap_usec)
+{
+    uint64_t last_send_usec, now;
+    uint32_t period;
+    int ret;
+
+    last_send_usec = send_pwms(get_micro64());
+    while (!stop_requested) {
+        /* the keepalive is due a period after the last send */
+        period = pacer_period(&pacer);
+        ret = joystick_wait_change(&joystick, period);
+        if (ret == -1)
+            return;
+        now = get_micro64();
+        if (ret == 0) {
+            record_tick_lateness(last_send_usec + period, now);
+        } else if (now - last_send_usec < min_gap_usec) {
+            if (timebase_sleep_until(start_usec + last_send_usec +
+                                     min_gap_usec) == -1)
+                return;
+            now = get_micro64();
+        }
+        last_send_usec = send_pwms(now);
+    }
+}
+
+enum {
+    EPOLL_SOURCE_JOYSTICK,
+    EPOLL_SOURCE_TICK,
+    EPOLL_SOURCE_GAP,
+    EPOLL_SOURCE_REMOTE,
+    EPOLL_SOURCE_HOTPLUG,
+    EPOLL_NUM_SOURCES
+};
+
+/* arms timer_fd to expire at micro64, then every interval_usec if not 0 */
+static int arm_timer(int timer_fd, uint64_t micro64, uint32_t interval_usec)
+{
+    struct itimerspec its;
+
+    timebase_usec_to_timespec(start_usec + micro64, &its.it_value);
+    timebase_usec_to_timespec(interval_usec, &its.it_interval);
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("arm_timer - timerfd_settime");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int epoll_add(int epoll_fd, int fd, uint32_t source)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u32 = source;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_add - epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the joystick fd is added back once the device is reopened */
+static int epoll_reconnect(int epoll_fd)
+{
+    int ret;
+
+    ret = joystick_reconnect(&joystick);
+    if (ret != 1)
+        return ret;
+
+    return epoll_add(epoll_fd, joystick.fd, EPOLL_SOURCE_JOYSTICK);
+}
+
+/* the closed fd leaves the epoll set, the device is then watched for */
+static int epoll_disconnect(int epoll_fd)
+{
+    if (joystick_disconnect(&joystick) == -1 ||
+        epoll_add(epoll_fd, joystick.hotplug.inotify_fd,
+                  EPOLL_SOURCE_HOTPLUG) == -1)
+        return -1;
+
+    return epoll_reconnect(epoll_fd);
+}
+
+/*
+ * single threaded engine : the joystick events, the send ticks and the
+ * socket are all handled from one epoll loop. The ticks come from a timerfd
+ * armed on absolute deadlines, so the send cadence doesn't drift.
+ */
+static void epoll_loop(uint8_t on_change, uint32_t min_gap_usec)
+{
+    struct epoll_event events[EPOLL_NUM_SOURCES + 1];
+    int epoll_fd, tick_fd, gap_fd = -1;
+    uint64_t last_send_usec, expirations, now, tick_deadline_usec;
+    uint32_t tick_period_usec;
+    uint8_t gap_armed = 0;
+    int i, n, ret;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+        perror("epoll_loop - epoll_create1");
+        return;
+    }
+    tick_fd = timerfd_create(TIMEBASE_CLOCK, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tick_fd == -1) {
+        perror("epoll_loop - timerfd_create");
+        goto err_epoll;
+    }
+    if (on_change) {
+        gap_fd = timerfd_create(TIMEBASE_CLOCK, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (gap_fd == -1) {
+            perror("epoll_loop - timerfd_create");
+            goto err_tick;
+        }
+        if (epoll_add(epoll_fd, gap_fd, EPOLL_SOURCE_GAP) == -1)
+            goto err_gap;
+    }
+    if (epoll_add(epoll_fd, joystick.fd, EPOLL_SOURCE_JOYSTICK) == -1 ||
+        epoll_add(epoll_fd, tick_fd, EPOLL_SOURCE_TICK) == -1)
+        goto err_gap;
+    for (i = 0; i < (int) remote.n_sockets; i++) {
+        if (epoll_add(epoll_fd, remote.sockets[i].fd, EPOLL_SOURCE_REMOTE) == -1)
+            goto err_gap;
+    }
+
+    last_send_usec = get_micro64();
+    tick_period_usec = pacer_period(&pacer);
+    tick_deadline_usec = last_send_usec + tick_period_usec;
+    if (arm_timer(tick_fd, tick_deadline_usec, tick_period_usec) == -1)
+        goto err_gap;
+
+    while (!stop_requested) {
+        n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_loop - epoll_wait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case EPOLL_SOURCE_JOYSTICK:
+                /* the events still buffered in a stream are read first */
+                if ((events[i].events & (EPOLLHUP | EPOLLERR)) &&
+                    !(events[i].events & EPOLLIN)) {
+                    fprintf(stderr, "joystick disconnected\n");
+                    ret = -1;
+                } else {
+                    ret = joystick_process_events(&joystick);
+                }
+                if (ret == -1) {
+                    if (epoll_disconnect(epoll_fd) == -1)
+                        goto err_gap;
+                    break;
+                }
+                if (ret == 0 || gap_armed)
+                    break;
+                now = get_micro64();
+                /* periodic mode, only a move that speeds the pacer up is sent */
+                if (!on_change &&
+                    (pacer.level == 0 || !move_wakes_pacer(now)))
+                    break;
+                if (now - last_send_usec < min_gap_usec) {
+                    /* too early, send when the gap timer expires */
+                    if (arm_timer(gap_fd, last_send_usec + min_gap_usec, 0) == -1)
+                        goto err_gap;
+                    gap_armed = 1;
+                    break;
+                }
+                last_send_usec = send_pwms(now);
+                /* keepalive restarts from the last packet sent */
+                tick_period_usec = pacer_period(&pacer);
+                tick_deadline_usec = last_send_usec + tick_period_usec;
+                if (arm_timer(tick_fd, tick_deadline_usec,
+                              tick_period_usec) == -1)
+                    goto err_gap;
+                break;
+            case EPOLL_SOURCE_GAP:
+                if (read(gap_fd, &expirations, sizeof(expirations)) == -1)
+                    break;
+                gap_armed = 0;
+                last_send_usec = send_pwms(get_micro64());
+                tick_period_usec = pacer_period(&pacer);
+                tick_deadline_usec = last_send_usec + tick_period_usec;
+                if (arm_timer(tick_fd, tick_deadline_usec,
+                              tick_period_usec) == -1)
+                    goto err_gap;
+                break;
+            case EPOLL_SOURCE_TICK:
+                if (read(tick_fd, &expirations, sizeof(expirations)) == -1)
+                    break;
+                /* missed ticks are not replayed, the deadlines stay aligned */
+                if (expirations > 1) {
+                    log_printf(LOG_MAIN, LOG_INFO,
+                               "epoll_loop : missed %" PRIu64 " ticks\n",
+                               expirations - 1);
+                    metrics_add(&sender_counters, METRICS_LOST_SYNC, 1);
+                }
+                tick_deadline_usec += (expirations - 1) * tick_period_usec;
+                now = get_micro64();
+                record_tick_lateness(tick_deadline_usec, now);
+                tick_deadline_usec += tick_period_usec;
+                last_send_usec = send_pwms(now);
+                /* the pacer changed the rate, realigned on this send */
+                if (pacer_period(&pacer) != tick_period_usec) {
+                    tick_period_usec = pacer_period(&pacer);
+                    tick_deadline_usec = last_send_usec + tick_period_usec;
+                    if (arm_timer(tick_fd, tick_deadline_usec,
+                                  tick_period_usec) == -1)
+                        goto err_gap;
+                }
+                break;
+            case EPOLL_SOURCE_REMOTE:
+                remote_handle_input(&remote);
+                break;
+            case EPOLL_SOURCE_HOTPLUG:
+                if (epoll_reconnect(epoll_fd) == -1)
+                    goto err_gap;
+                break;
+            }
+        }
+    }
+
+err_gap:
+    if (gap_fd != -1)
+        close(gap_fd);
+err_tick:
+    close(tick_fd);
+err_epoll:
+    close(epoll_fd);
+}
+
+static void stop_recording(void)
+{
+    recorder_stop(&recorder);
+}
+
+/* a ring per producer thread : one per controller and the sender one */
+static int start_recording(const char *dir)
+{
+    struct recorder_ring *ring;
+    unsigned int i;
+
+    if (recorder_init(&recorder, dir) == -1)
+        return -1;
+    for (i = 0; i < trainer.n_controllers; i++) {
+        ring = recorder_add_ring(&recorder, i);
+        if (ring == NULL)
+            return -1;
+        joystick_set_recorder(trainer.controllers[i], ring);
+    }
+    packet_ring = recorder_add_ring(&recorder, 0);
+    if (packet_ring == NULL || recorder_start(&recorder) == -1)
+        return -1;
+    /* registered after dump_stats, so run before it */
+    atexit(stop_recording);
+
+    return 0;
+}
+
+static void stop_metrics(void)
+{
+    metrics_stop(&metrics);
+}
+
+/* the counters of each thread are only summed when requested */
+static int start_metrics(const char *path)
+{
+    unsigned int i;
+
+    metrics_init(&metrics);
+    for (i = 0; i < trainer.n_controllers; i++) {
+        if (metrics_add_counters(&metrics,
+                                 &trainer.controllers[i]->counters) == -1)
+            return -1;
+    }
+    if (metrics_add_counters(&metrics, &remote.counters) == -1 ||
+        metrics_add_counters(&metrics, &sender_counters) == -1 ||
+        metrics_add_histogram(&metrics, "tick_lateness_us",
+                              &tick_lateness) == -1 ||
+        metrics_add_histogram(&metrics, "input_latency_us",
+                              &input_latency) == -1 ||
+        metrics_add_histogram(&metrics, "recover_time_us",
+                              &joystick.hotplug.recover_time) == -1)
+        return -1;
+    if (remote.tx_timestamps &&
+        metrics_add_histogram(&metrics, "tx_delay_ns", &remote.tx_delay) == -1)
+        return -1;
+    if (remote.probing &&
+        metrics_add_histogram(&metrics, "rtt_us", &remote.rtt) == -1)
+        return -1;
+    metrics.pwms = &sent_pwms;
+    if (metrics_start(&metrics, path) == -1)
+        return -1;
+    atexit(stop_metrics);
+
+    return 0;
+}
+
+/* device,type of a controller merged with the instructor one */
+static int add_controller(char *spec, enum joystick_backend backend,
+                          unsigned int replay_speed,
+                          enum joystick_failsafe failsafe)
+{
+    struct joystick *controller = &controllers[trainer.n_controllers - 1];
+    char *device, *type, *saveptr;
+
+    device = strtok_r(spec, ",", &saveptr);
+    type = strtok_r(NULL, ",", &saveptr);
+    if (device == NULL || type == NULL) {
+        fprintf(stderr, "bad controller %s, device,type expected\n", spec);
+        return -1;
+    }
+    if (joystick_open(device, type, backend, controller) == -1)
+        return -1;
+    joystick_set_replay_speed(controller, replay_speed);
+    joystick_set_failsafe(controller, failsafe);
+
+    return trainer_add(&trainer, controller);
 }
 
 int main(int argc, char **argv)
 {
-    int c;
+    int c, ret;
     char *device_path = NULL;
     char *joystick_type = NULL;
-    uint64_t next_run_usec;
-    char *remote_host = NULL;
-    uint16_t pwms[RCINPUT_UDP_NUM_CHANNELS];
+    char *remote_hosts[REMOTE_MAX_DESTINATIONS];
+    unsigned int n_remote_hosts = 0;
+    char *remote_host, *saveptr;
+    uint8_t on_change = 0;
+    uint8_t use_epoll = 0;
+    enum joystick_backend backend = JOYSTICK_BACKEND_JOYDEV;
+    char *swarm_specs[SWARM_MAX_VEHICLES];
+    unsigned int i, n_swarm_specs = 0;
+    struct swarm swarm;
+    uint32_t min_gap_usec = DEFAULT_MIN_GAP_USEC;
+    unsigned int replay_speed = 1;
+    unsigned int idle_hz = 1000000 / SEND_PERIOD_USEC;
+    unsigned int moving_hz = 1000000 / SEND_PERIOD_USEC;
+    enum remote_protocol protocol = REMOTE_PROTOCOL_AUTO;
+    unsigned int history = REMOTE_DEFAULT_HISTORY;
+    enum joystick_failsafe failsafe = JOYSTICK_FAILSAFE_NEUTRAL;
+    char *controller_specs[TRAINER_MAX_CONTROLLERS - 1];
+    unsigned int n_controller_specs = 0;
+    char *channels_spec = NULL;
+    char *record_dir = NULL;
+    char *metrics_path = NULL;
+    uint8_t tx_timestamps = 0;
+    uint8_t probe = 0;
+    int takeover_button = -1;
+    struct rt_config rt;
 
     if (argc < 2)
         printf(usage);
+    rt_init(&rt);
+    predictor_init(&predictor);
+    /* also writes what was logged while parsing the options */
+    atexit(log_stop);
 
     while (1) {
 
-        c = getopt_long(argc, argv, "vld:m:r:cht:", long_options, NULL);
+        c = getopt_long(argc, argv, "vld:m:r:cht:sg:ei:C:M:S:x:RP:A:T:a:p:H:F:j:o:u:w:L:k:f:b:qQ:E", long_options, NULL);
         if (c == -1)
             break;
 
         switch (c) {
         case 'l':
-            debug_printf("get the list of joysticks\n");
+            log_printf(LOG_MAIN, LOG_INFO, "get the list of joysticks\n");
             break;
         case 'd':
-            debug_printf("device : %s\n", optarg);
+            log_printf(LOG_MAIN, LOG_INFO, "device : %s\n", optarg);
             device_path = optarg;
             break;
         case 'm':
-            debug_printf("mode : %s\n", optarg);
+            log_printf(LOG_MAIN, LOG_INFO, "mode : %s\n", optarg);
             break;
         case 'v':
-            verbose = 1;
+            for (i = 0; i < LOG_NUM_SUBSYSTEMS; i++)
+                log_set_level(i, LOG_DEBUG);
+            break;
+        case 'f':
+            log_printf(LOG_MAIN, LOG_INFO, "set prediction to %s\n", optarg);
+            if (predictor_set_prediction(&predictor, optarg) == -1)
+                goto end;
+            break;
+        case 'b':
+            log_printf(LOG_MAIN, LOG_INFO, "set slew rate to %s\n", optarg);
+            predictor_set_slew_rate(&predictor, strtoul(optarg, NULL, 10));
+            break;
+        case 'q':
+            log_printf(LOG_MAIN, LOG_INFO, "tx timestamps\n");
+            tx_timestamps = 1;
+            break;
+        case 'E':
+            log_printf(LOG_MAIN, LOG_INFO, "round trip probes\n");
+            probe = 1;
+            break;
+        case 'Q':
+            log_printf(LOG_MAIN, LOG_INFO, "set txtime lead to %s\n", optarg);
+            txtime_lead_usec = strtoul(optarg, NULL, 10);
+            if (txtime_lead_usec == 0) {
+                fprintf(stderr, "bad txtime lead %s\n", optarg);
+                goto end;
+            }
+            break;
+        case 'k':
+            log_printf(LOG_MAIN, LOG_INFO, "serve metrics on %s\n", optarg);
+            metrics_path = optarg;
+            break;
+        case 'L':
+            if (log_parse_levels(optarg) == -1)
+                goto end;
             break;
         case 'r':
-            debug_printf("set remote to %s\n", optarg);
-            remote_host = optarg;
+            log_printf(LOG_MAIN, LOG_INFO, "set remote to %s\n", optarg);
+            for (remote_host = strtok_r(optarg, ",", &saveptr);
+                 remote_host != NULL;
+                 remote_host = strtok_r(NULL, ",", &saveptr)) {
+                if (n_remote_hosts == REMOTE_MAX_DESTINATIONS) {
+                    fprintf(stderr, "too many remotes, max %d\n",
+                            REMOTE_MAX_DESTINATIONS);
+                    goto end;
+                }
+                remote_hosts[n_remote_hosts++] = remote_host;
+            }
             break;
         case 't':
-            debug_printf("set joystick_type to %s\n", optarg);
+            log_printf(LOG_MAIN, LOG_INFO, "set joystick_type to %s\n", optarg);
             joystick_type = optarg;
             break;
+        case 's':
+            log_printf(LOG_MAIN, LOG_INFO, "send on change\n");
+            on_change = 1;
+            break;
+        case 'g':
+            log_printf(LOG_MAIN, LOG_INFO, "set min gap to %s usec\n", optarg);
+            min_gap_usec = strtoul(optarg, NULL, 10);
+            on_change = 1;
+            break;
+        case 'e':
+            log_printf(LOG_MAIN, LOG_INFO, "single threaded epoll engine\n");
+            use_epoll = 1;
+            break;
+        case 'i':
+            log_printf(LOG_MAIN, LOG_INFO, "set input api to %s\n", optarg);
+            if (!strcmp(optarg, "evdev")) {
+                backend = JOYSTICK_BACKEND_EVDEV;
+            } else if (!strcmp(optarg, "joydev")) {
+                backend = JOYSTICK_BACKEND_JOYDEV;
+            } else {
+                fprintf(stderr, "unknown input api %s\n", optarg);
+                goto end;
+            }
+            break;
+        case 'C':
+            log_printf(LOG_MAIN, LOG_INFO, "set curves to %s\n", optarg);
+            curves_path = optarg;
+            break;
+        case 'M':
+            log_printf(LOG_MAIN, LOG_INFO, "set mixer to %s\n", optarg);
+            mixer_path = optarg;
+            break;
+        case 'S':
+            log_printf(LOG_MAIN, LOG_INFO, "add swarm vehicle %s\n", optarg);
+            if (n_swarm_specs == SWARM_MAX_VEHICLES) {
+                fprintf(stderr, "too many vehicles, max %d\n",
+                        SWARM_MAX_VEHICLES);
+                goto end;
+            }
+            swarm_specs[n_swarm_specs++] = optarg;
+            break;
+        case 'x':
+            log_printf(LOG_MAIN, LOG_INFO, "set replay speed to %s\n", optarg);
+            replay_speed = strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            log_printf(LOG_MAIN, LOG_INFO, "real time mode\n");
+            rt_enable(&rt);
+            break;
+        case 'P':
+            log_printf(LOG_MAIN, LOG_INFO, "set priorities to %s\n", optarg);
+            rt_enable(&rt);
+            if (rt_parse_pair(optarg, &rt.reader.priority,
+                              &rt.sender.priority) == -1) {
+                fprintf(stderr, "bad priorities %s\n", optarg);
+                goto end;
+            }
+            break;
+        case 'A':
+            log_printf(LOG_MAIN, LOG_INFO, "set affinity to %s\n", optarg);
+            if (rt_parse_pair(optarg, &rt.reader.cpu, &rt.sender.cpu) == -1) {
+                fprintf(stderr, "bad affinity %s\n", optarg);
+                goto end;
+            }
+            break;
+        case 'a':
+            log_printf(LOG_MAIN, LOG_INFO, "set rate to %s\n", optarg);
+            if (sscanf(optarg, "%u,%u", &idle_hz, &moving_hz) != 2 ||
+                idle_hz == 0 || idle_hz > moving_hz || moving_hz > 1000) {
+                fprintf(stderr, "bad rate %s, idle_hz,moving_hz expected\n",
+                        optarg);
+                goto end;
+            }
+            break;
+        case 'p':
+            log_printf(LOG_MAIN, LOG_INFO, "set protocol to %s\n", optarg);
+            if (!strcmp(optarg, "2")) {
+                protocol = REMOTE_PROTOCOL_V2;
+            } else if (!strcmp(optarg, "3")) {
+                protocol = REMOTE_PROTOCOL_V3;
+            } else if (!strcmp(optarg, "auto")) {
+                protocol = REMOTE_PROTOCOL_AUTO;
+            } else {
+                fprintf(stderr, "unknown protocol %s\n", optarg);
+                goto end;
+            }
+            break;
+        case 'H':
+            log_printf(LOG_MAIN, LOG_INFO, "set history to %s\n", optarg);
+            history = strtoul(optarg, NULL, 10);
+            break;
+        case 'F':
+            log_printf(LOG_MAIN, LOG_INFO, "set failsafe to %s\n", optarg);
+            if (!strcmp(optarg, "neutral")) {
+                failsafe = JOYSTICK_FAILSAFE_NEUTRAL;
+            } else if (!strcmp(optarg, "hold")) {
+                failsafe = JOYSTICK_FAILSAFE_HOLD;
+            } else {
+                fprintf(stderr, "unknown failsafe %s\n", optarg);
+                goto end;
+            }
+            break;
+        case 'j':
+            log_printf(LOG_MAIN, LOG_INFO, "add controller %s\n", optarg);
+            if (n_controller_specs == TRAINER_MAX_CONTROLLERS - 1) {
+                fprintf(stderr, "too many controllers, max %d\n",
+                        TRAINER_MAX_CONTROLLERS);
+                goto end;
+            }
+            controller_specs[n_controller_specs++] = optarg;
+            break;
+        case 'o':
+            log_printf(LOG_MAIN, LOG_INFO, "set takeover button to %s\n", optarg);
+            takeover_button = strtoul(optarg, NULL, 10);
+            break;
+        case 'u':
+            log_printf(LOG_MAIN, LOG_INFO, "set channels to %s\n", optarg);
+            channels_spec = optarg;
+            break;
+        case 'w':
+            log_printf(LOG_MAIN, LOG_INFO, "record in %s\n", optarg);
+            record_dir = optarg;
+            break;
+        case 'T':
+            log_printf(LOG_MAIN, LOG_INFO, "set timestamps clock to %s\n", optarg);
+            if (timebase_set_stamp_clock(optarg) == -1)
+                goto end;
+            break;
         case 'h':
             printf(usage);
             goto end;
@@ -142,54 +1112,193 @@ int main(int argc, char **argv)
         printf("\n");
     }
 
+    /* before rt_setup_sender, not to inherit the sender affinity */
+    if (log_start() == -1)
+        goto end;
+
+    mixer_init(&mixer);
+    if (mixer_path != NULL && mixer_load(&mixer, mixer_path) == -1) {
+        fprintf(stderr, "loading mixer failed\n");
+        goto end;
+    }
+
+    if (n_swarm_specs > 0) {
+        if (record_dir != NULL || metrics_path != NULL ||
+            predictor.horizon_usec != 0 || predictor.slew_rate != 0 ||
+            tx_timestamps || txtime_lead_usec != 0 || probe) {
+            fprintf(stderr, "--record, --metrics, --predict, --slew, "
+                    "--tx-timestamps, --txtime and --probe are not "
+                    "supported with --swarm\n");
+            goto end;
+        }
+        /* the vehicles have their own loop, these would be silently ignored */
+        if (curves_path != NULL || on_change || use_epoll ||
+            replay_speed != 1 || idle_hz != moving_hz ||
+            moving_hz != 1000000 / SEND_PERIOD_USEC ||
+            n_controller_specs > 0 || channels_spec != NULL ||
+            takeover_button != -1) {
+            fprintf(stderr, "--curves, --on-change, --min-gap, --epoll, "
+                    "--speed, --rate, --controller, --takeover and "
+                    "--channels are not supported with --swarm\n");
+            goto end;
+        }
+        if (swarm_init(&swarm, &mixer, SEND_PERIOD_USEC) == -1)
+            goto end;
+        for (i = 0; i < n_swarm_specs; i++) {
+            if (swarm_add_vehicle(&swarm, swarm_specs[i], backend) == -1)
+                goto end;
+            joystick_set_failsafe(&swarm.vehicles[i].joystick, failsafe);
+        }
+        if (swarm_start(&swarm) == -1) {
+            fprintf(stderr, "swarm start failed\n");
+            goto end;
+        }
+        if (remote_set_protocol(&swarm.remote, protocol, history) == -1)
+            goto end;
+        rt_setup_sender(&rt);
+        rt_self_check(&rt, 0);
+        swarm_run(&swarm, 0);
+        goto end;
+    }
+
     if (device_path == NULL) {
         fprintf(stderr, "you must specify a device with -d option\n");
         goto end;
     }
 
-    if (joystick_start(device_path, &joystick) == -1) {
-        fprintf(stderr, "joystick start failed\n");
+    /* Calibration procedure to be added */
+    if (joystick_type == NULL) {
+        fprintf(stderr, "no joystick type specified\n");
+        goto end;
+    }
+
+    ret = joystick_open(device_path, joystick_type, backend, &joystick);
+    if (ret == -1) {
+        fprintf(stderr, "joystick open failed\n");
+        goto end;
+    }
+    joystick_set_replay_speed(&joystick, replay_speed);
+    joystick_set_failsafe(&joystick, failsafe);
+    if (use_epoll && joystick.source == JOYSTICK_SOURCE_REPLAY) {
+        fprintf(stderr, "recorded sessions can't be replayed with --epoll\n");
+        goto end;
+    }
+
+    trainer_init(&trainer, &joystick);
+    for (i = 0; i < n_controller_specs; i++) {
+        if (add_controller(controller_specs[i], backend, replay_speed,
+                           failsafe) == -1)
+            goto end;
+    }
+    if (channels_spec != NULL &&
+        trainer_set_channels(&trainer, channels_spec) == -1)
+        goto end;
+    if (takeover_button != -1 &&
+        trainer_set_takeover(&trainer, takeover_button) == -1)
+        goto end;
+    if (trainer.n_controllers > 1) {
+        /* each controller has its own reader thread */
+        if (use_epoll) {
+            fprintf(stderr, "several controllers can't be used with --epoll\n");
+            goto end;
+        }
+        if (takeover_button == -1)
+            fprintf(stderr, "no --takeover button, the instructor can't "
+                    "take over\n");
+    }
+
+    if (curves_path != NULL && load_curves() == -1) {
+        fprintf(stderr, "loading curves failed\n");
         goto end;
     }
 
-    if (remote_host == NULL) {
+    if (curves_path != NULL || mixer_path != NULL)
+        signal(SIGHUP, sighup_handler);
+
+    histogram_init(&input_latency, "input to wire latency (us)");
+    histogram_init(&tick_lateness, "tick lateness (us)");
+    signal(SIGUSR1, sigusr1_handler);
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+    /* also dumped when the joystick thread exits at the end of a stream */
+    atexit(dump_stats);
+
+    if (n_remote_hosts == 0) {
         fprintf(stderr, "no ip address specified\n");
         goto end;
     }
 
-    if (remote_start(remote_host, &remote) == -1) {
+    if (remote_start(remote_hosts, n_remote_hosts, &remote) == -1) {
         fprintf(stderr, "remote start failed\n");
         goto end;
     }
+    if (remote_set_protocol(&remote, protocol, history) == -1)
+        goto end;
+    if (tx_timestamps && remote_enable_tx_timestamps(&remote) == -1)
+        goto end;
+    if (probe && remote_enable_probes(&remote) == -1)
+        goto end;
+    if (txtime_lead_usec != 0) {
+        if (on_change || use_epoll) {
+            fprintf(stderr, "--txtime needs the periodic mode\n");
+            goto end;
+        }
+        if (txtime_lead_usec >= 1000000 / moving_hz) {
+            fprintf(stderr, "the txtime lead must be shorter than the "
+                    "send period\n");
+            goto end;
+        }
+        if (remote_enable_txtime(&remote) == -1)
+            goto end;
+    }
 
-    /* Calibration procedure to be added */
-    if (joystick_type == NULL) {
-        fprintf(stderr, "no joystick type specified\n");
+    if (pacer_init(&pacer, 1000000 / moving_hz, 1000000 / idle_hz) == -1)
         goto end;
+
+    /* with --rate, the periodic mode also waits for the first move */
+    if ((on_change || idle_hz != moving_hz) && !use_epoll) {
+        if (joystick_enable_change_notify(&joystick) == -1) {
+            fprintf(stderr, "joystick change notification failed\n");
+            goto end;
+        }
+        for (i = 1; i < trainer.n_controllers; i++)
+            joystick_share_change_notify(trainer.controllers[i], &joystick);
     }
-    joystick_set_type(&joystick, joystick_type);
 
-    /* get start time, necessary for get_micro64) */
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (i = 0; i < trainer.n_controllers; i++)
+        joystick_set_tracking(trainer.controllers[i],
+                              predictor.horizon_usec != 0 ||
+                              predictor.slew_rate != 0);
 
-    next_run_usec = get_micro64() + 10000;
-    while (1) {
-        uint64_t dt = next_run_usec - get_micro64();
-        uint64_t micro64;
-        uint8_t len;
+    /* get start time, necessary for get_micro64 */
+    start_usec = timebase_now_usec();
+    stamp_start_usec = timebase_stamp_usec(start_usec);
 
-        if (dt > 20000) {
-            // we've lost sync - restart
-            next_run_usec = get_micro64();
-        } else {
-            microsleep(dt);
-        }
-        next_run_usec += 10000;
-        joystick_get_pwms(&joystick, pwms, &len);
-        remote_send_pwms(&remote, pwms, len, (micro64 = get_micro64()));
-        debug_printf("Micros : %" PRIu64", Roll : %d, Pitch : %d, Throttle : %d, Yaw : %d, Mode : %d\n",
-                micro64, pwms[0], pwms[1], pwms[2], pwms[3], pwms[4]);
+    /* the writer and the server must not inherit the sender affinity */
+    if (record_dir != NULL && start_recording(record_dir) == -1) {
+        fprintf(stderr, "recording failed\n");
+        goto end;
     }
+    if (metrics_path != NULL && start_metrics(metrics_path) == -1) {
+        fprintf(stderr, "metrics failed\n");
+        goto end;
+    }
+
+    /* before the reader is created, for its stack to be locked */
+    rt_setup_sender(&rt);
+    /* started last, a replay begins with everything ready */
+    if (!use_epoll && rt_start_readers(&rt) == -1) {
+        fprintf(stderr, "joystick start failed\n");
+        goto end;
+    }
+    rt_self_check(&rt, !use_epoll);
+
+    if (use_epoll)
+        epoll_loop(on_change, min_gap_usec);
+    else if (on_change)
+        send_on_change_loop(min_gap_usec);
+    else
+        send_loop();
 
 end:
     exit(EXIT_SUCCESS);
@@ -0,0 +1,506 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "timebase.h"
+#include "rt.h"
+
+#define LOG_WRITER_NICE 10
+#define LOG_SPEC_SIZE 48
+
+enum log_arg_type {
+    LOG_ARG_NONE,
+    LOG_ARG_PERCENT,
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_STRING,
+    LOG_ARG_POINTER,
+};
+
+union log_arg {
+    int64_t i;
+    double d;
+    const void *p;
+    /* offset in strings */
+    uint32_t string;
+};
+
+struct log_record {
+    uint64_t usec;
+    const char *fmt;
+    uint8_t n_args;
+    uint8_t truncated;
+    union log_arg args[LOG_MAX_ARGS];
+    char strings[LOG_STRINGS_SIZE];
+};
+
+struct log_ring {
+    /* written by the producer */
+    uint32_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    /* written by the writer */
+    uint32_t tail __attribute__((aligned(64)));
+    struct log_record records[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+uint8_t log_levels[LOG_NUM_SUBSYSTEMS];
+
+static const char *log_subsystem_names[LOG_NUM_SUBSYSTEMS] = {
+    [LOG_MAIN] = "main",
+    [LOG_JOYSTICK] = "joystick",
+    [LOG_REMOTE] = "remote",
+    [LOG_PACER] = "pacer",
+    [LOG_RT] = "rt",
+    [LOG_TRAINER] = "trainer",
+    [LOG_RECORDER] = "recorder",
+};
+
+static const char *log_level_names[] = {
+    [LOG_OFF] = "off",
+    [LOG_INFO] = "info",
+    [LOG_DEBUG] = "debug",
+};
+
+static struct log_ring *log_rings[LOG_MAX_THREADS];
+static unsigned int log_n_rings;
+static __thread struct log_ring *log_thread_ring;
+/* records of the threads which did not get a ring */
+static uint64_t log_lost;
+static pthread_t log_writer;
+static int log_started;
+static int log_stopped;
+
+/*
+ * Finds the next conversion of *fmt, returns its type, the position of its
+ * '%' in *start and the number of '*' int arguments before its own.
+ */
+static enum log_arg_type log_next_conversion(const char **fmt,
+                                             const char **start,
+                                             unsigned int *stars)
+{
+    const char *p = strchr(*fmt, '%');
+    enum log_arg_type type = LOG_ARG_INT;
+
+    *stars = 0;
+    if (p == NULL) {
+        *fmt += strlen(*fmt);
+        return LOG_ARG_NONE;
+    }
+    *start = p++;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+        p++;
+    while ((*p >= '0' && *p <= '9') || *p == '.' || *p == '*')
+        if (*p++ == '*')
+            (*stars)++;
+    switch (*p) {
+    case 'h':
+        while (*p == 'h')
+            p++;
+        break;
+    case 'l':
+        type = LOG_ARG_LONG;
+        if (*++p == 'l') {
+            type = LOG_ARG_LLONG;
+            p++;
+        }
+        break;
+    case 'q':
+    case 'j':
+        type = LOG_ARG_LLONG;
+        p++;
+        break;
+    case 'z':
+        type = LOG_ARG_SIZE;
+        p++;
+        break;
+    case 't':
+        type = LOG_ARG_PTRDIFF;
+        p++;
+        break;
+    }
+    switch (*p) {
+    case '%':
+        type = LOG_ARG_PERCENT;
+        break;
+    case 'f': case 'F': case 'e': case 'E':
+    case 'g': case 'G': case 'a': case 'A':
+        type = LOG_ARG_DOUBLE;
+        break;
+    case 's':
+        type = LOG_ARG_STRING;
+        break;
+    case 'p':
+        type = LOG_ARG_POINTER;
+        break;
+    case '\0':
+        /* malformed, printed as is */
+        *fmt = p;
+        return LOG_ARG_NONE;
+    }
+    *fmt = p + 1;
+
+    return type;
+}
+
+int log_register_thread(void)
+{
+    struct log_ring *ring;
+    unsigned int i;
+
+    if (log_thread_ring != NULL)
+        return 0;
+    i = __atomic_fetch_add(&log_n_rings, 1, __ATOMIC_RELAXED);
+    if (i >= LOG_MAX_THREADS)
+        return -1;
+    ring = aligned_alloc(64, sizeof(*ring));
+    if (ring == NULL)
+        return -1;
+    memset(ring, 0, sizeof(*ring));
+    __atomic_store_n(&log_rings[i], ring, __ATOMIC_RELEASE);
+    log_thread_ring = ring;
+
+    return 0;
+}
+
+static uint32_t log_copy_string(struct log_record *record, uint32_t *used,
+                                const char *s)
+{
+    /* the last byte stays 0, for the strings which do not fit */
+    size_t len, space = LOG_STRINGS_SIZE - 1 - *used;
+    uint32_t offset = *used;
+
+    if (s == NULL)
+        s = "(null)";
+    if (space == 0)
+        return LOG_STRINGS_SIZE - 1;
+    len = strnlen(s, space - 1);
+    memcpy(&record->strings[offset], s, len);
+    record->strings[offset + len] = '\0';
+    *used += len + 1;
+
+    return offset;
+}
+
+void log_write(const char *fmt, ...)
+{
+    struct log_ring *ring = log_thread_ring;
+    struct log_record *record;
+    enum log_arg_type type;
+    unsigned int n = 0, stars;
+    uint32_t used = 0;
+    const char *start;
+    va_list ap;
+
+    if (ring == NULL) {
+        if (log_register_thread() == -1) {
+            __atomic_fetch_add(&log_lost, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        ring = log_thread_ring;
+    }
+    if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+        LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    record = &ring->records[ring->head % LOG_RING_SIZE];
+    record->usec = timebase_now_usec();
+    record->fmt = fmt;
+    record->truncated = 0;
+    record->strings[LOG_STRINGS_SIZE - 1] = '\0';
+
+    va_start(ap, fmt);
+    while ((type = log_next_conversion(&fmt, &start, &stars)) !=
+           LOG_ARG_NONE) {
+        if (type == LOG_ARG_PERCENT)
+            continue;
+        if (n + stars + 1 > LOG_MAX_ARGS) {
+            record->truncated = 1;
+            break;
+        }
+        while (stars-- > 0)
+            record->args[n++].i = va_arg(ap, int);
+        switch (type) {
+        case LOG_ARG_INT:
+            record->args[n].i = va_arg(ap, int);
+            break;
+        case LOG_ARG_LONG:
+            record->args[n].i = va_arg(ap, long);
+            break;
+        case LOG_ARG_LLONG:
+            record->args[n].i = va_arg(ap, long long);
+            break;
+        case LOG_ARG_SIZE:
+            record->args[n].i = va_arg(ap, size_t);
+            break;
+        case LOG_ARG_PTRDIFF:
+            record->args[n].i = va_arg(ap, ptrdiff_t);
+            break;
+        case LOG_ARG_DOUBLE:
+            record->args[n].d = va_arg(ap, double);
+            break;
+        case LOG_ARG_STRING:
+            record->args[n].string = log_copy_string(record, &used,
+                                                     va_arg(ap, const char *));
+            break;
+        case LOG_ARG_POINTER:
+            record->args[n].p = va_arg(ap, const void *);
+            break;
+        default:
+            break;
+        }
+        n++;
+    }
+    va_end(ap);
+    record->n_args = n;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* the '*' of the spec are replaced by their arguments */
+static void log_expand_spec(char *spec, const char *start, const char *end,
+                            const union log_arg *args)
+{
+    size_t len = 0;
+
+    for (; start < end && len < LOG_SPEC_SIZE - 12; start++) {
+        if (*start == '*')
+            len += sprintf(spec + len, "%d", (int) (args++)->i);
+        else
+            spec[len++] = *start;
+    }
+    spec[len] = '\0';
+}
+
+static void log_print(FILE *out, const struct log_record *record)
+{
+    const char *fmt = record->fmt, *prev = fmt, *start;
+    const union log_arg *arg = record->args;
+    char spec[LOG_SPEC_SIZE];
+    enum log_arg_type type;
+    unsigned int stars;
+
+    while ((type = log_next_conversion(&fmt, &start, &stars)) !=
+           LOG_ARG_NONE) {
+        fwrite(prev, 1, start - prev, out);
+        prev = fmt;
+        if (type == LOG_ARG_PERCENT) {
+            fputc('%', out);
+            continue;
+        }
+        if (arg + stars + 1 > record->args + record->n_args) {
+            fputs("...\n", out);
+            return;
+        }
+        log_expand_spec(spec, start, fmt, arg);
+        arg += stars;
+        switch (type) {
+        case LOG_ARG_INT:
+            fprintf(out, spec, (int) arg->i);
+            break;
+        case LOG_ARG_LONG:
+            fprintf(out, spec, (long) arg->i);
+            break;
+        case LOG_ARG_LLONG:
+            fprintf(out, spec, (long long) arg->i);
+            break;
+        case LOG_ARG_SIZE:
+            fprintf(out, spec, (size_t) arg->i);
+            break;
+        case LOG_ARG_PTRDIFF:
+            fprintf(out, spec, (ptrdiff_t) arg->i);
+            break;
+        case LOG_ARG_DOUBLE:
+            fprintf(out, spec, arg->d);
+            break;
+        case LOG_ARG_STRING:
+            fprintf(out, spec, &record->strings[arg->string]);
+            break;
+        case LOG_ARG_POINTER:
+            fprintf(out, spec, arg->p);
+            break;
+        default:
+            break;
+        }
+        arg++;
+    }
+    fputs(prev, out);
+}
+
+/* the rings are merged in timestamp order, each of them is in order */
+static void log_drain(void)
+{
+    uint32_t heads[LOG_MAX_THREADS], tails[LOG_MAX_THREADS];
+    struct log_ring *rings[LOG_MAX_THREADS];
+    const struct log_record *record, *first;
+    unsigned int i, n, best = 0, written = 0;
+
+    n = __atomic_load_n(&log_n_rings, __ATOMIC_RELAXED);
+    if (n > LOG_MAX_THREADS)
+        n = LOG_MAX_THREADS;
+    for (i = 0; i < n; i++) {
+        rings[i] = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (rings[i] == NULL) {
+            heads[i] = tails[i] = 0;
+            continue;
+        }
+        tails[i] = rings[i]->tail;
+        heads[i] = __atomic_load_n(&rings[i]->head, __ATOMIC_ACQUIRE);
+    }
+    for (;;) {
+        first = NULL;
+        for (i = 0; i < n; i++) {
+            if (tails[i] == heads[i])
+                continue;
+            record = &rings[i]->records[tails[i] % LOG_RING_SIZE];
+            if (first == NULL || record->usec < first->usec) {
+                first = record;
+                best = i;
+            }
+        }
+        if (first == NULL)
+            break;
+        log_print(stdout, first);
+        tails[best]++;
+        written++;
+    }
+    for (i = 0; i < n; i++)
+        if (rings[i] != NULL)
+            __atomic_store_n(&rings[i]->tail, tails[i], __ATOMIC_RELEASE);
+    if (written > 0)
+        fflush(stdout);
+}
+
+static void *log_thread(void *arg)
+{
+    struct timespec period;
+
+    (void) arg;
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid), LOG_WRITER_NICE) == -1)
+        perror("log_thread - setpriority");
+    timebase_usec_to_timespec(LOG_WRITER_PERIOD_USEC, &period);
+    while (!__atomic_load_n(&log_stopped, __ATOMIC_ACQUIRE)) {
+        log_drain();
+        nanosleep(&period, NULL);
+    }
+    log_drain();
+
+    return NULL;
+}
+
+void log_set_level(enum log_subsystem subsystem, enum log_level level)
+{
+    __atomic_store_n(&log_levels[subsystem], level, __ATOMIC_RELAXED);
+}
+
+int log_parse_levels(char *spec)
+{
+    char *item, *saveptr = NULL, *value;
+    unsigned int subsystem, level;
+
+    for (item = strtok_r(spec, ",", &saveptr); item != NULL;
+         item = strtok_r(NULL, ",", &saveptr)) {
+        value = strchr(item, '=');
+        if (value == NULL)
+            goto err_item;
+        *value++ = '\0';
+        for (level = 0; level <= LOG_DEBUG; level++)
+            if (strcmp(value, log_level_names[level]) == 0)
+                break;
+        if (level > LOG_DEBUG)
+            goto err_item;
+        if (strcmp(item, "all") == 0) {
+            for (subsystem = 0; subsystem < LOG_NUM_SUBSYSTEMS; subsystem++)
+                log_set_level(subsystem, level);
+            continue;
+        }
+        for (subsystem = 0; subsystem < LOG_NUM_SUBSYSTEMS; subsystem++)
+            if (strcmp(item, log_subsystem_names[subsystem]) == 0)
+                break;
+        if (subsystem == LOG_NUM_SUBSYSTEMS)
+            goto err_item;
+        log_set_level(subsystem, level);
+    }
+
+    return 0;
+err_item:
+    fprintf(stderr, "log_parse_levels : invalid %s, expected "
+            "main|joystick|remote|pacer|rt|trainer|recorder|all"
+            "=off|info|debug\n", item);
+    return -1;
+}
+
+int log_start(void)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    if (rt_background_attr(&attr) == -1)
+        return -1;
+    ret = pthread_create(&log_writer, &attr, log_thread, NULL);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("log_start - pthread_create");
+        return -1;
+    }
+    log_started = 1;
+
+    return 0;
+}
+
+void log_stop(void)
+{
+    if (__atomic_exchange_n(&log_stopped, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (log_started)
+        pthread_join(log_writer, NULL);
+    else
+        log_drain();
+}
+
+uint64_t log_dropped(void)
+{
+    uint64_t dropped = __atomic_load_n(&log_lost, __ATOMIC_RELAXED);
+    unsigned int i, n = __atomic_load_n(&log_n_rings, __ATOMIC_RELAXED);
+    struct log_ring *ring;
+
+    for (i = 0; i < n && i < LOG_MAX_THREADS; i++) {
+        ring = __atomic_load_n(&log_rings[i], __ATOMIC_ACQUIRE);
+        if (ring != NULL)
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+
+    return dropped;
+}
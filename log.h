@@ -0,0 +1,87 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LOG_H_
+#define _LOG_H_
+#include <stdint.h>
+
+/*
+ * Deferred logging : a call site only stores the format, its raw
+ * arguments and a timestamp in a ring owned by the calling thread, the
+ * formatting and the output are done by a writer thread, niced, every
+ * LOG_WRITER_PERIOD_USEC. The strings are copied, up to
+ * LOG_STRINGS_SIZE bytes per record, the formats must be literals. A full
+ * ring drops the record and counts it, the hot path never waits.
+ */
+#define LOG_MAX_ARGS 16
+#define LOG_STRINGS_SIZE 96
+#define LOG_RING_SIZE 512
+#define LOG_MAX_THREADS 16
+#define LOG_WRITER_PERIOD_USEC 20000
+
+enum log_subsystem {
+    LOG_MAIN,
+    LOG_JOYSTICK,
+    LOG_REMOTE,
+    LOG_PACER,
+    LOG_RT,
+    LOG_TRAINER,
+    LOG_RECORDER,
+    LOG_NUM_SUBSYSTEMS
+};
+
+enum log_level {
+    LOG_OFF,
+    /* setup and state changes */
+    LOG_INFO,
+    /* every event and every packet */
+    LOG_DEBUG,
+};
+
+extern uint8_t log_levels[LOG_NUM_SUBSYSTEMS];
+
+static inline int log_enabled(enum log_subsystem subsystem,
+                              enum log_level level)
+{
+    return __atomic_load_n(&log_levels[subsystem], __ATOMIC_RELAXED) >= level;
+}
+
+/* the arguments are not evaluated if the level is disabled */
+#define log_printf(subsystem, level, ...) \
+    do { \
+        if (log_enabled(subsystem, level)) \
+            log_write(__VA_ARGS__); \
+    } while (0)
+
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/*
+ * allocates the ring of the calling thread, done by its first log_write
+ * otherwise, real time threads call it before their loop
+ */
+int log_register_thread(void);
+
+void log_set_level(enum log_subsystem subsystem, enum log_level level);
+/* subsystem=level list, e.g. joystick=debug,remote=info or all=debug */
+int log_parse_levels(char *spec);
+/* called before the sender pins itself, so the writer runs on any cpu */
+int log_start(void);
+/* writes what is left, also without log_start */
+void log_stop(void);
+uint64_t log_dropped(void);
+
+#endif // _LOG_H_
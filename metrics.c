@@ -0,0 +1,321 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "timebase.h"
+#include "rt.h"
+
+#define METRICS_PREFIX "joystick_remote_"
+/* a client has this long to send its request, JSON is sent otherwise */
+#define METRICS_REQUEST_MSEC 100
+#define METRICS_SNAPSHOT_SIZE 8192
+
+static const char *metrics_counter_names[METRICS_NUM_COUNTERS] = {
+    [METRICS_EVENTS] = "events",
+    [METRICS_READS] = "reads",
+    [METRICS_DISCONNECTS] = "disconnects",
+    [METRICS_RECONNECTS] = "reconnects",
+    [METRICS_PACKETS] = "packets",
+    [METRICS_BYTES] = "bytes",
+    [METRICS_SEND_ERRORS] = "send_errors",
+    [METRICS_TXTIME_ERRORS] = "txtime_errors",
+    [METRICS_LOST_SYNC] = "lost_sync",
+};
+
+struct metrics_buffer {
+    char data[METRICS_SNAPSHOT_SIZE];
+    size_t len;
+};
+
+void metrics_set_pwms(struct metrics_pwms *pwms, const uint16_t *values,
+                      unsigned int n)
+{
+    unsigned int i;
+
+    if (n > METRICS_MAX_PWMS)
+        n = METRICS_MAX_PWMS;
+    /* a reader may mix two ticks, acceptable for gauges */
+    for (i = 0; i < n; i++)
+        __atomic_store_n(&pwms->values[i], values[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&pwms->n, n, __ATOMIC_RELAXED);
+}
+
+void metrics_init(struct metrics *metrics)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->fd = -1;
+    metrics->start_usec = timebase_now_usec();
+}
+
+int metrics_add_counters(struct metrics *metrics,
+                         const struct metrics_counters *counters)
+{
+    if (metrics->n_counters == METRICS_MAX_COUNTERS) {
+        fprintf(stderr, "metrics_add_counters : too many counters, max %d\n",
+                METRICS_MAX_COUNTERS);
+        return -1;
+    }
+    metrics->counters[metrics->n_counters++] = counters;
+
+    return 0;
+}
+
+int metrics_add_histogram(struct metrics *metrics, const char *key,
+                          const struct histogram *histogram)
+{
+    if (metrics->n_histograms == METRICS_MAX_HISTOGRAMS) {
+        fprintf(stderr, "metrics_add_histogram : too many histograms, "
+                "max %d\n", METRICS_MAX_HISTOGRAMS);
+        return -1;
+    }
+    metrics->histograms[metrics->n_histograms].key = key;
+    metrics->histograms[metrics->n_histograms].histogram = histogram;
+    metrics->n_histograms++;
+
+    return 0;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void metrics_append(struct metrics_buffer *buffer, const char *fmt, ...)
+{
+    size_t space = sizeof(buffer->data) - buffer->len;
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = vsnprintf(buffer->data + buffer->len, space, fmt, ap);
+    va_end(ap);
+    /* truncated, the end is lost */
+    if (ret > 0)
+        buffer->len += (size_t) ret < space ? (size_t) ret : space - 1;
+}
+
+static uint64_t metrics_sum(const struct metrics *metrics,
+                            enum metrics_counter counter)
+{
+    uint64_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < metrics->n_counters; i++)
+        sum += metrics_get(metrics->counters[i], counter);
+
+    return sum;
+}
+
+static void metrics_json(const struct metrics *metrics,
+                         struct metrics_buffer *buffer)
+{
+    const struct histogram *histogram;
+    unsigned int i, n;
+
+    metrics_append(buffer, "{\"uptime_usec\":%" PRIu64 ",\"counters\":{",
+                   timebase_now_usec() - metrics->start_usec);
+    for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+        metrics_append(buffer, "%s\"%s\":%" PRIu64, i == 0 ? "" : ",",
+                       metrics_counter_names[i], metrics_sum(metrics, i));
+    metrics_append(buffer, "},\"histograms\":{");
+    for (i = 0; i < metrics->n_histograms; i++) {
+        histogram = metrics->histograms[i].histogram;
+        metrics_append(buffer, "%s\"%s\":{\"count\":%" PRIu64
+                       ",\"p50\":%" PRIu64 ",\"p99\":%" PRIu64
+                       ",\"p999\":%" PRIu64 ",\"max\":%" PRIu64 "}",
+                       i == 0 ? "" : ",", metrics->histograms[i].key,
+                       __atomic_load_n(&histogram->count, __ATOMIC_RELAXED),
+                       histogram_percentile(histogram, 50.0),
+                       histogram_percentile(histogram, 99.0),
+                       histogram_percentile(histogram, 99.9),
+                       __atomic_load_n(&histogram->max, __ATOMIC_RELAXED));
+    }
+    metrics_append(buffer, "},\"pwms\":[");
+    n = metrics->pwms != NULL ?
+        __atomic_load_n(&metrics->pwms->n, __ATOMIC_RELAXED) : 0;
+    for (i = 0; i < n; i++)
+        metrics_append(buffer, "%s%u", i == 0 ? "" : ",",
+                       __atomic_load_n(&metrics->pwms->values[i],
+                                       __ATOMIC_RELAXED));
+    metrics_append(buffer, "]}\n");
+}
+
+static void metrics_prometheus(const struct metrics *metrics,
+                               struct metrics_buffer *buffer)
+{
+    static const double quantiles[] = {50.0, 99.0, 99.9};
+    const struct histogram *histogram;
+    const char *key;
+    unsigned int i, j, n;
+
+    metrics_append(buffer, "# TYPE " METRICS_PREFIX "uptime_seconds gauge\n"
+                   METRICS_PREFIX "uptime_seconds %.3f\n",
+                   (timebase_now_usec() - metrics->start_usec) / 1.0e6);
+    for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+        metrics_append(buffer, "# TYPE " METRICS_PREFIX "%s_total counter\n"
+                       METRICS_PREFIX "%s_total %" PRIu64 "\n",
+                       metrics_counter_names[i], metrics_counter_names[i],
+                       metrics_sum(metrics, i));
+    for (i = 0; i < metrics->n_histograms; i++) {
+        histogram = metrics->histograms[i].histogram;
+        key = metrics->histograms[i].key;
+        /* no _sum, the histograms don't keep it */
+        metrics_append(buffer, "# TYPE " METRICS_PREFIX "%s summary\n", key);
+        for (j = 0; j < sizeof(quantiles) / sizeof(quantiles[0]); j++)
+            metrics_append(buffer, METRICS_PREFIX "%s{quantile=\"%g\"} %"
+                           PRIu64 "\n", key, quantiles[j] / 100.0,
+                           histogram_percentile(histogram, quantiles[j]));
+        metrics_append(buffer, METRICS_PREFIX "%s_count %" PRIu64 "\n", key,
+                       __atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+    }
+    n = metrics->pwms != NULL ?
+        __atomic_load_n(&metrics->pwms->n, __ATOMIC_RELAXED) : 0;
+    if (n > 0)
+        metrics_append(buffer, "# TYPE " METRICS_PREFIX "pwm gauge\n");
+    for (i = 0; i < n; i++)
+        metrics_append(buffer, METRICS_PREFIX "pwm{channel=\"%u\"} %u\n", i,
+                       __atomic_load_n(&metrics->pwms->values[i],
+                                       __ATOMIC_RELAXED));
+}
+
+static void metrics_serve(struct metrics *metrics, int fd)
+{
+    static struct metrics_buffer buffer;
+    struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+    char request[256] = "";
+    const char *content_type;
+    char header[128];
+    int prometheus, http = 0, header_len = 0;
+    ssize_t ret;
+
+    if (poll(&pollfd, 1, METRICS_REQUEST_MSEC) == 1) {
+        ret = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT);
+        if (ret > 0)
+            request[ret] = '\0';
+        http = strncmp(request, "GET ", 4) == 0;
+    }
+    prometheus = strncmp(request, "prometheus", 10) == 0 ||
+                 strncmp(request, "GET /metrics", 12) == 0;
+    buffer.len = 0;
+    if (prometheus)
+        metrics_prometheus(metrics, &buffer);
+    else
+        metrics_json(metrics, &buffer);
+    if (http) {
+        content_type = prometheus ? "text/plain; version=0.0.4" :
+                       "application/json";
+        header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: %s\r\nContent-Length: %zu\r\n"
+                              "\r\n", content_type, buffer.len);
+        send(fd, header, header_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    }
+    /* a snapshot fits in the socket buffer, a stuck client loses it */
+    if (send(fd, buffer.data, buffer.len, MSG_NOSIGNAL | MSG_DONTWAIT) == -1)
+        perror("metrics_serve - send");
+}
+
+static void *metrics_thread(void *arg)
+{
+    struct metrics *metrics = arg;
+    struct pollfd pollfd = { .fd = metrics->fd, .events = POLLIN };
+    int fd;
+
+    while (!__atomic_load_n(&metrics->stop, __ATOMIC_ACQUIRE)) {
+        if (poll(&pollfd, 1, METRICS_POLL_MSEC) != 1)
+            continue;
+        fd = accept4(metrics->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR && errno != EAGAIN)
+                perror("metrics_thread - accept4");
+            continue;
+        }
+        metrics_serve(metrics, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int metrics_start(struct metrics *metrics, const char *path)
+{
+    struct sockaddr_un addr;
+    pthread_attr_t attr;
+    int ret;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics_start : %s is too long\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    strcpy(metrics->path, path);
+    metrics->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                         0);
+    if (metrics->fd == -1) {
+        perror("metrics_start - socket");
+        return -1;
+    }
+    /* left by a previous run */
+    unlink(path);
+    if (bind(metrics->fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("metrics_start - bind");
+        goto err_close;
+    }
+    if (listen(metrics->fd, 4) == -1) {
+        perror("metrics_start - listen");
+        goto err_unlink;
+    }
+
+    if (rt_background_attr(&attr) == -1)
+        goto err_unlink;
+    ret = pthread_create(&metrics->server, &attr, metrics_thread, metrics);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("metrics_start - pthread_create");
+        goto err_unlink;
+    }
+    metrics->started = 1;
+
+    return 0;
+err_unlink:
+    unlink(path);
+err_close:
+    close(metrics->fd);
+    metrics->fd = -1;
+    return -1;
+}
+
+void metrics_stop(struct metrics *metrics)
+{
+    if (!metrics->started ||
+        __atomic_exchange_n(&metrics->stop, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_join(metrics->server, NULL);
+    close(metrics->fd);
+    metrics->fd = -1;
+    unlink(metrics->path);
+}
@@ -0,0 +1,115 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/un.h>
+
+#include "histogram.h"
+
+#define METRICS_MAX_COUNTERS 16
+#define METRICS_MAX_HISTOGRAMS 8
+#define METRICS_MAX_PWMS 16
+/* how often the server checks for metrics_stop */
+#define METRICS_POLL_MSEC 200
+
+enum metrics_counter {
+    /* joystick threads */
+    METRICS_EVENTS,
+    METRICS_READS,
+    METRICS_DISCONNECTS,
+    METRICS_RECONNECTS,
+    /* sender thread */
+    METRICS_PACKETS,
+    METRICS_BYTES,
+    METRICS_SEND_ERRORS,
+    /* SO_TXTIME deadlines missed or refused by the qdisc */
+    METRICS_TXTIME_ERRORS,
+    /* ticks too late to be kept aligned, restarted from now */
+    METRICS_LOST_SYNC,
+    METRICS_NUM_COUNTERS
+};
+
+/*
+ * Counters of a single thread, on their own cache lines : the owner
+ * increments them with plain stores, they are only summed when the
+ * metrics are requested.
+ */
+struct metrics_counters {
+    uint64_t values[METRICS_NUM_COUNTERS];
+} __attribute__((aligned(64)));
+
+/* last pwms sent, written by the sender */
+struct metrics_pwms {
+    uint32_t n;
+    uint16_t values[METRICS_MAX_PWMS];
+} __attribute__((aligned(64)));
+
+struct metrics_histogram {
+    const char *key;
+    const struct histogram *histogram;
+};
+
+struct metrics {
+    const struct metrics_counters *counters[METRICS_MAX_COUNTERS];
+    unsigned int n_counters;
+    struct metrics_histogram histograms[METRICS_MAX_HISTOGRAMS];
+    unsigned int n_histograms;
+    const struct metrics_pwms *pwms;
+    uint64_t start_usec;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int fd;
+    pthread_t server;
+    uint8_t started;
+    int stop;
+};
+
+static inline void metrics_add(struct metrics_counters *counters,
+                               enum metrics_counter counter, uint64_t n)
+{
+    /* single writer, no need for an atomic increment */
+    __atomic_store_n(&counters->values[counter],
+                     counters->values[counter] + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_get(const struct metrics_counters *counters,
+                                   enum metrics_counter counter)
+{
+    return __atomic_load_n(&counters->values[counter], __ATOMIC_RELAXED);
+}
+
+void metrics_set_pwms(struct metrics_pwms *pwms, const uint16_t *values,
+                      unsigned int n);
+
+void metrics_init(struct metrics *metrics);
+int metrics_add_counters(struct metrics *metrics,
+                         const struct metrics_counters *counters);
+/* key is the metric name, e.g. tick_lateness_us */
+int metrics_add_histogram(struct metrics *metrics, const char *key,
+                          const struct histogram *histogram);
+/*
+ * Serves the snapshots on a unix stream socket at path : a client sending
+ * "prometheus" or "GET /metrics" gets the Prometheus text format, the
+ * others JSON.
+ */
+int metrics_start(struct metrics *metrics, const char *path);
+void metrics_stop(struct metrics *metrics);
+
+#endif // _METRICS_H_
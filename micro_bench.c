@@ -0,0 +1,326 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Microbenchmarks of the per-event and per-tick paths : the response
+ * curve, the event handling and publication, the state read by the
+ * sender, the mixer and the send to a local udp sink. Each one is run
+ * BENCH_RUNS times, the fastest run is reported in ns/op and, when the
+ * kernel allows perf events, cycles/op.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/joystick.h>
+#include <linux/perf_event.h>
+
+#include "joystick.h"
+#include "remote.h"
+#include "mixer.h"
+#include "curve.h"
+#include "timebase.h"
+
+#define BENCH_RUNS 5
+#define BENCH_NUM_VALUES 4096
+
+struct bench {
+    const char *name;
+    void (*run)(unsigned int n);
+    unsigned int iterations;
+};
+
+static int16_t values[BENCH_NUM_VALUES];
+static struct curve curve;
+static struct joystick joystick;
+static struct mixer mixer;
+static struct remote remote;
+static volatile uint32_t sink;
+/* perf event fd counting the cycles of this thread, -1 if not allowed */
+static int cycles_fd = -1;
+
+static void *sink_thread(void *arg)
+{
+    static char buffers[64][RCINPUT_UDP_V3_MAX_SIZE];
+    struct mmsghdr msgs[64];
+    struct iovec iovs[64];
+    int fd = *(int *) arg;
+    int i, ret;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < 64; i++) {
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = sizeof(buffers[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (1) {
+        ret = recvmmsg(fd, msgs, 64, MSG_WAITFORONE, NULL);
+        if (ret == -1 && errno != EINTR) {
+            perror("sink_thread - recvmmsg");
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* the kernel part is counted too, if perf_event_paranoid allows it */
+static int cycles_open(void)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd != -1)
+        return fd;
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd != -1)
+        printf("cycles of the user space only\n");
+    else
+        printf("cycles not available : %s\n", strerror(errno));
+
+    return fd;
+}
+
+static uint64_t cycles_read(void)
+{
+    uint64_t cycles = 0;
+
+    if (cycles_fd != -1 &&
+        read(cycles_fd, &cycles, sizeof(cycles)) != sizeof(cycles))
+        cycles = 0;
+
+    return cycles;
+}
+
+static void bench_curve_apply(unsigned int n)
+{
+    uint32_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+        sum += curve_apply(&curve, values[i % BENCH_NUM_VALUES]);
+    sink = sum;
+}
+
+/* a single axis event per frame, each one changes the state */
+static void bench_handle_axis(unsigned int n)
+{
+    struct js_event event = { .type = JS_EVENT_AXIS, .number = 0 };
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        event.value = values[i % BENCH_NUM_VALUES];
+        joystick_handle_events(&joystick, &event, 1, i);
+    }
+}
+
+/* mode buttons pressed and released */
+static void bench_handle_button(unsigned int n)
+{
+    struct js_event event = { .type = JS_EVENT_BUTTON };
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        event.number = (i / 2) % 4;
+        event.value = !(i & 1);
+        joystick_handle_events(&joystick, &event, 1, i);
+    }
+}
+
+/* the 2 sticks of a gamepad moving together, per frame */
+static void bench_handle_frame(unsigned int n)
+{
+    struct js_event events[4];
+    unsigned int i, j;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < 4; j++) {
+            events[j].type = JS_EVENT_AXIS;
+            events[j].number = j;
+            events[j].value = values[(i + j * 1024) % BENCH_NUM_VALUES];
+        }
+        joystick_handle_events(&joystick, events, 4, i);
+    }
+}
+
+static void bench_get_state(unsigned int n)
+{
+    struct joystick_state state;
+    uint32_t sum = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++) {
+        joystick_get_state(&joystick, &state);
+        sum += state.pwms.roll;
+    }
+    sink = sum;
+}
+
+static void bench_mixer(unsigned int n)
+{
+    int16_t inputs[MIXER_NUM_INPUTS];
+    uint16_t pwms[MIXER_NUM_OUTPUTS];
+    struct joystick_state state;
+    unsigned int i;
+
+    joystick_get_state(&joystick, &state);
+    for (i = 0; i < n; i++) {
+        state.axes[0] = values[i % BENCH_NUM_VALUES];
+        mixer_inputs(&state, inputs);
+        mixer_run(&mixer, inputs, pwms);
+    }
+    sink = pwms[0];
+}
+
+/* the sticks move at every send, version 3 has deltas to code */
+static void bench_send(unsigned int n)
+{
+    uint16_t pwms[MIXER_NUM_OUTPUTS];
+    unsigned int i;
+
+    for (i = 0; i < MIXER_NUM_OUTPUTS; i++)
+        pwms[i] = 1500;
+    for (i = 0; i < n; i++) {
+        pwms[i % 4] = 1000 + (values[i % BENCH_NUM_VALUES] + 32768) / 66;
+        remote_send_pwms(&remote, pwms, mixer.n_outputs * sizeof(*pwms),
+                         i * 10000ULL);
+    }
+}
+
+static void bench_send_v2(unsigned int n)
+{
+    remote_set_protocol(&remote, REMOTE_PROTOCOL_V2, 0);
+    bench_send(n);
+}
+
+static void bench_send_v3(unsigned int n)
+{
+    remote_set_protocol(&remote, REMOTE_PROTOCOL_V3, REMOTE_DEFAULT_HISTORY);
+    bench_send(n);
+}
+
+static void bench_run(const struct bench *bench)
+{
+    uint64_t start, cycles, best_nsec = UINT64_MAX, best_cycles = 0;
+    unsigned int run;
+
+    /* warm up the caches and the branch predictors */
+    bench->run(bench->iterations / 10);
+    for (run = 0; run < BENCH_RUNS; run++) {
+        cycles = cycles_read();
+        start = timebase_now_nsec();
+        bench->run(bench->iterations);
+        start = timebase_now_nsec() - start;
+        cycles = cycles_read() - cycles;
+        if (start < best_nsec) {
+            best_nsec = start;
+            best_cycles = cycles;
+        }
+    }
+    printf("%-28s %10u %10.1f", bench->name, bench->iterations,
+           (double) best_nsec / bench->iterations);
+    if (cycles_fd != -1)
+        printf(" %10.1f\n", (double) best_cycles / bench->iterations);
+    else
+        printf(" %10s\n", "-");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct bench benches[] = {
+        {"curve_apply", bench_curve_apply, 10000000},
+        {"joystick_handle_axis", bench_handle_axis, 2000000},
+        {"joystick_handle_button", bench_handle_button, 2000000},
+        {"joystick frame of 4 axes", bench_handle_frame, 1000000},
+        {"joystick_get_state", bench_get_state, 5000000},
+        {"mixer_inputs + mixer_run", bench_mixer, 2000000},
+        {"remote_send_pwms v2", bench_send_v2, 100000},
+        {"remote_send_pwms v3", bench_send_v3, 100000},
+    };
+    struct curve_config config;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char sink_host[64], *hosts[1] = {sink_host};
+    unsigned int i, scale = 1;
+    pthread_t sink_tid;
+    int sink_fd, fds[2];
+
+    if (argc > 2 || (argc == 2 && (scale = strtoul(argv[1], NULL, 10)) == 0)) {
+        fprintf(stderr, "usage: micro_bench [iterations multiplier]\n");
+        return EXIT_FAILURE;
+    }
+    srand(1);
+    for (i = 0; i < BENCH_NUM_VALUES; i++)
+        values[i] = rand() % 65536 - 32768;
+    curve_default_config(&config);
+    curve_compile(&config, 1, &curve);
+
+    /* the events are handed directly, the pipe is never read */
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("micro_bench - pipe2");
+        return EXIT_FAILURE;
+    }
+    if (joystick_attach(fds[0], "xbox360", JOYSTICK_BACKEND_JOYDEV,
+                        &joystick) == -1)
+        return EXIT_FAILURE;
+    mixer_init(&mixer);
+
+    sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink_fd == -1 ||
+        bind(sink_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        getsockname(sink_fd, (struct sockaddr *) &addr, &addrlen) == -1) {
+        perror("micro_bench - sink socket");
+        return EXIT_FAILURE;
+    }
+    snprintf(sink_host, sizeof(sink_host), "127.0.0.1:%d", ntohs(addr.sin_port));
+    pthread_create(&sink_tid, NULL, sink_thread, &sink_fd);
+    if (remote_start(hosts, 1, &remote) == -1)
+        return EXIT_FAILURE;
+
+    cycles_fd = cycles_open();
+    printf("%-28s %10s %10s %10s\n", "", "ops", "ns/op", "cycles/op");
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        struct bench bench = benches[i];
+
+        bench.iterations *= scale;
+        bench_run(&bench);
+    }
+
+    return EXIT_SUCCESS;
+}
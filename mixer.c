@@ -0,0 +1,179 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "joystick.h"
+#include "remote.h"
+#include "mixer.h"
+
+#define MIXER_PWM_MIN 800
+#define MIXER_PWM_MAX 2200
+
+static void mixer_enable_output(struct mixer *mixer, int output)
+{
+    if (mixer->max[output] != 0)
+        return;
+    mixer->offsets[output] = CURVE_PWM_CENTER;
+    mixer->min[output] = MIXER_PWM_MIN;
+    mixer->max[output] = MIXER_PWM_MAX;
+    if ((unsigned int) output >= mixer->n_outputs)
+        mixer->n_outputs = output + 1;
+}
+
+void mixer_init(struct mixer *mixer)
+{
+    int i;
+
+    memset(mixer, 0, sizeof(*mixer));
+    for (i = MIXER_INPUT_ROLL; i <= MIXER_INPUT_MODE; i++) {
+        mixer->weights[i][i] = 1 << MIXER_WEIGHT_SHIFT;
+        mixer_enable_output(mixer, i);
+    }
+}
+
+static int mixer_parse_input(const char *name)
+{
+    static const char *channels[] = {
+        "roll", "pitch", "throttle", "yaw", "mode"
+    };
+    unsigned int i;
+    char *end;
+    long n;
+
+    for (i = 0; i < sizeof(channels) / sizeof(channels[0]); i++) {
+        if (!strcmp(name, channels[i]))
+            return MIXER_INPUT_ROLL + i;
+    }
+    if (!strncmp(name, "axis", 4)) {
+        n = strtol(name + 4, &end, 10);
+        if (end != name + 4 && *end == '\0' &&
+            n >= 0 && n < JOYSTICK_NUM_RAW_AXES)
+            return MIXER_INPUT_AXIS0 + n;
+    } else if (!strncmp(name, "button", 6)) {
+        n = strtol(name + 6, &end, 10);
+        if (end != name + 6 && *end == '\0' &&
+            n >= 0 && n < MIXER_INPUT_END - MIXER_INPUT_BUTTON0)
+            return MIXER_INPUT_BUTTON0 + n;
+    }
+
+    return -1;
+}
+
+/*
+ * Each line of the file sets a weight of the matrix, starting from the
+ * default one, e.g.
+ * # output input weight (percent, from -199 to 199)
+ * 5 axis6 100
+ * 6 button2 -50
+ * # output offset center (us)
+ * 6 offset 1600
+ */
+int mixer_load(struct mixer *mixer, const char *path)
+{
+    struct mixer new_mixer;
+    char line[256], input[32];
+    int output, input_index, line_number = 0;
+    long value;
+    FILE *file;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        perror("mixer_load - fopen");
+        return -1;
+    }
+    mixer_init(&new_mixer);
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+        if (sscanf(line, "%d %31s %ld", &output, input, &value) != 3 ||
+            output < 0 || output >= MIXER_NUM_OUTPUTS) {
+            fprintf(stderr, "%s:%d : bad line\n", path, line_number);
+            goto err;
+        }
+        mixer_enable_output(&new_mixer, output);
+        if (!strcmp(input, "offset")) {
+            if (value < MIXER_PWM_MIN || value > MIXER_PWM_MAX) {
+                fprintf(stderr, "%s:%d : bad offset\n", path, line_number);
+                goto err;
+            }
+            new_mixer.offsets[output] = value;
+            continue;
+        }
+        input_index = mixer_parse_input(input);
+        if (input_index == -1 || value < -199 || value > 199) {
+            fprintf(stderr, "%s:%d : bad input or weight\n", path, line_number);
+            goto err;
+        }
+        new_mixer.weights[output][input_index] =
+            value * (1 << MIXER_WEIGHT_SHIFT) / 100;
+    }
+    fclose(file);
+
+    memcpy(mixer, &new_mixer, sizeof(*mixer));
+    return 0;
+err:
+    fclose(file);
+    return -1;
+}
+
+void mixer_inputs(const struct joystick_state *state, int16_t *inputs)
+{
+    const uint16_t *pwms = (const uint16_t *) &state->pwms;
+    int i;
+
+    memset(inputs, 0, MIXER_NUM_INPUTS * sizeof(*inputs));
+    for (i = MIXER_INPUT_ROLL; i <= MIXER_INPUT_MODE; i++)
+        inputs[i] = pwms[i] - CURVE_PWM_CENTER;
+    /* 32767 * 25 >> 11 is 399 */
+    for (i = 0; i < JOYSTICK_NUM_RAW_AXES; i++)
+        inputs[MIXER_INPUT_AXIS0 + i] = (state->axes[i] * 25) >> 11;
+    for (i = 0; i < MIXER_INPUT_END - MIXER_INPUT_BUTTON0; i++)
+        inputs[MIXER_INPUT_BUTTON0 + i] = (state->buttons >> i) & 1 ?
+                                          MIXER_INPUT_RANGE : -MIXER_INPUT_RANGE;
+}
+
+/*
+ * Plain loops over the flat matrix so the compiler vectorizes the dot
+ * products (pmaddwd on x86, vmlal on arm). The cost doesn't depend on how
+ * many inputs are mapped.
+ */
+void mixer_run(const struct mixer *mixer, const int16_t *inputs,
+               uint16_t *outputs)
+{
+    int32_t acc, out;
+    int i, j;
+
+    for (i = 0; i < MIXER_NUM_OUTPUTS; i++) {
+        acc = 0;
+        for (j = 0; j < MIXER_NUM_INPUTS; j++)
+            acc += (int32_t) mixer->weights[i][j] * inputs[j];
+        out = mixer->offsets[i] + (acc >> MIXER_WEIGHT_SHIFT);
+        if (out < mixer->min[i])
+            out = mixer->min[i];
+        else if (out > mixer->max[i])
+            out = mixer->max[i];
+        outputs[i] = out;
+    }
+}
@@ -0,0 +1,64 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _MIXER_H_
+#define _MIXER_H_
+
+#define MIXER_NUM_OUTPUTS RCINPUT_UDP_V3_MAX_CHANNELS
+
+/*
+ * Inputs are centered on 0 in pwm units : the joystick channels minus
+ * their center, the raw axes scaled to +-400 and the buttons at -400 when
+ * released and 400 when pressed. The vector is padded with zeros so the
+ * inner loop of mixer_run is a multiple of the simd width.
+ */
+enum {
+    MIXER_INPUT_ROLL,
+    MIXER_INPUT_PITCH,
+    MIXER_INPUT_THROTTLE,
+    MIXER_INPUT_YAW,
+    MIXER_INPUT_MODE,
+    MIXER_INPUT_AXIS0,
+    MIXER_INPUT_BUTTON0 = MIXER_INPUT_AXIS0 + JOYSTICK_NUM_RAW_AXES,
+    MIXER_INPUT_END = MIXER_INPUT_BUTTON0 + JOYSTICK_NUM_RAW_BUTTONS,
+};
+#define MIXER_NUM_INPUTS ((MIXER_INPUT_END + 15) & ~15)
+
+#define MIXER_INPUT_RANGE 400
+/* weights are fixed point, 1 << MIXER_WEIGHT_SHIFT is 100% */
+#define MIXER_WEIGHT_SHIFT 14
+
+struct mixer {
+    int16_t weights[MIXER_NUM_OUTPUTS][MIXER_NUM_INPUTS]
+        __attribute__((aligned(32)));
+    int32_t offsets[MIXER_NUM_OUTPUTS];
+    /* outputs are clamped, both 0 for the unused outputs */
+    int32_t min[MIXER_NUM_OUTPUTS];
+    int32_t max[MIXER_NUM_OUTPUTS];
+    /* the last enabled output plus one, what the senders transmit */
+    unsigned int n_outputs;
+};
+
+/* the joystick channels on the first outputs, the others unused */
+void mixer_init(struct mixer *mixer);
+int mixer_load(struct mixer *mixer, const char *path);
+void mixer_inputs(const struct joystick_state *state, int16_t *inputs);
+void mixer_run(const struct mixer *mixer, const int16_t *inputs,
+               uint16_t *outputs);
+
+#endif // _MIXER_H_
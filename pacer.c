@@ -0,0 +1,179 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "pacer.h"
+#include "log.h"
+
+int pacer_init(struct pacer *pacer, uint32_t min_period_usec,
+               uint32_t max_period_usec)
+{
+    uint32_t period;
+
+    if (min_period_usec == 0 || min_period_usec > max_period_usec) {
+        fprintf(stderr, "pacer_init : bad periods %u %u\n",
+                min_period_usec, max_period_usec);
+        return -1;
+    }
+    memset(pacer, 0, sizeof(*pacer));
+    for (period = min_period_usec;
+         pacer->n_levels < PACER_MAX_LEVELS - 1 && period < max_period_usec;
+         period *= 2)
+        pacer->periods[pacer->n_levels++] = period;
+    pacer->periods[pacer->n_levels++] = max_period_usec;
+    /* idle until the sticks move */
+    pacer->level = pacer->n_levels - 1;
+
+    return 0;
+}
+
+/* level matching a speed in pwm us per second */
+static unsigned int pacer_target_level(const struct pacer *pacer, uint64_t speed)
+{
+    unsigned int level = 0;
+    uint64_t threshold = PACER_FAST_SPEED;
+
+    while (level < pacer->n_levels - 1 && speed < threshold) {
+        threshold /= 2;
+        level++;
+    }
+
+    return level;
+}
+
+/* the time since the last update or wake was spent at the current level */
+static void pacer_account(struct pacer *pacer, uint64_t now_usec)
+{
+    uint64_t dt = now_usec - pacer->accounted_usec;
+
+    pacer->usec_at_level[pacer->level] += dt;
+    pacer->elapsed_usec += dt;
+    pacer->accounted_usec = now_usec;
+}
+
+/* in pwm us per second, from the last pwms sent */
+static uint64_t pacer_speed(const struct pacer *pacer, const uint16_t *pwms,
+                            unsigned int n_channels, uint64_t now_usec)
+{
+    unsigned int i, delta, max_delta = 0;
+    uint64_t dt = now_usec - pacer->last_usec;
+
+    for (i = 0; i < n_channels; i++) {
+        delta = abs(pwms[i] - pacer->last_pwms[i]);
+        if (delta > max_delta)
+            max_delta = delta;
+    }
+    if (dt > PACER_SPEED_WINDOW_USEC)
+        dt = PACER_SPEED_WINDOW_USEC;
+
+    return dt ? max_delta * 1000000ULL / dt : 0;
+}
+
+int pacer_wake(struct pacer *pacer, const uint16_t *pwms,
+               unsigned int n_channels, uint64_t now_usec)
+{
+    unsigned int target;
+
+    if (n_channels > PACER_MAX_CHANNELS)
+        n_channels = PACER_MAX_CHANNELS;
+    if (pacer->level == 0 || pacer->packets == 0 ||
+        n_channels != pacer->n_channels)
+        return 0;
+    target = pacer_target_level(pacer,
+                                pacer_speed(pacer, pwms, n_channels, now_usec));
+    if (target >= pacer->level)
+        return 0;
+    pacer_account(pacer, now_usec);
+    log_printf(LOG_PACER, LOG_INFO, "pacer : woken up, %u us period\n",
+               pacer->periods[target]);
+    pacer->level = target;
+    pacer->slower_since_usec = 0;
+
+    return 1;
+}
+
+uint32_t pacer_update(struct pacer *pacer, const uint16_t *pwms,
+                      unsigned int n_channels, uint64_t now_usec)
+{
+    unsigned int target;
+
+    if (n_channels > PACER_MAX_CHANNELS)
+        n_channels = PACER_MAX_CHANNELS;
+    if (pacer->packets == 0 || n_channels != pacer->n_channels) {
+        memcpy(pacer->last_pwms, pwms, n_channels * sizeof(*pwms));
+        pacer->n_channels = n_channels;
+        pacer->last_usec = now_usec;
+        pacer->accounted_usec = now_usec;
+        pacer->packets++;
+        return pacer_period(pacer);
+    }
+
+    target = pacer_target_level(pacer,
+                                pacer_speed(pacer, pwms, n_channels, now_usec));
+    pacer_account(pacer, now_usec);
+    pacer->last_usec = now_usec;
+    pacer->packets++;
+    memcpy(pacer->last_pwms, pwms, n_channels * sizeof(*pwms));
+
+    if (target < pacer->level) {
+        /* faster at once */
+        if (pacer->level == pacer->n_levels - 1)
+            log_printf(LOG_PACER, LOG_INFO, "pacer : moving, %u us period\n",
+                       pacer->periods[target]);
+        pacer->level = target;
+        pacer->slower_since_usec = 0;
+    } else if (target > pacer->level) {
+        if (pacer->slower_since_usec == 0) {
+            pacer->slower_since_usec = now_usec;
+        } else if (now_usec - pacer->slower_since_usec >= PACER_HOLD_USEC) {
+            pacer->level++;
+            /* the next level down needs its own hold time */
+            pacer->slower_since_usec = now_usec;
+        }
+    } else {
+        pacer->slower_since_usec = 0;
+    }
+
+    return pacer_period(pacer);
+}
+
+void pacer_print(const struct pacer *pacer, uint64_t bytes, FILE *file)
+{
+    uint64_t max_rate_packets, saved = 0;
+    unsigned int i;
+
+    /* nothing to report at a fixed rate */
+    if (pacer->n_levels < 2 || pacer->elapsed_usec == 0)
+        return;
+    fprintf(file, "time at rate :");
+    for (i = 0; i < pacer->n_levels; i++)
+        fprintf(file, " %uHz %.1f%%", 1000000 / pacer->periods[i],
+                100.0 * pacer->usec_at_level[i] / pacer->elapsed_usec);
+    max_rate_packets = pacer->elapsed_usec / pacer->periods[0];
+    /* at the average size of the sends, v3 ones shrink with the history */
+    if (max_rate_packets > pacer->packets && pacer->packets > 0)
+        saved = (max_rate_packets - pacer->packets) * bytes / pacer->packets;
+    fprintf(file, "\nbytes saved : %" PRIu64 " (%" PRIu64 " packets at %uHz "
+            "instead of %" PRIu64 ")\n", saved, pacer->packets,
+            1000000 / pacer->periods[0], max_rate_packets);
+}
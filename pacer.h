@@ -0,0 +1,80 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PACER_H_
+#define _PACER_H_
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Adaptive send rate : the periods go from min_period_usec (moving) to
+ * max_period_usec (idle), doubling at each level. The level follows the
+ * speed of the pwms, one level slower for each halving of the speed under
+ * PACER_FAST_SPEED. It goes faster at once, but slower only one level at
+ * a time, once the speed has been low for PACER_HOLD_USEC, so that it
+ * doesn't oscillate.
+ */
+#define PACER_MAX_LEVELS 16
+/* in pwm us per second, a full stick throw in 0.4s */
+#define PACER_FAST_SPEED 2000
+#define PACER_HOLD_USEC 1000000
+/* a change after a long idle time counts as done within this window */
+#define PACER_SPEED_WINDOW_USEC 100000
+#define PACER_MAX_CHANNELS 16
+
+struct pacer {
+    unsigned int n_levels;
+    uint32_t periods[PACER_MAX_LEVELS];
+    unsigned int level;
+    /* since when a slower level would do, 0 if not */
+    uint64_t slower_since_usec;
+    uint16_t last_pwms[PACER_MAX_CHANNELS];
+    unsigned int n_channels;
+    uint64_t last_usec;
+
+    /* stats, the time is accounted up to accounted_usec */
+    uint64_t accounted_usec;
+    uint64_t usec_at_level[PACER_MAX_LEVELS];
+    uint64_t packets;
+    uint64_t elapsed_usec;
+};
+
+/* both periods equal for a fixed rate */
+int pacer_init(struct pacer *pacer, uint32_t min_period_usec,
+               uint32_t max_period_usec);
+/* called with the pwms of each send, returns the period until the next one */
+uint32_t pacer_update(struct pacer *pacer, const uint16_t *pwms,
+                      unsigned int n_channels, uint64_t now_usec);
+/*
+ * when the joystick reports a change while slowed down : returns 1 and
+ * goes faster at once if the speed of pwms since the last send calls for
+ * it, so that a real move doesn't wait for the next idle tick
+ */
+int pacer_wake(struct pacer *pacer, const uint16_t *pwms,
+               unsigned int n_channels, uint64_t now_usec);
+static inline uint32_t pacer_period(const struct pacer *pacer)
+{
+    return pacer->periods[pacer->level];
+}
+/*
+ * time spent at each rate and the bytes saved compared to the max rate,
+ * bytes are the ones actually sent, whatever the protocol versions
+ */
+void pacer_print(const struct pacer *pacer, uint64_t bytes, FILE *file);
+
+#endif // _PACER_H_
@@ -0,0 +1,147 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "predictor.h"
+#include "joystick.h"
+
+_Static_assert(PREDICTOR_NUM_CHANNELS == JOYSTICK_NUM_AXIS, "stick channels");
+
+/* a full throw in 10ms, faster is noise */
+#define PREDICTOR_MAX_RATE 100000
+
+int32_t predictor_track(struct predictor_track *track, uint16_t pwm,
+                        uint64_t usec)
+{
+    int64_t dt = usec - track->usec, predicted, residual, rate;
+
+    if (track->usec == 0 || usec < track->usec ||
+        dt > PREDICTOR_RESET_USEC) {
+        track->value = pwm << 8;
+        track->rate = 0;
+        track->usec = usec;
+        return 0;
+    }
+    /* same timestamp, nothing to learn about the rate */
+    if (dt == 0) {
+        track->value = pwm << 8;
+        return track->rate;
+    }
+    predicted = track->value + (int64_t) track->rate * dt * 256 / 1000000;
+    residual = ((int64_t) pwm << 8) - predicted;
+    track->value = predicted + residual * PREDICTOR_ALPHA / 256;
+    rate = track->rate + residual * PREDICTOR_BETA * 1000000 / (256 * 256 * dt);
+    if (rate > PREDICTOR_MAX_RATE)
+        rate = PREDICTOR_MAX_RATE;
+    else if (rate < -PREDICTOR_MAX_RATE)
+        rate = -PREDICTOR_MAX_RATE;
+    track->rate = rate;
+    track->usec = usec;
+
+    return track->rate;
+}
+
+void predictor_init(struct predictor *predictor)
+{
+    memset(predictor, 0, sizeof(*predictor));
+}
+
+int predictor_set_prediction(struct predictor *predictor, char *spec)
+{
+    char *end;
+
+    predictor->horizon_usec = strtoul(spec, &end, 10);
+    predictor->clamp = PREDICTOR_DEFAULT_CLAMP;
+    if (*end == ',')
+        predictor->clamp = strtoul(end + 1, &end, 10);
+    if (*end != '\0' || predictor->horizon_usec == 0) {
+        fprintf(stderr, "predictor_set_prediction : bad %s, "
+                "horizon_usec[,clamp_us] expected\n", spec);
+        return -1;
+    }
+
+    return 0;
+}
+
+void predictor_set_slew_rate(struct predictor *predictor, uint32_t slew_rate)
+{
+    predictor->slew_rate = slew_rate;
+}
+
+static uint16_t predictor_add(uint16_t pwm, int64_t delta, uint16_t min,
+                              uint16_t max)
+{
+    int64_t value = pwm + delta;
+
+    return value < min ? min : value > max ? max : value;
+}
+
+void predictor_apply(struct predictor *predictor, struct joystick_state *state,
+                     uint64_t usec)
+{
+    uint16_t *pwms = (uint16_t *) &state->pwms;
+    int64_t delta, max;
+    unsigned int i;
+    uint64_t age;
+
+    for (i = 0; i < PREDICTOR_NUM_CHANNELS; i++) {
+        age = usec - state->axis_usec[i];
+        /* an old event means the stick stopped, not that it still moves */
+        if (predictor->horizon_usec != 0 && state->rates[i] != 0 &&
+            usec > state->axis_usec[i] && age <= predictor->horizon_usec) {
+            delta = (int64_t) state->rates[i] * (int64_t) age / 1000000;
+            if (delta > predictor->clamp || delta < -predictor->clamp) {
+                delta = delta > 0 ? predictor->clamp : -predictor->clamp;
+                predictor->clamped++;
+            }
+            /* the endpoints of the curve are a pilot setting */
+            pwms[i] = predictor_add(pwms[i], delta, state->pwm_min[i],
+                                    state->pwm_max[i]);
+            predictor->predicted++;
+        }
+        if (predictor->slew_rate != 0 && predictor->last_usec != 0) {
+            max = (uint64_t) predictor->slew_rate *
+                  (usec - predictor->last_usec) / 1000000;
+            delta = pwms[i] - predictor->last_pwms[i];
+            if (delta > max || delta < -max) {
+                pwms[i] = predictor_add(predictor->last_pwms[i],
+                                        delta > 0 ? max : -max,
+                                        0, UINT16_MAX);
+                predictor->limited++;
+            }
+        }
+        predictor->last_pwms[i] = pwms[i];
+    }
+    predictor->last_usec = usec;
+}
+
+void predictor_print(const struct predictor *predictor, FILE *file)
+{
+    if (predictor->horizon_usec != 0)
+        fprintf(file, "predicted %" PRIu64 " channels, clamped %" PRIu64
+                ", horizon %u us, clamp %u us\n", predictor->predicted,
+                predictor->clamped, predictor->horizon_usec, predictor->clamp);
+    if (predictor->slew_rate != 0)
+        fprintf(file, "slew limited %" PRIu64 " channels, %u us/s\n",
+                predictor->limited, predictor->slew_rate);
+}
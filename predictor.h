@@ -0,0 +1,80 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _PREDICTOR_H_
+#define _PREDICTOR_H_
+#include <stdio.h>
+#include <stdint.h>
+
+struct joystick_state;
+
+/*
+ * Stick prediction : the joystick thread tracks the rate of each stick
+ * channel with an alpha-beta filter, at each event, and publishes it with
+ * the time of the event. The sender extrapolates the pwms from there to
+ * the send time, if the event is less than horizon_usec old, and by at
+ * most clamp us, never past the curve endpoints. The slew limiter is the
+ * opposite trade, it bounds the pwm change per second to filter the
+ * jitter of the sticks.
+ */
+#define PREDICTOR_NUM_CHANNELS 4
+/* filter gains, in 1/256 */
+#define PREDICTOR_ALPHA 192
+#define PREDICTOR_BETA 64
+/* no event for that long, the stick stopped and the tracking restarts */
+#define PREDICTOR_RESET_USEC 100000
+#define PREDICTOR_DEFAULT_CLAMP 50
+
+/* alpha-beta state of a channel, only used by the joystick thread */
+struct predictor_track {
+    uint64_t usec;
+    /* filtered pwm, in 1/256 us */
+    int32_t value;
+    /* pwm us per second */
+    int32_t rate;
+};
+
+struct predictor {
+    /* 0 if no prediction */
+    uint32_t horizon_usec;
+    uint16_t clamp;
+    /* max pwm us per second, 0 if no limit */
+    uint32_t slew_rate;
+    uint16_t last_pwms[PREDICTOR_NUM_CHANNELS];
+    uint64_t last_usec;
+
+    /* stats */
+    uint64_t predicted;
+    uint64_t clamped;
+    uint64_t limited;
+};
+
+/* returns the rate estimated after the pwm measured at usec */
+int32_t predictor_track(struct predictor_track *track, uint16_t pwm,
+                        uint64_t usec);
+
+void predictor_init(struct predictor *predictor);
+/* spec is horizon_usec[,clamp_us] */
+int predictor_set_prediction(struct predictor *predictor, char *spec);
+void predictor_set_slew_rate(struct predictor *predictor, uint32_t slew_rate);
+/* updates the stick pwms of state for a send at usec, TIMEBASE_CLOCK */
+void predictor_apply(struct predictor *predictor, struct joystick_state *state,
+                     uint64_t usec);
+void predictor_print(const struct predictor *predictor, FILE *file);
+
+#endif // _PREDICTOR_H_
@@ -0,0 +1,560 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Stand-in for the vehicle : receives the rc_udp_packet stream and reports,
+ * per sender, the loss, reordering, duplicates, inter-arrival jitter and
+ * the skew of the sender clock. Packets are received by batches with
+ * recvmmsg and stamped by the kernel, so that high send rates can be
+ * measured without the receiver being the bottleneck.
+ *
+ * The version 3 datagrams are decoded in place. The receiver answers the
+ * version 2 senders with its capabilities, so that the ones in auto mode
+ * switch to version 3, and counts the updates recovered from the history
+ * of the later datagrams. With --echo, each datagram is echoed with its
+ * arrival time, for the sender to measure the round trip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <signal.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/time.h>
+
+#include "RCInput_UDP_Protocol.h"
+#include "rc_udp_v3.h"
+#include "histogram.h"
+#include "timebase.h"
+
+#define RECEIVER_BATCH 64
+#define RECEIVER_MAX_SENDERS 64
+#define RECEIVER_DEFAULT_PORT "8000"
+/* how often the caps are repeated to a sender still in version 2 */
+#define RECEIVER_CAPS_PERIOD_USEC 1000000
+
+struct sender {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char name[INET6_ADDRSTRLEN + 8];
+
+    uint32_t version;
+    uint64_t received;
+    uint64_t received_last_report;
+    uint64_t bytes;
+    uint64_t bytes_last_report;
+    uint64_t last_caps_usec;
+    /* missing sequence numbers, decremented when they arrive late */
+    int64_t lost;
+    uint64_t reordered;
+    uint64_t duplicates;
+    uint16_t next_sequence;
+    /* bit n is set if sequence n was received since it was last expected */
+    uint64_t seen[65536 / 64];
+
+    /* version 3, the updates are the frames, several per datagram */
+    uint64_t updates;
+    uint64_t recovered;
+    uint64_t updates_lost;
+    uint16_t next_frame;
+
+    /* previous packet, for the inter-arrival and the jitter */
+    uint64_t last_arrival_usec;
+    uint64_t last_timestamp_usec;
+    /* rfc 3550 interarrival jitter, in us */
+    double jitter;
+    struct histogram inter_arrival;
+
+    /* least squares of the clock offset against the arrival time */
+    uint64_t first_arrival_usec;
+    int64_t first_offset_usec;
+    double sx, sy, sxx, sxy;
+};
+
+static struct option long_options[] = {
+    {"bind",      required_argument, 0,     'b' },
+    {"port",      required_argument, 0,     'p' },
+    {"interval",  required_argument, 0,     'i' },
+    {"duration",  required_argument, 0,     'd' },
+    {"no-v3",     no_argument, 0,           'n' },
+    {"echo",      no_argument, 0,           'e' },
+    {"help",      no_argument, 0,           'h' },
+    {0, 0, 0, 0 }
+};
+
+static const char usage[] = "usage:\n\trc_receiver [-b bind_address] "
+                            "[-p port (default " RECEIVER_DEFAULT_PORT ")]\n"
+                            "\t\t[-i report_interval_sec (default 1)] "
+                            "[-d duration_sec (default forever)]\n"
+                            "\t\t[-n, --no-v3 only version 2, "
+                            "the caps are not sent]\n"
+                            "\t\t[-e, --echo echoes the sequence of each "
+                            "datagram, for --probe]\n\n";
+
+static struct sender senders[RECEIVER_MAX_SENDERS];
+static unsigned int n_senders;
+static uint64_t malformed;
+static int receiver_fd;
+static int v3_enabled = 1;
+static int echo_enabled = 0;
+/* the echoes of a batch, sent together once it is handled */
+static struct rc_udp_echo echoes[RECEIVER_BATCH];
+static struct iovec echo_iovs[RECEIVER_BATCH];
+static struct mmsghdr echo_msgs[RECEIVER_BATCH];
+static unsigned int n_echoes;
+static uint64_t echoed;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_handler(int signum)
+{
+    (void) signum;
+    stop_requested = 1;
+}
+
+static struct sender *sender_find(const struct sockaddr_storage *addr,
+                                  socklen_t addrlen)
+{
+    struct sender *sender;
+    char host[INET6_ADDRSTRLEN], port[8];
+    unsigned int i;
+
+    for (i = 0; i < n_senders; i++) {
+        if (senders[i].addrlen == addrlen &&
+            !memcmp(&senders[i].addr, addr, addrlen))
+            return &senders[i];
+    }
+    if (n_senders == RECEIVER_MAX_SENDERS)
+        return NULL;
+
+    sender = &senders[n_senders++];
+    memcpy(&sender->addr, addr, addrlen);
+    sender->addrlen = addrlen;
+    if (getnameinfo((const struct sockaddr *) addr, addrlen, host, sizeof(host),
+                    port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0)
+        strcpy(host, "?");
+    snprintf(sender->name, sizeof(sender->name), "%s:%s", host, port);
+    histogram_init(&sender->inter_arrival, "inter-arrival (us)");
+    printf("new sender %s\n", sender->name);
+
+    return sender;
+}
+
+static void sender_sequence(struct sender *sender, uint16_t sequence)
+{
+    uint64_t *word = &sender->seen[sequence / 64];
+    uint64_t bit = 1ULL << (sequence % 64);
+    int16_t delta = sequence - sender->next_sequence;
+    uint16_t missing;
+
+    if (sender->received == 0) {
+        delta = 0;
+    } else if (delta > 0) {
+        /* the skipped ones are lost until they show up */
+        sender->lost += delta;
+        for (missing = sender->next_sequence; missing != sequence; missing++)
+            sender->seen[missing / 64] &= ~(1ULL << (missing % 64));
+    } else if (delta < 0) {
+        if (*word & bit) {
+            sender->duplicates++;
+        } else {
+            sender->reordered++;
+            sender->lost--;
+            *word |= bit;
+        }
+        return;
+    }
+    *word |= bit;
+    sender->next_sequence = sequence + 1;
+}
+
+static void sender_timing(struct sender *sender, uint64_t arrival_usec,
+                          uint64_t timestamp_usec)
+{
+    int64_t offset = arrival_usec - timestamp_usec;
+    double d, x, y;
+
+    if (sender->received == 0) {
+        sender->first_arrival_usec = arrival_usec;
+        sender->first_offset_usec = offset;
+    } else {
+        histogram_record(&sender->inter_arrival,
+                         arrival_usec - sender->last_arrival_usec);
+        d = (double) (int64_t) (arrival_usec - sender->last_arrival_usec) -
+            (double) (int64_t) (timestamp_usec - sender->last_timestamp_usec);
+        sender->jitter += ((d < 0 ? -d : d) - sender->jitter) / 16;
+    }
+    sender->last_arrival_usec = arrival_usec;
+    sender->last_timestamp_usec = timestamp_usec;
+
+    x = (arrival_usec - sender->first_arrival_usec) * 1.0e-6;
+    y = offset - sender->first_offset_usec;
+    sender->sx += x;
+    sender->sy += y;
+    sender->sxx += x * x;
+    sender->sxy += x * y;
+}
+
+/*
+ * drift of the offset, in us per second of arrival, that is ppm; positive
+ * when the sender clock runs faster than the receiver one
+ */
+static double sender_skew_ppm(const struct sender *sender)
+{
+    double n = sender->received;
+    double den = n * sender->sxx - sender->sx * sender->sx;
+
+    if (n < 2 || den == 0)
+        return 0;
+    return -(n * sender->sxy - sender->sx * sender->sy) / den;
+}
+
+/* the version 3 timestamps are 32 bits, they wrap after 71 minutes */
+static uint64_t sender_unwrap(const struct sender *sender, uint32_t timestamp_us)
+{
+    if (sender->received == 0)
+        return timestamp_us;
+    return sender->last_timestamp_usec +
+           (int32_t) (timestamp_us - (uint32_t) sender->last_timestamp_usec);
+}
+
+/* the frames older than the newest one are those carried as history */
+static int sender_frames(struct sender *sender, struct rc_udp_v3_reader *reader)
+{
+    int16_t delta;
+    int ret;
+
+    while ((ret = rc_udp_v3_next(reader)) == 1) {
+        delta = reader->sequence - sender->next_frame;
+        if (sender->updates > 0 && delta < 0)
+            continue;
+        if (sender->updates > 0)
+            sender->updates_lost += delta;
+        if (reader->sequence != reader->header->sequence)
+            sender->recovered++;
+        sender->updates++;
+        sender->next_frame = reader->sequence + 1;
+    }
+
+    return ret;
+}
+
+static void send_caps(struct sender *sender, uint64_t arrival_usec)
+{
+    struct rc_udp_v3_caps caps = {
+        .magic = RCINPUT_UDP_V3_CAPS,
+        .max_channels = RCINPUT_UDP_V3_MAX_CHANNELS,
+        .max_frames = RCINPUT_UDP_V3_MAX_FRAMES,
+    };
+
+    if (sender->last_caps_usec != 0 &&
+        arrival_usec - sender->last_caps_usec < RECEIVER_CAPS_PERIOD_USEC)
+        return;
+    sender->last_caps_usec = arrival_usec;
+    if (sendto(receiver_fd, &caps, sizeof(caps), 0,
+               (const struct sockaddr *) &sender->addr, sender->addrlen) == -1)
+        perror("send_caps - sendto");
+}
+
+static void queue_echo(struct sender *sender, uint16_t sequence,
+                       uint64_t arrival_usec)
+{
+    struct msghdr *hdr = &echo_msgs[n_echoes].msg_hdr;
+
+    echoes[n_echoes].magic = RCINPUT_UDP_ECHO;
+    echoes[n_echoes].sequence = sequence;
+    echoes[n_echoes].receive_us = arrival_usec;
+    echo_iovs[n_echoes].iov_base = &echoes[n_echoes];
+    echo_iovs[n_echoes].iov_len = sizeof(echoes[n_echoes]);
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &sender->addr;
+    hdr->msg_namelen = sender->addrlen;
+    hdr->msg_iov = &echo_iovs[n_echoes];
+    hdr->msg_iovlen = 1;
+    n_echoes++;
+}
+
+/* on the clock of the arrival times, CLOCK_REALTIME */
+static void send_echoes(void)
+{
+    struct timespec now;
+    unsigned int i, sent = 0;
+    uint64_t send_usec;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    send_usec = timebase_timespec_to_usec(&now);
+    for (i = 0; i < n_echoes; i++)
+        echoes[i].send_us = send_usec;
+    while (sent < n_echoes) {
+        ret = sendmmsg(receiver_fd, &echo_msgs[sent], n_echoes - sent, 0);
+        if (ret == -1) {
+            perror("send_echoes - sendmmsg");
+            /* skip the failing sender */
+            sent++;
+            continue;
+        }
+        sent += ret;
+        echoed += ret;
+    }
+    n_echoes = 0;
+}
+
+static void handle_packet(const struct sockaddr_storage *addr, socklen_t addrlen,
+                          const void *buf, unsigned int len,
+                          uint64_t arrival_usec)
+{
+    const struct rc_udp_packet *packet = buf;
+    /* only opened for version 3, -flto can't tell and warns */
+    struct rc_udp_v3_reader reader = { 0 };
+    struct sender *sender;
+    uint64_t timestamp_usec;
+    uint16_t sequence;
+
+    if (len == sizeof(*packet) && packet->version == RCINPUT_UDP_VERSION) {
+        sequence = packet->sequence;
+    } else if (v3_enabled && rc_udp_v3_open(&reader, buf, len) == 0) {
+        sequence = reader.header->sequence;
+    } else {
+        malformed++;
+        return;
+    }
+    sender = sender_find(addr, addrlen);
+    if (sender == NULL) {
+        malformed++;
+        return;
+    }
+    sender->version = packet->version;
+    if (sender->version == RCINPUT_UDP_VERSION_3) {
+        if (sender_frames(sender, &reader) == -1) {
+            malformed++;
+            return;
+        }
+        timestamp_usec = sender_unwrap(sender, reader.header->timestamp_us);
+    } else {
+        if (v3_enabled)
+            send_caps(sender, arrival_usec);
+        timestamp_usec = packet->timestamp_us;
+    }
+    if (echo_enabled)
+        queue_echo(sender, sequence, arrival_usec);
+    sender_sequence(sender, sequence);
+    sender_timing(sender, arrival_usec, timestamp_usec);
+    sender->received++;
+    sender->bytes += len;
+}
+
+static void report(double interval)
+{
+    struct sender *sender;
+    uint64_t expected;
+    unsigned int i;
+
+    for (i = 0; i < n_senders; i++) {
+        sender = &senders[i];
+        expected = sender->received - sender->duplicates + sender->lost;
+        printf("%s : %" PRIu64 " packets, %.0f/s, lost %" PRId64 " (%.3f%%), "
+               "reordered %" PRIu64 ", duplicates %" PRIu64 ", "
+               "jitter %.1f us, skew %.1f ppm\n",
+               sender->name, sender->received,
+               (sender->received - sender->received_last_report) / interval,
+               sender->lost, expected ? 100.0 * sender->lost / expected : 0.0,
+               sender->reordered, sender->duplicates, sender->jitter,
+               sender_skew_ppm(sender));
+        printf("\tversion %" PRIu32 ", %" PRIu64 " bytes, %.0f/s\n",
+               sender->version, sender->bytes,
+               (sender->bytes - sender->bytes_last_report) / interval);
+        if (sender->version == RCINPUT_UDP_VERSION_3)
+            printf("\tupdates %" PRIu64 ", recovered from history %" PRIu64
+                   ", lost %" PRIu64 "\n", sender->updates,
+                   sender->recovered, sender->updates_lost);
+        histogram_print(&sender->inter_arrival, stdout);
+        sender->received_last_report = sender->received;
+        sender->bytes_last_report = sender->bytes;
+    }
+    if (echo_enabled)
+        printf("echoed : %" PRIu64 "\n", echoed);
+    if (malformed)
+        printf("malformed or unknown senders : %" PRIu64 "\n", malformed);
+    fflush(stdout);
+}
+
+static int receiver_socket(const char *bind_address, const char *port)
+{
+    struct addrinfo hints, *res;
+    /* wakes up at least every 100ms for the reports */
+    struct timeval rcvtimeo = {0, 100000};
+    int fd, ret, on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    ret = getaddrinfo(bind_address, port, &hints, &res);
+    if (ret != 0) {
+        fprintf(stderr, "receiver_socket - getaddrinfo : %s\n", gai_strerror(ret));
+        return -1;
+    }
+    fd = socket(res->ai_family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("receiver_socket - socket");
+        goto err_free;
+    }
+    /* kernel arrival time of each packet, not the one of the batch */
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) == -1) {
+        perror("receiver_socket - SO_TIMESTAMPNS");
+        goto err_close;
+    }
+    /* the recvmmsg timeout is only checked after a packet, use this one */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcvtimeo, sizeof(rcvtimeo)) == -1) {
+        perror("receiver_socket - SO_RCVTIMEO");
+        goto err_close;
+    }
+    if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        perror("receiver_socket - bind");
+        goto err_close;
+    }
+    freeaddrinfo(res);
+
+    return fd;
+err_close:
+    close(fd);
+err_free:
+    freeaddrinfo(res);
+    return -1;
+}
+
+/* arrival time from the control message, or now if missing */
+static uint64_t arrival_usec(struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return timebase_timespec_to_usec(&ts);
+        }
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return timebase_timespec_to_usec(&ts);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t packets[RECEIVER_BATCH][RCINPUT_UDP_V3_MAX_SIZE];
+    struct sockaddr_storage addrs[RECEIVER_BATCH];
+    char controls[RECEIVER_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+    struct mmsghdr msgs[RECEIVER_BATCH];
+    struct iovec iovs[RECEIVER_BATCH];
+    const char *bind_address = NULL, *port = RECEIVER_DEFAULT_PORT;
+    unsigned int interval = 1, duration = 0;
+    struct timespec now, start, last_report;
+    int fd, i, c, ret;
+
+    while ((c = getopt_long(argc, argv, "b:p:i:d:neh", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'b':
+            bind_address = optarg;
+            break;
+        case 'p':
+            port = optarg;
+            break;
+        case 'i':
+            interval = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            v3_enabled = 0;
+            break;
+        case 'e':
+            echo_enabled = 1;
+            break;
+        case 'h':
+        default:
+            printf(usage);
+            return EXIT_FAILURE;
+        }
+    }
+    if (interval == 0)
+        interval = 1;
+
+    fd = receiver_socket(bind_address, port);
+    if (fd == -1)
+        return EXIT_FAILURE;
+    receiver_fd = fd;
+    signal(SIGINT, stop_handler);
+    signal(SIGTERM, stop_handler);
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < RECEIVER_BATCH; i++) {
+        iovs[i].iov_base = packets[i];
+        iovs[i].iov_len = sizeof(packets[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    last_report = start;
+    while (!stop_requested) {
+        for (i = 0; i < RECEIVER_BATCH; i++) {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_control = controls[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+        }
+        ret = recvmmsg(fd, msgs, RECEIVER_BATCH, MSG_WAITFORONE, NULL);
+        if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+            perror("rc_receiver - recvmmsg");
+            break;
+        }
+        for (i = 0; i < ret; i++)
+            handle_packet(&addrs[i], msgs[i].msg_hdr.msg_namelen, packets[i],
+                          msgs[i].msg_len, arrival_usec(&msgs[i].msg_hdr));
+        if (n_echoes > 0)
+            send_echoes();
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timebase_timespec_to_usec(&now) - timebase_timespec_to_usec(&last_report) >=
+            interval * 1000000ULL) {
+            report((timebase_timespec_to_usec(&now) - timebase_timespec_to_usec(&last_report)) *
+                   1.0e-6);
+            last_report = now;
+        }
+        if (duration && timebase_timespec_to_usec(&now) - timebase_timespec_to_usec(&start) >=
+            duration * 1000000ULL)
+            break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    printf("final :\n");
+    report((timebase_timespec_to_usec(&now) - timebase_timespec_to_usec(&last_report)) * 1.0e-6);
+    close(fd);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,171 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "rc_udp_v3.h"
+
+#define RC_UDP_V3_MAX_VALUE ((1 << RCINPUT_UDP_V3_VALUE_BITS) - 1)
+
+static void put_bits(uint8_t *bits, unsigned int *pos, uint32_t value,
+                     unsigned int n)
+{
+    unsigned int i;
+
+    /* the buffer is cleared by the caller, only the ones are written */
+    for (i = 0; i < n; i++, (*pos)++) {
+        if (value & (1U << i))
+            bits[*pos / 8] |= 1 << (*pos % 8);
+    }
+}
+
+static uint32_t get_bits(const uint8_t *bits, unsigned int *pos, unsigned int n)
+{
+    uint32_t value = 0;
+    unsigned int i;
+
+    for (i = 0; i < n; i++, (*pos)++)
+        value |= (uint32_t) ((bits[*pos / 8] >> (*pos % 8)) & 1) << i;
+
+    return value;
+}
+
+/* 0 is kept for the unused channels, at a 0 pwm */
+static uint16_t to_value(uint16_t pwm)
+{
+    if (pwm == 0)
+        return 0;
+    if (pwm <= RCINPUT_UDP_V3_PWM_BASE)
+        return 1;
+    if (pwm - RCINPUT_UDP_V3_PWM_BASE > RC_UDP_V3_MAX_VALUE)
+        return RC_UDP_V3_MAX_VALUE;
+    return pwm - RCINPUT_UDP_V3_PWM_BASE;
+}
+
+unsigned int rc_udp_v3_encode(uint8_t *buf, uint16_t sequence,
+                              uint32_t timestamp_us, unsigned int n_channels,
+                              const uint16_t *const *frames,
+                              unsigned int n_frames)
+{
+    struct rc_udp_v3_header *header = (struct rc_udp_v3_header *) buf;
+    uint8_t *bits = buf + sizeof(*header);
+    unsigned int pos = 0, frame, i;
+    uint32_t mask, zigzag;
+    int32_t delta;
+
+    memset(buf, 0, RCINPUT_UDP_V3_MAX_SIZE);
+    header->version = RCINPUT_UDP_VERSION_3;
+    header->timestamp_us = timestamp_us;
+    header->sequence = sequence;
+    header->n_channels = n_channels;
+    header->n_frames = n_frames;
+
+    for (i = 0; i < n_channels; i++)
+        put_bits(bits, &pos, to_value(frames[0][i]), RCINPUT_UDP_V3_VALUE_BITS);
+    for (frame = 1; frame < n_frames; frame++) {
+        mask = 0;
+        for (i = 0; i < n_channels; i++) {
+            if (to_value(frames[frame][i]) != to_value(frames[frame - 1][i]))
+                mask |= 1U << i;
+        }
+        put_bits(bits, &pos, mask, n_channels);
+        for (i = 0; i < n_channels; i++) {
+            if (!(mask & (1U << i)))
+                continue;
+            delta = to_value(frames[frame][i]) - to_value(frames[frame - 1][i]);
+            zigzag = delta < 0 ? -2 * delta - 1 : 2 * delta;
+            /* 3 bits groups, the 4th bit is set if another one follows */
+            do {
+                put_bits(bits, &pos, (zigzag & 7) | (zigzag > 7 ? 8 : 0), 4);
+                zigzag >>= 3;
+            } while (zigzag);
+        }
+    }
+
+    return sizeof(*header) + (pos + 7) / 8;
+}
+
+int rc_udp_v3_open(struct rc_udp_v3_reader *reader, const void *buf,
+                   unsigned int len)
+{
+    const struct rc_udp_v3_header *header = buf;
+
+    if (len < sizeof(*header) || header->version != RCINPUT_UDP_VERSION_3 ||
+        header->n_channels == 0 ||
+        header->n_channels > RCINPUT_UDP_V3_MAX_CHANNELS ||
+        header->n_frames == 0 || header->n_frames > RCINPUT_UDP_V3_MAX_FRAMES)
+        return -1;
+    reader->header = header;
+    reader->bits = (const uint8_t *) buf + sizeof(*header);
+    reader->n_bits = (len - sizeof(*header)) * 8;
+    reader->pos = 0;
+    reader->frame = 0;
+
+    return 0;
+}
+
+int rc_udp_v3_next(struct rc_udp_v3_reader *reader)
+{
+    unsigned int n_channels = reader->header->n_channels;
+    unsigned int i, shift;
+    uint32_t mask, group, zigzag;
+    int32_t value;
+
+    if (reader->frame == reader->header->n_frames)
+        return 0;
+
+    if (reader->frame == 0) {
+        if (reader->pos + n_channels * RCINPUT_UDP_V3_VALUE_BITS > reader->n_bits)
+            return -1;
+        for (i = 0; i < n_channels; i++)
+            reader->values[i] = get_bits(reader->bits, &reader->pos,
+                                         RCINPUT_UDP_V3_VALUE_BITS);
+    } else {
+        if (reader->pos + n_channels > reader->n_bits)
+            return -1;
+        mask = get_bits(reader->bits, &reader->pos, n_channels);
+        for (i = 0; i < n_channels; i++) {
+            if (!(mask & (1U << i)))
+                continue;
+            zigzag = 0;
+            shift = 0;
+            do {
+                if (reader->pos + 4 > reader->n_bits || shift > 12)
+                    return -1;
+                group = get_bits(reader->bits, &reader->pos, 4);
+                zigzag |= (group & 7) << shift;
+                shift += 3;
+            } while (group & 8);
+            value = reader->values[i] +
+                    ((zigzag & 1) ? -(int32_t) ((zigzag + 1) / 2) :
+                                    (int32_t) (zigzag / 2));
+            if (value < 0 || value > RC_UDP_V3_MAX_VALUE)
+                return -1;
+            reader->values[i] = value;
+        }
+    }
+    for (i = 0; i < n_channels; i++)
+        reader->pwms[i] = reader->values[i] ?
+                          RCINPUT_UDP_V3_PWM_BASE + reader->values[i] : 0;
+    reader->sequence = reader->header->sequence -
+                       (reader->header->n_frames - 1 - reader->frame);
+    reader->frame++;
+
+    return 1;
+}
@@ -0,0 +1,52 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RC_UDP_V3_H_
+#define _RC_UDP_V3_H_
+#include <stdint.h>
+#include "RCInput_UDP_Protocol.h"
+
+/*
+ * frames[i] are the pwms of sequence - n_frames + 1 + i, returns the size
+ * of the datagram written to buf, at most RCINPUT_UDP_V3_MAX_SIZE
+ */
+unsigned int rc_udp_v3_encode(uint8_t *buf, uint16_t sequence,
+                              uint32_t timestamp_us, unsigned int n_channels,
+                              const uint16_t *const *frames,
+                              unsigned int n_frames);
+
+/* decodes a datagram in place, frame after frame */
+struct rc_udp_v3_reader {
+    const struct rc_udp_v3_header *header;
+    const uint8_t *bits;
+    unsigned int n_bits;
+    unsigned int pos;
+    unsigned int frame;
+    /* sequence and pwms of the last frame decoded */
+    uint16_t sequence;
+    uint16_t pwms[RCINPUT_UDP_V3_MAX_CHANNELS];
+    uint16_t values[RCINPUT_UDP_V3_MAX_CHANNELS];
+};
+
+/* checks the header, returns -1 if it is not a valid version 3 datagram */
+int rc_udp_v3_open(struct rc_udp_v3_reader *reader, const void *buf,
+                   unsigned int len);
+/* returns 1 when a frame was decoded, 0 after the newest, -1 if truncated */
+int rc_udp_v3_next(struct rc_udp_v3_reader *reader);
+
+#endif // _RC_UDP_V3_H_
@@ -0,0 +1,257 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Reads the segments written by joystick_remote --record, merges their
+ * records in time order and prints them as text or csv, or converts the
+ * js_event records of a controller back to a session replayable with -d.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+
+struct dump_record {
+    const struct recorder_record *record;
+    /* keeps the order of the records of a same time */
+    uint64_t order;
+};
+
+static struct option long_options[] = {
+    {"csv",       no_argument, 0,           'c' },
+    {"session",   required_argument, 0,     's' },
+    {"controller", required_argument, 0,    'i' },
+    {"help",      no_argument, 0,           'h' },
+    {0, 0, 0, 0 }
+};
+
+static const char usage[] = "usage:\n\trec_dump [-c] [-s session_file "
+                            "[-i controller (default 0)]] segment.rec...\n\n"
+                            "\t-c, --csv\tone csv line per record\n"
+                            "\t-s, --session file\twrites the js_event records "
+                            "of a controller, to be replayed with -d\n\n";
+
+static struct dump_record *records;
+static uint64_t n_records;
+static uint64_t start_usec, start_realtime_usec;
+
+/* the segment stays mapped until exit, the records point in it */
+static int load_segment(const char *path)
+{
+    const struct recorder_segment_header *segment;
+    const struct recorder_record *first;
+    struct dump_record *new_records;
+    struct stat st;
+    uint64_t i, count;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("load_segment - open");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("load_segment - fstat");
+        goto err_close;
+    }
+    if ((size_t) st.st_size < sizeof(*segment)) {
+        fprintf(stderr, "%s : too short\n", path);
+        goto err_close;
+    }
+    segment = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (segment == MAP_FAILED) {
+        perror("load_segment - mmap");
+        goto err_close;
+    }
+    close(fd);
+    if (segment->magic != RECORDER_MAGIC ||
+        segment->version != RECORDER_VERSION ||
+        segment->record_size != sizeof(struct recorder_record)) {
+        fprintf(stderr, "%s : not a version %d segment\n", path,
+                RECORDER_VERSION);
+        return -1;
+    }
+    /* a crashed writer leaves the preallocated size */
+    count = segment->count;
+    if (sizeof(*segment) + count * sizeof(*first) > (size_t) st.st_size) {
+        fprintf(stderr, "%s : truncated\n", path);
+        return -1;
+    }
+    start_usec = segment->start_usec;
+    start_realtime_usec = segment->start_realtime_usec;
+
+    new_records = realloc(records, (n_records + count) * sizeof(*records));
+    if (new_records == NULL) {
+        perror("load_segment - realloc");
+        return -1;
+    }
+    records = new_records;
+    first = (const struct recorder_record *) (segment + 1);
+    for (i = 0; i < count; i++) {
+        records[n_records].record = &first[i];
+        records[n_records].order = n_records;
+        n_records++;
+    }
+
+    return 0;
+err_close:
+    close(fd);
+    return -1;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const struct dump_record *ra = a, *rb = b;
+
+    if (ra->record->usec != rb->record->usec)
+        return ra->record->usec < rb->record->usec ? -1 : 1;
+    return ra->order < rb->order ? -1 : ra->order > rb->order;
+}
+
+static void print_record(const struct recorder_record *record, int csv)
+{
+    const struct recorder_packet *packet = &record->packet;
+    int64_t usec = record->usec - start_usec;
+    unsigned int i;
+
+    if (csv)
+        printf("%" PRId64 ",", usec);
+    else
+        printf("%4" PRId64 ".%06" PRId64 " ", usec / 1000000, usec % 1000000);
+
+    switch (record->type) {
+    case RECORDER_JS_EVENT:
+        printf(csv ? "js,%u,%u,%u,%d\n" : "js     %u type %u number %u value %d\n",
+               record->source, record->js_event.type, record->js_event.number,
+               record->js_event.value);
+        break;
+    case RECORDER_INPUT_EVENT:
+        printf(csv ? "input,%u,%u,%u,%d\n" : "input  %u type %u code %u value %d\n",
+               record->source, record->input_event.type,
+               record->input_event.code, record->input_event.value);
+        break;
+    case RECORDER_PACKET:
+        printf(csv ? "packet,%u,%" PRIu64 ",%u" : "packet v%u timestamp %" PRIu64
+               " sequence %u :", packet->version, packet->timestamp_us,
+               packet->sequence);
+        for (i = 0; i < packet->n_channels && i < RECORDER_MAX_CHANNELS; i++)
+            printf(csv ? ",%u" : " %u", packet->pwms[i]);
+        printf("\n");
+        break;
+    default:
+        printf(csv ? "unknown,%u\n" : "unknown type %u\n", record->type);
+        break;
+    }
+}
+
+/* the js_event times are in ms since the start of the recording */
+static int write_session(const char *path, unsigned int controller)
+{
+    const struct recorder_record *record;
+    struct js_event event;
+    uint64_t i, written = 0;
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        perror("write_session - fopen");
+        return -1;
+    }
+    for (i = 0; i < n_records; i++) {
+        record = records[i].record;
+        if (record->type != RECORDER_JS_EVENT || record->source != controller)
+            continue;
+        event = record->js_event;
+        event.time = (record->usec - start_usec) / 1000;
+        if (fwrite(&event, sizeof(event), 1, file) != 1) {
+            perror("write_session - fwrite");
+            fclose(file);
+            return -1;
+        }
+        written++;
+    }
+    if (fclose(file) == EOF) {
+        perror("write_session - fclose");
+        return -1;
+    }
+    fprintf(stderr, "%" PRIu64 " events of controller %u written to %s\n",
+            written, controller, path);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *session_path = NULL;
+    unsigned int controller = 0;
+    uint64_t i;
+    int c, csv = 0;
+
+    while ((c = getopt_long(argc, argv, "cs:i:h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'c':
+            csv = 1;
+            break;
+        case 's':
+            session_path = optarg;
+            break;
+        case 'i':
+            controller = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+        default:
+            printf(usage);
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind == argc) {
+        printf(usage);
+        return EXIT_FAILURE;
+    }
+    for (; optind < argc; optind++) {
+        if (load_segment(argv[optind]) == -1)
+            return EXIT_FAILURE;
+    }
+    /* the writer drains the rings one after the other */
+    qsort(records, n_records, sizeof(*records), compare_records);
+
+    if (session_path != NULL)
+        return write_session(session_path, controller) == -1 ?
+               EXIT_FAILURE : EXIT_SUCCESS;
+
+    if (csv)
+        printf("usec,type,source or version,...\n");
+    else
+        printf("# %" PRIu64 " records, started at %" PRIu64 ".%06" PRIu64
+               " (realtime)\n", n_records, start_realtime_usec / 1000000,
+               start_realtime_usec % 1000000);
+    for (i = 0; i < n_records; i++)
+        print_record(records[i].record, csv);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,327 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recorder.h"
+#include "timebase.h"
+#include "log.h"
+#include "rt.h"
+
+#define RECORDER_SEGMENT_SIZE \
+    (sizeof(struct recorder_segment_header) + \
+     RECORDER_SEGMENT_RECORDS * sizeof(struct recorder_record))
+
+_Static_assert(sizeof(struct recorder_record) == 64, "record size");
+_Static_assert(sizeof(struct recorder_segment_header) == 64, "header size");
+
+int recorder_init(struct recorder *recorder, const char *dir)
+{
+    struct timespec now;
+    struct stat st;
+
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->fd = -1;
+    if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "recorder_init : %s is not a directory\n", dir);
+        return -1;
+    }
+    if (strlen(dir) >= sizeof(recorder->dir)) {
+        fprintf(stderr, "recorder_init : %s is too long\n", dir);
+        return -1;
+    }
+    strcpy(recorder->dir, dir);
+    recorder->start_usec = timebase_now_usec();
+    clock_gettime(CLOCK_REALTIME, &now);
+    recorder->start_realtime_usec = timebase_timespec_to_usec(&now);
+
+    return 0;
+}
+
+struct recorder_ring *recorder_add_ring(struct recorder *recorder,
+                                        uint8_t source)
+{
+    struct recorder_ring *ring;
+
+    if (recorder->n_rings == RECORDER_MAX_RINGS) {
+        fprintf(stderr, "recorder_add_ring : too many rings, max %d\n",
+                RECORDER_MAX_RINGS);
+        return NULL;
+    }
+    ring = aligned_alloc(64, sizeof(*ring));
+    if (ring == NULL) {
+        perror("recorder_add_ring - aligned_alloc");
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->source = source;
+    recorder->rings[recorder->n_rings++] = ring;
+
+    return ring;
+}
+
+/*
+ * Claims up to n consecutive records, returns how many. The others are
+ * dropped, the hot path never waits for the writer.
+ */
+static unsigned int recorder_claim(struct recorder_ring *ring, unsigned int n)
+{
+    uint32_t used = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned int available = RECORDER_RING_SIZE - used;
+
+    if (n > available) {
+        __atomic_store_n(&ring->dropped, ring->dropped + n - available,
+                         __ATOMIC_RELAXED);
+        n = available;
+    }
+
+    return n;
+}
+
+static struct recorder_record *recorder_slot(struct recorder_ring *ring,
+                                             unsigned int i)
+{
+    return &ring->records[(ring->head + i) % RECORDER_RING_SIZE];
+}
+
+static void recorder_commit(struct recorder_ring *ring, unsigned int n)
+{
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_RELEASE);
+}
+
+void recorder_push_js_events(struct recorder_ring *ring, uint64_t usec,
+                             const struct js_event *events, unsigned int n)
+{
+    struct recorder_record *record;
+    unsigned int i;
+
+    n = recorder_claim(ring, n);
+    for (i = 0; i < n; i++) {
+        record = recorder_slot(ring, i);
+        record->usec = usec;
+        record->type = RECORDER_JS_EVENT;
+        record->source = ring->source;
+        record->js_event = events[i];
+    }
+    recorder_commit(ring, n);
+}
+
+void recorder_push_input_events(struct recorder_ring *ring,
+                                const struct input_event *events,
+                                unsigned int n)
+{
+    struct recorder_record *record;
+    unsigned int i;
+
+    n = recorder_claim(ring, n);
+    for (i = 0; i < n; i++) {
+        record = recorder_slot(ring, i);
+        /* CLOCK_MONOTONIC, see evdev_open */
+        record->usec = events[i].input_event_sec * 1000000ULL +
+                       events[i].input_event_usec;
+        record->type = RECORDER_INPUT_EVENT;
+        record->source = ring->source;
+        record->input_event.type = events[i].type;
+        record->input_event.code = events[i].code;
+        record->input_event.value = events[i].value;
+    }
+    recorder_commit(ring, n);
+}
+
+void recorder_push_packet(struct recorder_ring *ring, uint64_t usec,
+                          const struct recorder_packet *packet)
+{
+    struct recorder_record *record;
+
+    if (recorder_claim(ring, 1) == 0)
+        return;
+    record = recorder_slot(ring, 0);
+    record->usec = usec;
+    record->type = RECORDER_PACKET;
+    record->source = ring->source;
+    record->packet = *packet;
+    recorder_commit(ring, 1);
+}
+
+/* the whole segment is allocated up front, the writer never extends it */
+static int recorder_open_segment(struct recorder *recorder)
+{
+    struct recorder_segment_header *segment;
+    char path[sizeof(recorder->dir) + 16];
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "%s/%04u.rec", recorder->dir,
+             recorder->n_segments);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("recorder_open_segment - open");
+        return -1;
+    }
+    ret = posix_fallocate(fd, 0, RECORDER_SEGMENT_SIZE);
+    if (ret != 0) {
+        errno = ret;
+        perror("recorder_open_segment - posix_fallocate");
+        goto err_close;
+    }
+    segment = mmap(NULL, RECORDER_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        perror("recorder_open_segment - mmap");
+        goto err_close;
+    }
+    segment->magic = RECORDER_MAGIC;
+    segment->version = RECORDER_VERSION;
+    segment->record_size = sizeof(struct recorder_record);
+    segment->segment = recorder->n_segments++;
+    segment->start_usec = recorder->start_usec;
+    segment->start_realtime_usec = recorder->start_realtime_usec;
+    recorder->segment = segment;
+    recorder->fd = fd;
+    log_printf(LOG_RECORDER, LOG_INFO, "recorder : writing %s\n", path);
+
+    return 0;
+err_close:
+    close(fd);
+    return -1;
+}
+
+/* the preallocated records which were not used are cut */
+static void recorder_close_segment(struct recorder *recorder)
+{
+    uint64_t count = recorder->segment->count;
+
+    munmap(recorder->segment, RECORDER_SEGMENT_SIZE);
+    recorder->segment = NULL;
+    if (ftruncate(recorder->fd, sizeof(struct recorder_segment_header) +
+                  count * sizeof(struct recorder_record)) == -1)
+        perror("recorder_close_segment - ftruncate");
+    close(recorder->fd);
+    recorder->fd = -1;
+}
+
+/* the records of each ring are in order, not those of different rings */
+static void recorder_drain(struct recorder *recorder)
+{
+    struct recorder_record *records;
+    struct recorder_ring *ring;
+    uint32_t head, tail;
+    unsigned int i, n;
+    uint64_t count;
+
+    for (i = 0; i < recorder->n_rings; i++) {
+        ring = recorder->rings[i];
+        tail = ring->tail;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while (tail != head) {
+            if (recorder->segment != NULL &&
+                recorder->segment->count == RECORDER_SEGMENT_RECORDS)
+                recorder_close_segment(recorder);
+            /* on error, the records are dropped and it is tried again */
+            if (recorder->segment == NULL &&
+                recorder_open_segment(recorder) == -1) {
+                __atomic_store_n(&recorder->lost,
+                                 recorder->lost + head - tail,
+                                 __ATOMIC_RELAXED);
+                tail = head;
+                break;
+            }
+            count = recorder->segment->count;
+            records = (struct recorder_record *) (recorder->segment + 1);
+            n = head - tail;
+            if (n > RECORDER_RING_SIZE - tail % RECORDER_RING_SIZE)
+                n = RECORDER_RING_SIZE - tail % RECORDER_RING_SIZE;
+            if (n > RECORDER_SEGMENT_RECORDS - count)
+                n = RECORDER_SEGMENT_RECORDS - count;
+            memcpy(&records[count], &ring->records[tail % RECORDER_RING_SIZE],
+                   n * sizeof(*records));
+            tail += n;
+            /* the count is only updated once the records are there */
+            __atomic_store_n(&recorder->segment->count, count + n,
+                             __ATOMIC_RELEASE);
+            __atomic_store_n(&recorder->written, recorder->written + n,
+                             __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void *recorder_thread(void *arg)
+{
+    struct recorder *recorder = arg;
+    struct timespec period;
+
+    timebase_usec_to_timespec(RECORDER_WRITER_PERIOD_USEC, &period);
+    while (!__atomic_load_n(&recorder->stop, __ATOMIC_ACQUIRE)) {
+        recorder_drain(recorder);
+        nanosleep(&period, NULL);
+    }
+    recorder_drain(recorder);
+
+    return NULL;
+}
+
+int recorder_start(struct recorder *recorder)
+{
+    pthread_attr_t attr;
+    int ret;
+
+    if (rt_background_attr(&attr) == -1)
+        return -1;
+    ret = pthread_create(&recorder->writer, &attr, recorder_thread, recorder);
+    pthread_attr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("recorder_start - pthread_create");
+        return -1;
+    }
+    recorder->started = 1;
+
+    return 0;
+}
+
+void recorder_stop(struct recorder *recorder)
+{
+    if (!recorder->started ||
+        __atomic_exchange_n(&recorder->stop, 1, __ATOMIC_ACQ_REL))
+        return;
+    pthread_join(recorder->writer, NULL);
+    if (recorder->segment != NULL)
+        recorder_close_segment(recorder);
+}
+
+uint64_t recorder_dropped(const struct recorder *recorder)
+{
+    uint64_t dropped = __atomic_load_n(&recorder->lost, __ATOMIC_RELAXED);
+    unsigned int i;
+
+    for (i = 0; i < recorder->n_rings; i++)
+        dropped += __atomic_load_n(&recorder->rings[i]->dropped,
+                                   __ATOMIC_RELAXED);
+
+    return dropped;
+}
@@ -0,0 +1,147 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/input.h>
+#include <linux/joystick.h>
+
+/*
+ * Binary recorder of the input events and of the packets sent. Each
+ * producer thread pushes fixed size records in its own single producer,
+ * single consumer ring, without any syscall or lock : a full ring drops
+ * the record and counts it. A writer thread drains the rings every
+ * RECORDER_WRITER_PERIOD_USEC into preallocated segment files, mapped in
+ * memory, so a crash of the process loses nothing already drained.
+ */
+#define RECORDER_RING_SIZE 4096
+#define RECORDER_MAX_RINGS 8
+#define RECORDER_WRITER_PERIOD_USEC 20000
+/* 4MB segments, about 5 minutes of a controller and a 100Hz stream */
+#define RECORDER_SEGMENT_RECORDS 65536
+#define RECORDER_MAGIC 0x43455252
+#define RECORDER_VERSION 1
+#define RECORDER_MAX_CHANNELS 16
+
+enum {
+    /* a js_event, joydev devices and replays */
+    RECORDER_JS_EVENT = 1,
+    /* an input_event, evdev devices */
+    RECORDER_INPUT_EVENT,
+    /* the content of a packet sent to the first destination */
+    RECORDER_PACKET,
+};
+
+struct recorder_input_event {
+    uint16_t type;
+    uint16_t code;
+    int32_t value;
+};
+
+struct recorder_packet {
+    /* timestamp sent in the packet */
+    uint64_t timestamp_us;
+    uint16_t sequence;
+    uint8_t version;
+    uint8_t n_channels;
+    uint16_t pwms[RECORDER_MAX_CHANNELS];
+};
+
+struct recorder_record {
+    /* TIMEBASE_CLOCK time, of the read for the js_event */
+    uint64_t usec;
+    uint8_t type;
+    /* the controller of an event, 0 for a packet */
+    uint8_t source;
+    uint8_t reserved[6];
+    union {
+        struct js_event js_event;
+        struct recorder_input_event input_event;
+        struct recorder_packet packet;
+        uint8_t raw[48];
+    };
+};
+
+/* at the beginning of each segment file, followed by the records */
+struct recorder_segment_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint32_t segment;
+    uint32_t reserved;
+    /* records written, updated after each drain */
+    uint64_t count;
+    /* TIMEBASE_CLOCK and CLOCK_REALTIME times of the recorder start */
+    uint64_t start_usec;
+    uint64_t start_realtime_usec;
+    uint8_t padding[24];
+};
+
+struct recorder_ring {
+    /* written by the producer */
+    uint32_t head __attribute__((aligned(64)));
+    uint64_t dropped;
+    uint8_t source;
+    /* written by the writer */
+    uint32_t tail __attribute__((aligned(64)));
+    struct recorder_record records[RECORDER_RING_SIZE]
+        __attribute__((aligned(64)));
+};
+
+struct recorder {
+    char dir[256];
+    struct recorder_ring *rings[RECORDER_MAX_RINGS];
+    unsigned int n_rings;
+    pthread_t writer;
+    int started;
+    int stop;
+    uint64_t start_usec;
+    uint64_t start_realtime_usec;
+
+    /* only accessed by the writer, but for the stats */
+    int fd;
+    struct recorder_segment_header *segment;
+    uint32_t n_segments;
+    uint64_t written;
+    /* drained while no segment could be opened */
+    uint64_t lost;
+};
+
+/* the segments are written in dir, which must exist */
+int recorder_init(struct recorder *recorder, const char *dir);
+/* a ring per producer thread, before recorder_start */
+struct recorder_ring *recorder_add_ring(struct recorder *recorder,
+                                        uint8_t source);
+/* starts the writer thread, which gets the cpu mask of the caller */
+int recorder_start(struct recorder *recorder);
+/* drains what is left and closes the last segment */
+void recorder_stop(struct recorder *recorder);
+/* records lost because a ring was full or a segment couldn't be opened */
+uint64_t recorder_dropped(const struct recorder *recorder);
+
+void recorder_push_js_events(struct recorder_ring *ring, uint64_t usec,
+                             const struct js_event *events, unsigned int n);
+void recorder_push_input_events(struct recorder_ring *ring,
+                                const struct input_event *events,
+                                unsigned int n);
+void recorder_push_packet(struct recorder_ring *ring, uint64_t usec,
+                          const struct recorder_packet *packet);
+
+#endif // _RECORDER_H_
@@ -18,83 +18,728 @@
 
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <string.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include "joystick.h"
 #include "remote.h"
-#include "joystick_remote.h"
+#include "rc_udp_v3.h"
+#include "timebase.h"
+#include "log.h"
 
-int remote_start(char *remote_host, struct remote *remote)
+static int remote_add_destination(char *remote_host, struct remote *remote)
 {
+    struct remote_destination *destination;
     char *remote_addr, *remote_port;
-    struct addrinfo info;
+    struct addrinfo info, *res;
     int ret;
 
-    memset(remote, 0, sizeof(*remote));
+    if (remote->n_destinations == REMOTE_MAX_DESTINATIONS) {
+        fprintf(stderr, "remote_start : too many destinations\n");
+        return -1;
+    }
+    destination = &remote->destinations[remote->n_destinations];
     remote_addr = remote_host;
 
     remote_port = strchr(remote_host, ':');
     if (remote_port == NULL) {
         fprintf(stderr, "remote_start : no port specified\n");
-        goto err_arg;
+        return -1;
     }
 
     *remote_port = '\0';
     remote_port++;
-    debug_printf("remote addr : %s, remote port : %s\n", remote_addr, remote_port);
+    log_printf(LOG_REMOTE, LOG_INFO, "remote addr : %s, remote port : %s\n",
+               remote_addr, remote_port);
 
     memset(&info, 0, sizeof(info));
     info.ai_family = AF_UNSPEC;
     info.ai_socktype = SOCK_DGRAM;
     info.ai_protocol = 0;
     info.ai_flags = AI_ADDRCONFIG;
-    ret = getaddrinfo(remote_addr, remote_port, &info, &remote->res);
+    ret = getaddrinfo(remote_addr, remote_port, &info, &res);
     if (ret != 0) {
         fprintf(stderr, "remote_start - getaddrinfo : %s\n", gai_strerror(ret));
-        goto err_arg;
+        return -1;
     }
+    memcpy(&destination->addr, res->ai_addr, res->ai_addrlen);
+    destination->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    memset(&destination->packet, 0, sizeof(destination->packet));
+    /* to check compatibility */
+    destination->packet.version = RCINPUT_UDP_VERSION;
+    remote->n_destinations++;
+
+    return 0;
+}
 
-    remote->fd = socket(remote->res->ai_family,
-                        remote->res->ai_socktype,
-                        remote->res->ai_protocol);
-    if (remote->fd == -1) {
+static struct remote_socket *remote_get_socket(struct remote *remote, int family)
+{
+    struct remote_socket *sock;
+    unsigned int i;
+
+    for (i = 0; i < remote->n_sockets; i++) {
+        if (remote->sockets[i].family == family)
+            return &remote->sockets[i];
+    }
+    sock = &remote->sockets[remote->n_sockets];
+    sock->fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock->fd == -1) {
         perror("remote_start - socket");
-        goto err_addrinfo;
+        return NULL;
     }
+    sock->family = family;
+    remote->n_sockets++;
 
-    return 0;
-err_addrinfo:
-    freeaddrinfo(remote->res);
-err_arg:
+    return sock;
+}
+
+int remote_start(char **remote_hosts, unsigned int n_hosts,
+                 struct remote *remote)
+{
+    struct remote_destination *destination;
+    struct remote_socket *sock;
+    struct msghdr *hdr;
+    unsigned int i;
+
+    memset(remote, 0, sizeof(*remote));
+
+    for (i = 0; i < n_hosts; i++) {
+        if (remote_add_destination(remote_hosts[i], remote) == -1)
+            goto err_sockets;
+    }
+
+    /* the headers are built once, remote_send_pwms only updates packets */
+    for (i = 0; i < remote->n_destinations; i++) {
+        destination = &remote->destinations[i];
+        sock = remote_get_socket(remote, destination->addr.ss_family);
+        if (sock == NULL)
+            goto err_sockets;
+        sock->iovs[sock->n_msgs].iov_base = &destination->packet;
+        sock->iovs[sock->n_msgs].iov_len = sizeof(destination->packet);
+        destination->iov = &sock->iovs[sock->n_msgs];
+        hdr = &sock->msgs[sock->n_msgs].msg_hdr;
+        hdr->msg_name = &destination->addr;
+        hdr->msg_namelen = destination->addrlen;
+        hdr->msg_iov = &sock->iovs[sock->n_msgs];
+        hdr->msg_iovlen = 1;
+        sock->n_msgs++;
+    }
+
+    /* a connected socket saves the route lookup on every send */
+    for (i = 0; i < remote->n_sockets; i++) {
+        sock = &remote->sockets[i];
+        if (sock->n_msgs != 1)
+            continue;
+        hdr = &sock->msgs[0].msg_hdr;
+        if (connect(sock->fd, hdr->msg_name, hdr->msg_namelen) == -1) {
+            perror("remote_start - connect");
+            continue;
+        }
+        hdr->msg_name = NULL;
+        hdr->msg_namelen = 0;
+        sock->connected = 1;
+    }
+
+    return remote_set_protocol(remote, REMOTE_PROTOCOL_AUTO,
+                               REMOTE_DEFAULT_HISTORY);
+err_sockets:
+    for (i = 0; i < remote->n_sockets; i++)
+        close(remote->sockets[i].fd);
     return -1;
 }
 
+static void remote_use_version(struct remote_destination *destination,
+                               uint32_t version)
+{
+    destination->version = version;
+    destination->n_history = 0;
+    if (version == RCINPUT_UDP_VERSION_3) {
+        destination->iov->iov_base = destination->v3_packet;
+    } else {
+        destination->iov->iov_base = &destination->packet;
+        destination->iov->iov_len = sizeof(destination->packet);
+    }
+}
+
+int remote_set_protocol(struct remote *remote, enum remote_protocol protocol,
+                        unsigned int history)
+{
+    struct remote_destination *destination;
+    unsigned int i;
+
+    if (history >= RCINPUT_UDP_V3_MAX_FRAMES) {
+        fprintf(stderr, "remote_set_protocol : history is at most %d frames\n",
+                RCINPUT_UDP_V3_MAX_FRAMES - 1);
+        return -1;
+    }
+    remote->protocol = protocol;
+    remote->history = history;
+    remote->negotiating = protocol == REMOTE_PROTOCOL_AUTO;
+    for (i = 0; i < remote->n_destinations; i++) {
+        destination = &remote->destinations[i];
+        destination->max_channels = RCINPUT_UDP_V3_MAX_CHANNELS;
+        destination->max_frames = history + 1;
+        remote_use_version(destination, protocol == REMOTE_PROTOCOL_V3 ?
+                           RCINPUT_UDP_VERSION_3 : RCINPUT_UDP_VERSION);
+    }
+
+    return 0;
+}
+
+static void remote_set_v3(struct remote_destination *destination,
+                          uint16_t *pwms, unsigned int n_channels,
+                          uint64_t micro64)
+{
+    const uint16_t *frames[RCINPUT_UDP_V3_MAX_FRAMES];
+    unsigned int i, n_frames;
+
+    if (n_channels > destination->max_channels)
+        n_channels = destination->max_channels;
+    destination->history_head = (destination->history_head + 1) %
+                                RCINPUT_UDP_V3_MAX_FRAMES;
+    memcpy(destination->history[destination->history_head], pwms,
+           n_channels * sizeof(*pwms));
+    if (destination->n_history < destination->max_frames)
+        destination->n_history++;
+
+    /* oldest first */
+    n_frames = destination->n_history;
+    for (i = 0; i < n_frames; i++)
+        frames[i] = destination->history[(destination->history_head +
+                                          RCINPUT_UDP_V3_MAX_FRAMES -
+                                          (n_frames - 1 - i)) %
+                                         RCINPUT_UDP_V3_MAX_FRAMES];
+    destination->iov->iov_len =
+        rc_udp_v3_encode(destination->v3_packet, destination->packet.sequence,
+                         micro64, n_channels, frames, n_frames);
+}
+
+void remote_set_pwms(struct remote *remote, unsigned int destination,
+                     uint16_t *pwms, uint8_t len, uint64_t micro64)
+{
+    struct remote_destination *dest = &remote->destinations[destination];
+    struct rc_udp_packet *packet = &dest->packet;
+
+    if (len > RCINPUT_UDP_V3_MAX_CHANNELS * sizeof(*pwms)) {
+        fprintf(stderr, "remote_set_pwms : bad len %d\n", len);
+        return;
+    }
+    packet->sequence++;
+    if (dest->version == RCINPUT_UDP_VERSION_3) {
+        remote_set_v3(dest, pwms, len / sizeof(*pwms), micro64);
+        return;
+    }
+    packet->timestamp_us = micro64;
+    /* version 2 has a fixed number of channels */
+    memcpy(&packet->pwms, pwms,
+           len < sizeof(packet->pwms) ? len : sizeof(packet->pwms));
+}
+
+/* the software tx timestamps are on CLOCK_REALTIME */
+static uint64_t remote_realtime_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* the kernel numbers the datagrams sent, a failed send doesn't use an id */
+static void remote_keep_sent(struct remote_socket *sock, unsigned int n,
+                             uint64_t nsec)
+{
+    unsigned int slot;
+
+    for (; n > 0; n--, sock->tx_next_id++) {
+        slot = sock->tx_next_id & (REMOTE_TX_PENDING - 1);
+        sock->tx_ids[slot] = sock->tx_next_id;
+        sock->tx_sent_nsec[slot] = nsec;
+    }
+}
+
+/* before the send, the echo can't be read first */
+static void remote_keep_probes(struct remote *remote)
+{
+    struct remote_destination *destination;
+    uint64_t nsec = remote_realtime_nsec();
+    unsigned int i, slot;
+
+    for (i = 0; i < remote->n_destinations; i++) {
+        destination = &remote->destinations[i];
+        slot = destination->packet.sequence & (REMOTE_PROBE_PENDING - 1);
+        destination->probe.sequences[slot] = destination->packet.sequence;
+        destination->probe.sent_nsec[slot] = nsec;
+    }
+}
+
+void remote_flush(struct remote *remote)
+{
+    struct remote_socket *sock;
+    unsigned int i, sent;
+    uint64_t bytes, sent_nsec = 0;
+    int ret;
+
+    if (remote->probing)
+        remote_keep_probes(remote);
+    for (i = 0; i < remote->n_sockets; i++) {
+        sock = &remote->sockets[i];
+        sent = 0;
+        while (sent < sock->n_msgs) {
+            if (remote->tx_timestamps)
+                sent_nsec = remote_realtime_nsec();
+            ret = sendmmsg(sock->fd, &sock->msgs[sent], sock->n_msgs - sent, 0);
+            if (ret == -1) {
+                /* a connected socket reports the icmp errors of the peer */
+                if (errno != ECONNREFUSED)
+                    perror("remote_flush - sendmmsg");
+                /* skip the failing destination */
+                metrics_add(&remote->counters, METRICS_SEND_ERRORS, 1);
+                sent++;
+                continue;
+            }
+            if (remote->tx_timestamps)
+                remote_keep_sent(sock, ret, sent_nsec);
+            metrics_add(&remote->counters, METRICS_PACKETS, ret);
+            for (bytes = 0; ret > 0; ret--, sent++)
+                bytes += sock->iovs[sent].iov_len;
+            metrics_add(&remote->counters, METRICS_BYTES, bytes);
+        }
+    }
+    /* on loopback the timestamps are already queued, else next flush */
+    if (remote->tx_timestamps || remote->txtime)
+        remote_handle_errors(remote);
+}
+
 void remote_send_pwms(struct remote *remote, uint16_t *pwms,
                       uint8_t len, uint64_t micro64)
 {
-    struct rc_udp_packet msg;
+    unsigned int i;
+    uint32_t sends;
+
+    for (i = 0; i < remote->n_destinations; i++)
+        remote_set_pwms(remote, i, pwms, len, micro64);
+    remote_flush(remote);
+    /* the threaded loops don't watch the sockets */
+    sends = remote->sends++;
+    if ((remote->negotiating && sends % REMOTE_NEGOTIATE_EVERY == 0) ||
+        (remote->probing && sends % REMOTE_PROBE_EVERY == 0))
+        remote_handle_input(remote);
+}
+
+static int remote_same_addr(const struct sockaddr_storage *a,
+                            const struct sockaddr_storage *b)
+{
+    const struct sockaddr_in *a4 = (const struct sockaddr_in *) a;
+    const struct sockaddr_in *b4 = (const struct sockaddr_in *) b;
+    const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a;
+    const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *) b;
+
+    if (a->ss_family != b->ss_family)
+        return 0;
+    if (a->ss_family == AF_INET)
+        return a4->sin_port == b4->sin_port &&
+               a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+    if (a->ss_family == AF_INET6)
+        return a6->sin6_port == b6->sin6_port &&
+               !memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr));
+
+    return 0;
+}
+
+/* switches the destination that sent the caps to version 3 */
+static void remote_handle_caps(struct remote *remote,
+                               const struct sockaddr_storage *addr,
+                               const struct rc_udp_v3_caps *caps)
+{
+    struct remote_destination *destination;
+    unsigned int i;
+
+    remote->negotiating = 0;
+    for (i = 0; i < remote->n_destinations; i++) {
+        destination = &remote->destinations[i];
+        if (destination->version != RCINPUT_UDP_VERSION_3 &&
+            remote_same_addr(&destination->addr, addr) &&
+            caps->max_channels > 0 && caps->max_frames > 0) {
+            if (caps->max_channels < destination->max_channels)
+                destination->max_channels = caps->max_channels;
+            if (caps->max_frames < destination->max_frames)
+                destination->max_frames = caps->max_frames;
+            remote_use_version(destination, RCINPUT_UDP_VERSION_3);
+            log_printf(LOG_REMOTE, LOG_INFO,
+                       "remote : destination %u uses version 3, "
+                       "%u channels, %u frames\n", i,
+                       destination->max_channels, destination->max_frames);
+        }
+        if (destination->version != RCINPUT_UDP_VERSION_3)
+            remote->negotiating = 1;
+    }
+}
+
+/* the fastest echo of the window has the least asymmetric delays */
+static void remote_probe_sample(struct remote_probe *probe, uint64_t rtt_usec,
+                                int64_t offset_usec)
+{
+    if (probe->window_echoes == 0 || rtt_usec < probe->window_rtt_usec) {
+        probe->window_rtt_usec = rtt_usec;
+        probe->window_offset_usec = offset_usec;
+    }
+    probe->window_echoes++;
+    probe->echoes++;
+}
+
+/*
+ * t1 and t4 are the send and arrival times here, t2 and t3 the arrival and
+ * send times on the vehicle, on its own clock
+ */
+static void remote_handle_echo(struct remote *remote,
+                               const struct sockaddr_storage *addr,
+                               const struct rc_udp_echo *echo,
+                               uint64_t arrival_nsec)
+{
+    struct remote_destination *destination;
+    struct remote_probe *probe;
+    uint64_t t1, t4, rtt_usec;
+    int64_t offset_usec;
+    unsigned int i, slot;
+
+    slot = echo->sequence & (REMOTE_PROBE_PENDING - 1);
+    for (i = 0; i < remote->n_destinations; i++) {
+        destination = &remote->destinations[i];
+        probe = &destination->probe;
+        /* overwritten by newer sends, or already echoed */
+        if (!remote_same_addr(&destination->addr, addr) ||
+            probe->sequences[slot] != echo->sequence ||
+            probe->sent_nsec[slot] == 0)
+            continue;
+        t1 = probe->sent_nsec[slot] / 1000;
+        t4 = arrival_nsec / 1000;
+        probe->sent_nsec[slot] = 0;
+        /* CLOCK_REALTIME may be stepped */
+        if (t4 < t1 || echo->send_us < echo->receive_us)
+            continue;
+        rtt_usec = t4 - t1;
+        rtt_usec -= echo->send_us - echo->receive_us < rtt_usec ?
+                    echo->send_us - echo->receive_us : rtt_usec;
+        offset_usec = ((int64_t) (echo->receive_us - t1) +
+                       (int64_t) (echo->send_us - t4)) / 2;
+        histogram_record(&remote->rtt, rtt_usec);
+        histogram_record(&remote->rtt_window, rtt_usec);
+        remote_probe_sample(probe, rtt_usec, offset_usec);
+    }
+}
+
+/* the offsets of the window are kept, their change is the clock drift */
+static void remote_close_window(struct remote *remote, uint64_t now_nsec)
+{
+    struct remote_probe *probe;
+    unsigned int i;
+
+    if (now_nsec - remote->window_start_nsec < REMOTE_PROBE_WINDOW_NSEC)
+        return;
+    for (i = 0; i < remote->n_destinations; i++) {
+        probe = &remote->destinations[i].probe;
+        if (probe->window_echoes == 0)
+            continue;
+        if (probe->offset_nsec != 0 && now_nsec > probe->offset_nsec)
+            probe->drift_ppm = (probe->window_offset_usec - probe->offset_usec) *
+                               1.0e9 / (now_nsec - probe->offset_nsec);
+        probe->min_rtt_usec = probe->window_rtt_usec;
+        probe->offset_usec = probe->window_offset_usec;
+        probe->offset_nsec = now_nsec;
+        probe->window_echoes = 0;
+    }
+    remote->rtt_last_window = remote->rtt_window;
+    histogram_init(&remote->rtt_window, "round trip, current window (us)");
+    remote->rtt_last_window.name = "round trip, last window (us)";
+    remote->window_start_nsec = now_nsec;
+}
+
+/* kernel arrival time of the datagram, or now if missing */
+static uint64_t remote_arrival_nsec(struct msghdr *hdr)
+{
+    struct cmsghdr *cmsg;
+    struct timespec ts;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+
+    return remote_realtime_nsec();
+}
+
+static void remote_handle_datagram(struct remote *remote,
+                                   const struct sockaddr_storage *addr,
+                                   struct msghdr *hdr, unsigned int len)
+{
+    const uint8_t *buf = hdr->msg_iov->iov_base;
+    struct rc_udp_v3_caps caps;
+    struct rc_udp_echo echo;
+
+    if (len == sizeof(caps)) {
+        memcpy(&caps, buf, sizeof(caps));
+        if (caps.magic == RCINPUT_UDP_V3_CAPS &&
+            remote->protocol == REMOTE_PROTOCOL_AUTO)
+            remote_handle_caps(remote, addr, &caps);
+        return;
+    }
+    if (len == sizeof(echo)) {
+        memcpy(&echo, buf, sizeof(echo));
+        if (echo.magic == RCINPUT_UDP_ECHO && remote->probing)
+            remote_handle_echo(remote, addr, &echo, remote_arrival_nsec(hdr));
+        return;
+    }
+    log_printf(LOG_REMOTE, LOG_DEBUG,
+               "remote_handle_input : ignoring %u bytes\n", len);
+}
+
+void remote_handle_input(struct remote *remote)
+{
+    struct sockaddr_storage addrs[REMOTE_INPUT_BATCH];
+    uint8_t bufs[REMOTE_INPUT_BATCH][64];
+    struct iovec iovs[REMOTE_INPUT_BATCH];
+    union {
+        /* SCM_TIMESTAMPNS, and SCM_TIMESTAMPING with --tx-timestamps */
+        char buf[128];
+        struct cmsghdr align;
+    } controls[REMOTE_INPUT_BATCH];
+    struct mmsghdr msgs[REMOTE_INPUT_BATCH];
+    struct msghdr *hdr;
+    unsigned int i, j;
     int ret;
 
-    /* to check compatibility */
-    memset(&msg, 0, sizeof(msg));
-    msg.version = RCINPUT_UDP_VERSION;
-    msg.timestamp_us = micro64;
-    msg.sequence++;
+    for (i = 0; i < remote->n_sockets; i++) {
+        do {
+            memset(msgs, 0, sizeof(msgs));
+            for (j = 0; j < REMOTE_INPUT_BATCH; j++) {
+                hdr = &msgs[j].msg_hdr;
+                iovs[j].iov_base = bufs[j];
+                iovs[j].iov_len = sizeof(bufs[j]);
+                hdr->msg_name = &addrs[j];
+                hdr->msg_namelen = sizeof(addrs[j]);
+                hdr->msg_iov = &iovs[j];
+                hdr->msg_iovlen = 1;
+                hdr->msg_control = controls[j].buf;
+                hdr->msg_controllen = sizeof(controls[j].buf);
+            }
+            ret = recvmmsg(remote->sockets[i].fd, msgs, REMOTE_INPUT_BATCH,
+                           MSG_DONTWAIT, NULL);
+            if (ret == -1) {
+                if (errno != EAGAIN && errno != EINTR && errno != ECONNREFUSED)
+                    perror("remote_handle_input - recvmmsg");
+                break;
+            }
+            for (j = 0; j < (unsigned int) ret; j++)
+                remote_handle_datagram(remote, &addrs[j], &msgs[j].msg_hdr,
+                                       msgs[j].msg_len);
+        } while (ret == REMOTE_INPUT_BATCH);
+    }
+    if (remote->probing)
+        remote_close_window(remote, remote_realtime_nsec());
+    /* a pending error queue keeps the sockets readable for epoll */
+    if (remote->tx_timestamps || remote->txtime)
+        remote_handle_errors(remote);
+}
+
+int remote_enable_tx_timestamps(struct remote *remote)
+{
+    int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+    unsigned int i;
+
+    for (i = 0; i < remote->n_sockets; i++) {
+        if (setsockopt(remote->sockets[i].fd, SOL_SOCKET, SO_TIMESTAMPING,
+                       &flags, sizeof(flags)) == -1) {
+            perror("remote_enable_tx_timestamps - setsockopt");
+            return -1;
+        }
+        remote->sockets[i].tx_next_id = 0;
+    }
+    histogram_init(&remote->tx_delay, "sendmmsg to tx timestamp (ns)");
+    remote->tx_timestamps = 1;
 
-    if (len > sizeof(msg.pwms)) {
-        fprintf(stderr, "remote_send_pwms : bad len %d\n", len);
+    return 0;
+}
+
+int remote_enable_txtime(struct remote *remote)
+{
+    struct sock_txtime config;
+    struct remote_socket *sock;
+    struct cmsghdr *cmsg;
+    unsigned int i, j;
+
+    /* only fq accepts CLOCK_MONOTONIC, etf wants CLOCK_TAI */
+    config.clockid = TIMEBASE_CLOCK;
+    config.flags = SOF_TXTIME_REPORT_ERRORS;
+    for (i = 0; i < remote->n_sockets; i++) {
+        sock = &remote->sockets[i];
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_TXTIME,
+                       &config, sizeof(config)) == -1) {
+            perror("remote_enable_txtime - setsockopt");
+            return -1;
+        }
+        cmsg = &sock->txtime_control.align;
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        for (j = 0; j < sock->n_msgs; j++) {
+            sock->msgs[j].msg_hdr.msg_control = sock->txtime_control.buf;
+            sock->msgs[j].msg_hdr.msg_controllen =
+                sizeof(sock->txtime_control.buf);
+        }
+    }
+    remote->txtime = 1;
+
+    return 0;
+}
+
+void remote_set_txtime(struct remote *remote, uint64_t nsec)
+{
+    unsigned int i;
+
+    for (i = 0; i < remote->n_sockets; i++)
+        memcpy(CMSG_DATA(&remote->sockets[i].txtime_control.align),
+               &nsec, sizeof(nsec));
+}
+
+int remote_enable_probes(struct remote *remote)
+{
+    unsigned int i;
+    int on = 1;
+
+    for (i = 0; i < remote->n_sockets; i++) {
+        /* arrival times of the echoes, they are read once every few sends */
+        if (setsockopt(remote->sockets[i].fd, SOL_SOCKET, SO_TIMESTAMPNS,
+                       &on, sizeof(on)) == -1) {
+            perror("remote_enable_probes - setsockopt");
+            return -1;
+        }
+    }
+    histogram_init(&remote->rtt, "round trip (us)");
+    histogram_init(&remote->rtt_window, "round trip, current window (us)");
+    histogram_init(&remote->rtt_last_window, "round trip, last window (us)");
+    remote->window_start_nsec = remote_realtime_nsec();
+    remote->probing = 1;
+
+    return 0;
+}
+
+void remote_print_probes(const struct remote *remote, FILE *file)
+{
+    const struct remote_probe *probe;
+    unsigned int i;
+
+    if (!remote->probing)
+        return;
+    for (i = 0; i < remote->n_destinations; i++) {
+        probe = &remote->destinations[i].probe;
+        if (probe->echoes == 0) {
+            fprintf(file, "destination %u : no echo\n", i);
+            continue;
+        }
+        /* before the end of the first window, its current values */
+        fprintf(file, "destination %u : %" PRIu64 " echoes, min round trip %"
+                PRIu64 " us, offset %" PRId64 " us, drift %.1f ppm\n", i,
+                probe->echoes,
+                probe->offset_nsec != 0 ? probe->min_rtt_usec :
+                probe->window_rtt_usec,
+                probe->offset_nsec != 0 ? probe->offset_usec :
+                probe->window_offset_usec, probe->drift_ppm);
+    }
+    histogram_print(&remote->rtt, file);
+    histogram_print(&remote->rtt_last_window, file);
+}
+
+/* a tx timestamp, or a datagram dropped by the qdisc */
+static void remote_handle_error(struct remote *remote,
+                                struct remote_socket *sock,
+                                struct msghdr *hdr)
+{
+    const struct sock_extended_err *err = NULL;
+    const struct scm_timestamping *tss = NULL;
+    struct cmsghdr *cmsg;
+    uint64_t wire_nsec, sent_nsec;
+    unsigned int slot;
+
+    for (cmsg = CMSG_FIRSTHDR(hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPING)
+            tss = (const struct scm_timestamping *) CMSG_DATA(cmsg);
+        else if ((cmsg->cmsg_level == SOL_IP &&
+                  cmsg->cmsg_type == IP_RECVERR) ||
+                 (cmsg->cmsg_level == SOL_IPV6 &&
+                  cmsg->cmsg_type == IPV6_RECVERR))
+            err = (const struct sock_extended_err *) CMSG_DATA(cmsg);
+    }
+    if (err == NULL)
+        return;
+    if (err->ee_origin == SO_EE_ORIGIN_TXTIME) {
+        metrics_add(&remote->counters, METRICS_TXTIME_ERRORS, 1);
+        log_printf(LOG_REMOTE, LOG_DEBUG, "remote : txtime %s\n",
+                   err->ee_code == SO_EE_CODE_TXTIME_MISSED ?
+                   "deadline missed" : "refused");
         return;
     }
-    memcpy(&msg.pwms, pwms, len);
-    ret = sendto(remote->fd, &msg, sizeof(msg), 0,
-            remote->res->ai_addr, remote->res->ai_addrlen);
-    if (ret == -1) {
-        perror("remote_send_pwms - socket");
+    if (err->ee_origin != SO_EE_ORIGIN_TIMESTAMPING || tss == NULL ||
+        err->ee_info != SCM_TSTAMP_SND)
+        return;
+    /* overwritten by newer sends, too late to be meaningful */
+    slot = err->ee_data & (REMOTE_TX_PENDING - 1);
+    if (sock->tx_ids[slot] != err->ee_data)
         return;
+    wire_nsec = tss->ts[0].tv_sec * 1000000000ULL + tss->ts[0].tv_nsec;
+    sent_nsec = sock->tx_sent_nsec[slot];
+    /* CLOCK_REALTIME may be stepped */
+    histogram_record(&remote->tx_delay,
+                     wire_nsec > sent_nsec ? wire_nsec - sent_nsec : 0);
+}
+
+void remote_handle_errors(struct remote *remote)
+{
+    struct mmsghdr msgs[REMOTE_ERRQUEUE_BATCH];
+    union {
+        char buf[256];
+        struct cmsghdr align;
+    } controls[REMOTE_ERRQUEUE_BATCH];
+    struct remote_socket *sock;
+    unsigned int i, j;
+    int ret;
+
+    for (i = 0; i < remote->n_sockets; i++) {
+        sock = &remote->sockets[i];
+        do {
+            /* no payload with OPT_TSONLY, the dropped datagrams are truncated */
+            memset(msgs, 0, sizeof(msgs));
+            for (j = 0; j < REMOTE_ERRQUEUE_BATCH; j++) {
+                msgs[j].msg_hdr.msg_control = controls[j].buf;
+                msgs[j].msg_hdr.msg_controllen = sizeof(controls[j].buf);
+            }
+            ret = recvmmsg(sock->fd, msgs, REMOTE_ERRQUEUE_BATCH,
+                           MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+            if (ret == -1) {
+                if (errno != EAGAIN && errno != EINTR)
+                    perror("remote_handle_errors - recvmmsg");
+                break;
+            }
+            for (j = 0; j < (unsigned int) ret; j++)
+                remote_handle_error(remote, sock, &msgs[j].msg_hdr);
+        } while (ret == REMOTE_ERRQUEUE_BATCH);
     }
-    return;
+}
+
+const char *remote_protocol_name(const struct remote *remote,
+                                 unsigned int destination)
+{
+    return remote->destinations[destination].version == RCINPUT_UDP_VERSION_3 ?
+           "v3" : "v2";
 }
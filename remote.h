@@ -18,14 +18,151 @@
 
 #ifndef _REMOTE_H_
 #define _REMOTE_H_
+#include <stdio.h>
+#include <sys/socket.h>
 #include "RCInput_UDP_Protocol.h"
+#include "metrics.h"
 
-struct remote {
+#define REMOTE_MAX_DESTINATIONS 64
+/* frames of history in the version 3 datagrams, unless the vehicle wants less */
+#define REMOTE_DEFAULT_HISTORY 2
+/* while negotiating, the sockets are checked for caps every N sends */
+#define REMOTE_NEGOTIATE_EVERY 50
+/* send times kept for the tx timestamps, per socket, a power of two */
+#define REMOTE_TX_PENDING 256
+/* error queue messages read by a single recvmmsg */
+#define REMOTE_ERRQUEUE_BATCH 16
+/* caps and echoes read by a single recvmmsg */
+#define REMOTE_INPUT_BATCH 16
+/* while probing, the sockets are checked for echoes every N sends */
+#define REMOTE_PROBE_EVERY 10
+/* send times kept for the echoes, per destination, a power of two */
+#define REMOTE_PROBE_PENDING 64
+/* the offset is the one of the fastest echo of each window */
+#define REMOTE_PROBE_WINDOW_NSEC 1000000000ULL
+
+enum remote_protocol {
+    /* version 2 until the vehicle advertises version 3 */
+    REMOTE_PROTOCOL_AUTO,
+    REMOTE_PROTOCOL_V2,
+    REMOTE_PROTOCOL_V3,
+};
+
+/* round trips and clock offset of a destination that echoes */
+struct remote_probe {
+    /* send times of the last sequences, CLOCK_REALTIME */
+    uint16_t sequences[REMOTE_PROBE_PENDING];
+    uint64_t sent_nsec[REMOTE_PROBE_PENDING];
+    uint64_t echoes;
+    uint64_t window_echoes;
+    uint64_t window_rtt_usec;
+    int64_t window_offset_usec;
+    /* of the last window with echoes, the offset is the vehicle clock ahead */
+    uint64_t min_rtt_usec;
+    int64_t offset_usec;
+    uint64_t offset_nsec;
+    double drift_ppm;
+};
+
+struct remote_destination {
+    /* pre-built, only the timestamp, sequence and pwms change */
+    struct rc_udp_packet packet;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    /* points to packet or to v3_packet, depending on version */
+    struct iovec *iov;
+
+    uint32_t version;
+    /* negotiated version 3 limits */
+    uint8_t max_channels;
+    uint8_t max_frames;
+    /* last frames sent, history[history_head] is the newest */
+    unsigned int n_history;
+    unsigned int history_head;
+    uint16_t history[RCINPUT_UDP_V3_MAX_FRAMES][RCINPUT_UDP_V3_MAX_CHANNELS];
+    uint8_t v3_packet[RCINPUT_UDP_V3_MAX_SIZE];
+    struct remote_probe probe;
+};
+
+/* one socket per address family, all its packets go in one sendmmsg */
+struct remote_socket {
     int fd;
-    struct addrinfo *res;
+    int family;
+    /* connected when it has a single destination, msg_name is then NULL */
+    uint8_t connected;
+    unsigned int n_msgs;
+    struct mmsghdr msgs[REMOTE_MAX_DESTINATIONS];
+    struct iovec iovs[REMOTE_MAX_DESTINATIONS];
+    /* SO_TIMESTAMPING numbers the datagrams from 0, CLOCK_REALTIME times */
+    uint32_t tx_next_id;
+    uint32_t tx_ids[REMOTE_TX_PENDING];
+    uint64_t tx_sent_nsec[REMOTE_TX_PENDING];
+    /* SO_TXTIME, the same release time for all the messages */
+    union {
+        char buf[CMSG_SPACE(sizeof(uint64_t))];
+        struct cmsghdr align;
+    } txtime_control;
 };
 
-int remote_start(char *remote_host, struct remote *remote);
+struct remote {
+    unsigned int n_destinations;
+    struct remote_destination destinations[REMOTE_MAX_DESTINATIONS];
+    unsigned int n_sockets;
+    struct remote_socket sockets[2];
+    enum remote_protocol protocol;
+    unsigned int history;
+    /* some destinations may still switch to version 3 */
+    uint8_t negotiating;
+    uint32_t sends;
+    /* packets, bytes and send errors of the thread calling remote_flush */
+    struct metrics_counters counters;
+    uint8_t tx_timestamps;
+    uint8_t txtime;
+    /* sendmmsg to the software tx timestamp : stack, qdisc and driver */
+    struct histogram tx_delay;
+    uint8_t probing;
+    /* round trips of all the echoes, of the current and the last window */
+    struct histogram rtt;
+    struct histogram rtt_window;
+    struct histogram rtt_last_window;
+    uint64_t window_start_nsec;
+};
+
+/* remote_hosts are remote_address:remote_port strings */
+int remote_start(char **remote_hosts, unsigned int n_hosts,
+                 struct remote *remote);
+/* REMOTE_PROTOCOL_AUTO with REMOTE_DEFAULT_HISTORY after remote_start */
+int remote_set_protocol(struct remote *remote, enum remote_protocol protocol,
+                        unsigned int history);
+/* sends the same pwms to all the destinations, len in bytes */
 void remote_send_pwms(struct remote *remote, uint16_t *pwms,
                       uint8_t len, uint64_t micro64);
+/* updates the packet of a single destination, sent by remote_flush */
+void remote_set_pwms(struct remote *remote, unsigned int destination,
+                     uint16_t *pwms, uint8_t len, uint64_t micro64);
+void remote_flush(struct remote *remote);
+/* handles the version 3 caps sent by the vehicles, and the error queues */
+void remote_handle_input(struct remote *remote);
+/* software tx timestamps of every datagram, measured in tx_delay */
+int remote_enable_tx_timestamps(struct remote *remote);
+/*
+ * SO_TXTIME : the datagrams carry a TIMEBASE_CLOCK release time, set by
+ * remote_set_txtime before each flush. Only the fq qdisc honours it,
+ * without it the datagrams leave at once.
+ */
+int remote_enable_txtime(struct remote *remote);
+void remote_set_txtime(struct remote *remote, uint64_t nsec);
+/* reads the tx timestamps and the txtime errors, never blocks */
+void remote_handle_errors(struct remote *remote);
+/*
+ * the sequence of each datagram is a probe, the echoes of the receivers
+ * started with --echo are read by remote_handle_input with kernel arrival
+ * times, so reading them late doesn't change the round trips
+ */
+int remote_enable_probes(struct remote *remote);
+/* round trips, offsets and drifts of the destinations that echo */
+void remote_print_probes(const struct remote *remote, FILE *file);
+/* name of the protocol used for a destination, for the stats */
+const char *remote_protocol_name(const struct remote *remote,
+                                 unsigned int destination);
 #endif // _REMOTE_H_
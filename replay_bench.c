@@ -0,0 +1,244 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays a recorded stick session through joystick_remote, in real time
+ * and as fast as possible, into a local udp sink. joystick_remote prints
+ * its events/s, packets/s, latency percentiles and cpu time when the
+ * replay ends, the sink count and the child cpu time are printed here.
+ * Without a session file, a synthetic one is generated, so that it runs
+ * on machines without any joystick.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/joystick.h>
+
+#include "RCInput_UDP_Protocol.h"
+
+/* the synthetic session moves 4 axes every 2ms, like a 500Hz gamepad */
+#define BENCH_EVENT_PERIOD_MSEC 2
+#define BENCH_NUM_AXES 8
+#define BENCH_NUM_BUTTONS 11
+#define BENCH_SESSION_SECONDS 10
+
+static uint64_t sink_packets;
+
+static int write_event(FILE *file, uint32_t time, uint8_t type,
+                       uint8_t number, int16_t value)
+{
+    struct js_event event;
+
+    event.time = time;
+    event.type = type;
+    event.number = number;
+    event.value = value;
+    if (fwrite(&event, sizeof(event), 1, file) != 1) {
+        perror("write_event - fwrite");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int generate_session(const char *path, unsigned int seconds)
+{
+    static const uint8_t moving_axes[] = {0, 1, 3, 4};
+    uint32_t time, end = seconds * 1000;
+    unsigned int i;
+    FILE *file;
+    int ret = 0;
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        perror("generate_session - fopen");
+        return -1;
+    }
+    /* the initial state, like joydev sends it on open */
+    for (i = 0; i < BENCH_NUM_AXES && ret == 0; i++)
+        ret = write_event(file, 0, JS_EVENT_AXIS | JS_EVENT_INIT, i, 0);
+    for (i = 0; i < BENCH_NUM_BUTTONS && ret == 0; i++)
+        ret = write_event(file, 0, JS_EVENT_BUTTON | JS_EVENT_INIT, i, 0);
+
+    for (time = BENCH_EVENT_PERIOD_MSEC; time <= end && ret == 0;
+         time += BENCH_EVENT_PERIOD_MSEC) {
+        for (i = 0; i < sizeof(moving_axes) && ret == 0; i++)
+            ret = write_event(file, time, JS_EVENT_AXIS, moving_axes[i],
+                              32767 * sin(2 * M_PI * time * (i + 1) / 4000.0));
+        /* mode changes every second */
+        if (time % 1000 == 0 && ret == 0)
+            ret = write_event(file, time, JS_EVENT_BUTTON,
+                              (time / 1000) % 6, 1);
+        if (time % 1000 == 100 && ret == 0)
+            ret = write_event(file, time, JS_EVENT_BUTTON,
+                              (time / 1000) % 6, 0);
+    }
+
+    if (fclose(file) != 0 && ret == 0) {
+        perror("generate_session - fclose");
+        ret = -1;
+    }
+
+    return ret;
+}
+
+static void *sink_thread(void *arg)
+{
+    struct rc_udp_packet packets[64];
+    struct mmsghdr msgs[64];
+    struct iovec iovs[64];
+    int fd = *(int *) arg;
+    int i, ret;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < 64; i++) {
+        iovs[i].iov_base = &packets[i];
+        iovs[i].iov_len = sizeof(packets[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (1) {
+        ret = recvmmsg(fd, msgs, 64, MSG_WAITFORONE, NULL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("sink_thread - recvmmsg");
+            break;
+        }
+        __atomic_fetch_add(&sink_packets, ret, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static int run(const char *title, char **args)
+{
+    struct rusage usage;
+    uint64_t packets;
+    int status;
+    pid_t pid;
+
+    printf("\n%s\n", title);
+    fflush(stdout);
+    packets = __atomic_load_n(&sink_packets, __ATOMIC_RELAXED);
+    pid = fork();
+    if (pid == -1) {
+        perror("run - fork");
+        return -1;
+    } else if (pid == 0) {
+        execv(args[0], args);
+        perror("run - execv");
+        _exit(EXIT_FAILURE);
+    }
+    if (wait4(pid, &status, 0, &usage) == -1) {
+        perror("run - wait4");
+        return -1;
+    }
+    /* let the sink drain */
+    usleep(20000);
+    packets = __atomic_load_n(&sink_packets, __ATOMIC_RELAXED) - packets;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s failed\n", args[0]);
+        return -1;
+    }
+    printf("sink received %" PRIu64 " packets, "
+           "child cpu user %.3fs system %.3fs\n", packets,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    char session[] = "/tmp/replay_bench_XXXXXX";
+    char *session_path = session;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    char sink_host[64];
+    pthread_t sink;
+    int sink_fd, fd;
+    int ret = EXIT_FAILURE;
+
+    if (argc > 2) {
+        fprintf(stderr, "usage: replay_bench [recorded js_event session]\n");
+        return EXIT_FAILURE;
+    }
+    if (argc == 2) {
+        session_path = argv[1];
+    } else {
+        fd = mkstemp(session);
+        if (fd == -1) {
+            perror("replay_bench - mkstemp");
+            return EXIT_FAILURE;
+        }
+        close(fd);
+        if (generate_session(session, BENCH_SESSION_SECONDS) == -1)
+            goto end;
+    }
+
+    sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink_fd == -1 ||
+        bind(sink_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        getsockname(sink_fd, (struct sockaddr *) &addr, &addrlen) == -1) {
+        perror("replay_bench - sink socket");
+        goto end;
+    }
+    snprintf(sink_host, sizeof(sink_host), "127.0.0.1:%d", ntohs(addr.sin_port));
+    pthread_create(&sink, NULL, sink_thread, &sink_fd);
+    printf("replaying %s to %s\n", session_path, sink_host);
+
+    {
+        char *realtime[] = {"./joystick_remote", "-d", session_path,
+                            "-t", "xbox360", "-r", sink_host, "-x", "1", NULL};
+        char *on_change[] = {"./joystick_remote", "-d", session_path,
+                             "-t", "xbox360", "-r", sink_host, "-x", "1",
+                             "-s", NULL};
+        char *max_speed[] = {"./joystick_remote", "-d", session_path,
+                             "-t", "xbox360", "-r", sink_host, "-x", "0",
+                             "-s", "-g", "0", NULL};
+
+        if (run("1x, 100Hz ticks", realtime) == -1 ||
+            run("1x, on change", on_change) == -1 ||
+            run("max speed, on change, no min gap", max_speed) == -1)
+            goto end;
+    }
+    ret = EXIT_SUCCESS;
+
+end:
+    if (session_path == session)
+        unlink(session);
+
+    return ret;
+}
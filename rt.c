@@ -0,0 +1,238 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "rt.h"
+#include "log.h"
+
+static uint8_t memory_locked;
+
+void rt_init(struct rt_config *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->reader.cpu = -1;
+    config->sender.cpu = -1;
+}
+
+void rt_enable(struct rt_config *config)
+{
+    config->lock_memory = 1;
+    if (config->reader.priority == 0)
+        config->reader.priority = RT_DEFAULT_READER_PRIORITY;
+    if (config->sender.priority == 0)
+        config->sender.priority = RT_DEFAULT_SENDER_PRIORITY;
+}
+
+int rt_parse_pair(const char *arg, int *first, int *second)
+{
+    char *end;
+
+    *first = strtol(arg, &end, 10);
+    if (end == arg)
+        return -1;
+    if (*end == '\0') {
+        *second = *first;
+        return 0;
+    }
+    if (*end != ',')
+        return -1;
+    arg = end + 1;
+    *second = strtol(arg, &end, 10);
+    if (end == arg || *end != '\0')
+        return -1;
+
+    return 0;
+}
+
+static void rt_prefault_stack(void)
+{
+    volatile uint8_t stack[RT_STACK_PREFAULT];
+    unsigned int i;
+
+    for (i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+int rt_lock_memory(void)
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        perror("rt_lock_memory - mlockall");
+        return -1;
+    }
+    rt_prefault_stack();
+    memory_locked = 1;
+
+    return 0;
+}
+
+int rt_thread_attr(const struct rt_thread_config *config, pthread_attr_t *attr)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int ret;
+
+    ret = pthread_attr_init(attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("rt_thread_attr - pthread_attr_init");
+        return -1;
+    }
+    ret = pthread_attr_setstacksize(attr, RT_THREAD_STACK_SIZE);
+    if (ret != 0) {
+        errno = ret;
+        perror("rt_thread_attr - pthread_attr_setstacksize");
+        goto err_destroy;
+    }
+    if (config->priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        /* otherwise the policy of the creating thread is used */
+        ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+        if (ret == 0)
+            ret = pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+        if (ret == 0)
+            ret = pthread_attr_setschedparam(attr, &param);
+        if (ret != 0) {
+            errno = ret;
+            perror("rt_thread_attr - SCHED_FIFO");
+            goto err_destroy;
+        }
+    }
+    if (config->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(config->cpu, &cpus);
+        ret = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+        if (ret != 0) {
+            errno = ret;
+            perror("rt_thread_attr - pthread_attr_setaffinity_np");
+            goto err_destroy;
+        }
+    }
+
+    return 0;
+err_destroy:
+    pthread_attr_destroy(attr);
+    return -1;
+}
+
+int rt_background_attr(pthread_attr_t *attr)
+{
+    struct sched_param param = { .sched_priority = 0 };
+    int ret;
+
+    ret = pthread_attr_init(attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("rt_background_attr - pthread_attr_init");
+        return -1;
+    }
+    /* otherwise a thread created from a SCHED_FIFO one would inherit it */
+    ret = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    if (ret == 0)
+        ret = pthread_attr_setschedpolicy(attr, SCHED_OTHER);
+    if (ret == 0)
+        ret = pthread_attr_setschedparam(attr, &param);
+    if (ret != 0) {
+        errno = ret;
+        perror("rt_background_attr - SCHED_OTHER");
+        pthread_attr_destroy(attr);
+        return -1;
+    }
+
+    return 0;
+}
+
+int rt_apply_self(const struct rt_thread_config *config)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int ret, failed = 0;
+
+    if (config->priority > 0) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = config->priority;
+        ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (ret != 0) {
+            errno = ret;
+            perror("rt_apply_self - pthread_setschedparam");
+            failed = 1;
+        }
+    }
+    if (config->cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(config->cpu, &cpus);
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (ret != 0) {
+            errno = ret;
+            perror("rt_apply_self - pthread_setaffinity_np");
+            failed = 1;
+        }
+    }
+
+    return failed ? -1 : 0;
+}
+
+int rt_check(const char *name, pthread_t thread,
+             const struct rt_thread_config *config)
+{
+    struct sched_param param;
+    cpu_set_t cpus;
+    int policy = SCHED_OTHER, failures = 0;
+
+    memset(&param, 0, sizeof(param));
+    if (pthread_getschedparam(thread, &policy, &param) != 0) {
+        fprintf(stderr, "rt : %s, scheduling unknown\n", name);
+        failures++;
+    } else if (config->priority > 0 &&
+               (policy != SCHED_FIFO ||
+                param.sched_priority != config->priority)) {
+        fprintf(stderr, "rt : %s is not SCHED_FIFO %d "
+                "(needs CAP_SYS_NICE or RLIMIT_RTPRIO)\n",
+                name, config->priority);
+        failures++;
+    }
+    if (config->cpu >= 0 &&
+        (pthread_getaffinity_np(thread, sizeof(cpus), &cpus) != 0 ||
+         CPU_COUNT(&cpus) != 1 || !CPU_ISSET(config->cpu, &cpus))) {
+        fprintf(stderr, "rt : %s is not pinned on cpu %d\n", name, config->cpu);
+        failures++;
+    }
+    log_printf(LOG_RT, LOG_INFO, "rt : %s %s %d, cpu %d\n", name,
+               policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_OTHER",
+               param.sched_priority, config->cpu);
+
+    return failures;
+}
+
+int rt_check_memory(void)
+{
+    if (memory_locked)
+        return 0;
+    fprintf(stderr, "rt : memory is not locked "
+            "(needs CAP_IPC_LOCK or RLIMIT_MEMLOCK)\n");
+
+    return 1;
+}
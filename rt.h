@@ -0,0 +1,71 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _RT_H_
+#define _RT_H_
+#include <stdint.h>
+#include <pthread.h>
+
+#define RT_DEFAULT_READER_PRIORITY 60
+#define RT_DEFAULT_SENDER_PRIORITY 50
+/* touched at startup so that the main stack never faults afterwards */
+#define RT_STACK_PREFAULT (256 * 1024)
+/* the default 8MB would all be locked, and may exceed RLIMIT_MEMLOCK */
+#define RT_THREAD_STACK_SIZE (256 * 1024)
+
+struct rt_thread_config {
+    /* SCHED_FIFO priority, 0 keeps the default policy */
+    int priority;
+    /* cpu the thread is pinned on, -1 if not pinned */
+    int cpu;
+};
+
+struct rt_config {
+    uint8_t lock_memory;
+    /* the joystick thread */
+    struct rt_thread_config reader;
+    /* the thread sending the packets, the main one */
+    struct rt_thread_config sender;
+};
+
+/* nothing enabled */
+void rt_init(struct rt_config *config);
+/* locks the memory, default priorities unless already set */
+void rt_enable(struct rt_config *config);
+/* "a,b" to two ints, a single value is used for both */
+int rt_parse_pair(const char *arg, int *first, int *second);
+/*
+ * mlockall, the stacks of the threads created afterwards are locked and
+ * populated when mapped, the one of the caller is prefaulted
+ */
+int rt_lock_memory(void);
+/* attributes for pthread_create, to be destroyed by the caller */
+int rt_thread_attr(const struct rt_thread_config *config, pthread_attr_t *attr);
+/* same, for the writer and server threads which are never real time */
+int rt_background_attr(pthread_attr_t *attr);
+/* applies the config to the calling thread */
+int rt_apply_self(const struct rt_thread_config *config);
+/*
+ * self check : reports on stderr what the thread really got, returns the
+ * number of settings that could not be applied
+ */
+int rt_check(const char *name, pthread_t thread,
+             const struct rt_thread_config *config);
+int rt_check_memory(void);
+
+#endif // _RT_H_
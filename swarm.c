@@ -0,0 +1,278 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "joystick.h"
+#include "remote.h"
+#include "mixer.h"
+#include "swarm.h"
+#include "timebase.h"
+
+/* epoll sources which are not vehicles, vehicles use their index */
+#define SWARM_SOURCE_TICK   0xffffffff
+#define SWARM_SOURCE_REMOTE 0xfffffffe
+/* or'ed with the vehicle index while its device is unplugged */
+#define SWARM_SOURCE_HOTPLUG 0x80000000
+
+#define SWARM_MAX_EVENTS 64
+
+static int swarm_epoll_add(struct swarm *swarm, int fd, uint32_t source)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.u32 = source;
+    if (epoll_ctl(swarm->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("swarm_epoll_add - epoll_ctl");
+        return -1;
+    }
+
+    return 0;
+}
+
+int swarm_init(struct swarm *swarm, const struct mixer *mixer,
+               uint32_t period_usec)
+{
+    memset(swarm, 0, sizeof(*swarm));
+    swarm->vehicles = calloc(SWARM_MAX_VEHICLES, sizeof(*swarm->vehicles));
+    if (swarm->vehicles == NULL) {
+        perror("swarm_init - calloc");
+        return -1;
+    }
+    swarm->mixer = mixer;
+    swarm->period_usec = period_usec;
+    swarm->epoll_fd = -1;
+    swarm->tick_fd = -1;
+
+    return 0;
+}
+
+int swarm_add_vehicle_fd(struct swarm *swarm, int fd, char *type,
+                         char *remote_host)
+{
+    struct swarm_vehicle *vehicle;
+
+    if (swarm->n_vehicles == SWARM_MAX_VEHICLES) {
+        fprintf(stderr, "swarm_add_vehicle : too many vehicles, max %d\n",
+                SWARM_MAX_VEHICLES);
+        return -1;
+    }
+    vehicle = &swarm->vehicles[swarm->n_vehicles];
+    if (joystick_attach(fd, type, JOYSTICK_BACKEND_JOYDEV,
+                        &vehicle->joystick) == -1)
+        return -1;
+    swarm->remote_hosts[swarm->n_vehicles++] = remote_host;
+
+    return 0;
+}
+
+int swarm_add_vehicle(struct swarm *swarm, char *spec,
+                      enum joystick_backend backend)
+{
+    char *device, *type, *remote_host, *saveptr;
+
+    device = strtok_r(spec, ",", &saveptr);
+    type = strtok_r(NULL, ",", &saveptr);
+    remote_host = strtok_r(NULL, ",", &saveptr);
+    if (device == NULL || type == NULL || remote_host == NULL) {
+        fprintf(stderr, "swarm_add_vehicle : bad vehicle %s\n", spec);
+        return -1;
+    }
+    if (swarm->n_vehicles == SWARM_MAX_VEHICLES) {
+        fprintf(stderr, "swarm_add_vehicle : too many vehicles, max %d\n",
+                SWARM_MAX_VEHICLES);
+        return -1;
+    }
+    if (joystick_open(device, type, backend,
+                      &swarm->vehicles[swarm->n_vehicles].joystick) == -1)
+        return -1;
+    swarm->remote_hosts[swarm->n_vehicles++] = remote_host;
+
+    return 0;
+}
+
+int swarm_start(struct swarm *swarm)
+{
+    unsigned int i;
+
+    /* destination i is the remote of vehicle i */
+    if (remote_start(swarm->remote_hosts, swarm->n_vehicles,
+                     &swarm->remote) == -1)
+        return -1;
+
+    swarm->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (swarm->epoll_fd == -1) {
+        perror("swarm_start - epoll_create1");
+        return -1;
+    }
+    swarm->tick_fd = timerfd_create(TIMEBASE_CLOCK, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (swarm->tick_fd == -1) {
+        perror("swarm_start - timerfd_create");
+        return -1;
+    }
+    if (swarm_epoll_add(swarm, swarm->tick_fd, SWARM_SOURCE_TICK) == -1)
+        return -1;
+    for (i = 0; i < swarm->remote.n_sockets; i++) {
+        if (swarm_epoll_add(swarm, swarm->remote.sockets[i].fd,
+                            SWARM_SOURCE_REMOTE) == -1)
+            return -1;
+    }
+    for (i = 0; i < swarm->n_vehicles; i++) {
+        if (swarm_epoll_add(swarm, swarm->vehicles[i].joystick.fd, i) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* now_usec is the single clock read of the tick */
+static void swarm_tick(struct swarm *swarm, uint64_t now_usec)
+{
+    int16_t inputs[MIXER_NUM_INPUTS] __attribute__((aligned(32)));
+    uint16_t pwms[MIXER_NUM_OUTPUTS];
+    struct joystick_state state;
+    uint64_t micro64;
+    unsigned int i;
+
+    /* a single timestamp for the whole batch */
+    micro64 = timebase_stamp_usec(now_usec) - swarm->stamp_start_usec;
+    for (i = 0; i < swarm->n_vehicles; i++) {
+        joystick_get_state(&swarm->vehicles[i].joystick, &state);
+        mixer_inputs(&state, inputs);
+        mixer_run(swarm->mixer, inputs, pwms);
+        remote_set_pwms(&swarm->remote, i, pwms,
+                        swarm->mixer->n_outputs * sizeof(*pwms), micro64);
+    }
+    remote_flush(&swarm->remote);
+    swarm->ticks++;
+}
+
+static void swarm_reconnect_vehicle(struct swarm *swarm, unsigned int index)
+{
+    struct swarm_vehicle *vehicle = &swarm->vehicles[index];
+
+    if (joystick_reconnect(&vehicle->joystick) != 1 ||
+        swarm_epoll_add(swarm, vehicle->joystick.fd, index) == -1)
+        return;
+    vehicle->disconnected = 0;
+}
+
+static void swarm_handle_vehicle(struct swarm *swarm, unsigned int index,
+                                 uint32_t events)
+{
+    struct swarm_vehicle *vehicle = &swarm->vehicles[index];
+
+    if (!(events & (EPOLLHUP | EPOLLERR)) &&
+        joystick_process_events(&vehicle->joystick) != -1)
+        return;
+
+    /* don't take the other vehicles down */
+    fprintf(stderr, "swarm : joystick of vehicle %u disconnected\n", index);
+    epoll_ctl(swarm->epoll_fd, EPOLL_CTL_DEL, vehicle->joystick.fd, NULL);
+    vehicle->disconnected = 1;
+    /* the failsafe state is sent until the device is back */
+    if (joystick_disconnect(&vehicle->joystick) == -1 ||
+        swarm_epoll_add(swarm, vehicle->joystick.hotplug.inotify_fd,
+                        index | SWARM_SOURCE_HOTPLUG) == -1)
+        return;
+    swarm_reconnect_vehicle(swarm, index);
+}
+
+int swarm_run(struct swarm *swarm, uint64_t duration_usec)
+{
+    struct epoll_event events[SWARM_MAX_EVENTS];
+    struct itimerspec its;
+    uint64_t expirations, now_usec;
+    uint8_t done = 0;
+    int i, n;
+
+    swarm->start_usec = timebase_now_usec();
+    swarm->stamp_start_usec = timebase_stamp_usec(swarm->start_usec);
+    timebase_usec_to_timespec(swarm->start_usec, &its.it_value);
+    timebase_usec_to_timespec(swarm->period_usec, &its.it_interval);
+    if (timerfd_settime(swarm->tick_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("swarm_run - timerfd_settime");
+        return -1;
+    }
+
+    while (!done) {
+        n = epoll_wait(swarm->epoll_fd, events, SWARM_MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("swarm_run - epoll_wait");
+            return -1;
+        }
+        swarm->wakeups++;
+        for (i = 0; i < n; i++) {
+            switch (events[i].data.u32) {
+            case SWARM_SOURCE_TICK:
+                if (read(swarm->tick_fd, &expirations, sizeof(expirations)) == -1)
+                    break;
+                now_usec = timebase_now_usec();
+                swarm_tick(swarm, now_usec);
+                /* checked on the ticks, which don't stop */
+                if (duration_usec != 0 &&
+                    now_usec - swarm->start_usec >= duration_usec)
+                    done = 1;
+                break;
+            case SWARM_SOURCE_REMOTE:
+                remote_handle_input(&swarm->remote);
+                break;
+            default:
+                if (events[i].data.u32 & SWARM_SOURCE_HOTPLUG)
+                    swarm_reconnect_vehicle(swarm, events[i].data.u32 &
+                                                   ~SWARM_SOURCE_HOTPLUG);
+                else
+                    swarm_handle_vehicle(swarm, events[i].data.u32,
+                                         events[i].events);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+void swarm_stop(struct swarm *swarm)
+{
+    unsigned int i;
+
+    for (i = 0; i < swarm->remote.n_sockets; i++)
+        close(swarm->remote.sockets[i].fd);
+    for (i = 0; i < swarm->n_vehicles; i++) {
+        close(swarm->vehicles[i].joystick.fd);
+        if (swarm->vehicles[i].joystick.hotplug.inotify_fd != -1)
+            close(swarm->vehicles[i].joystick.hotplug.inotify_fd);
+    }
+    if (swarm->tick_fd != -1)
+        close(swarm->tick_fd);
+    if (swarm->epoll_fd != -1)
+        close(swarm->epoll_fd);
+    free(swarm->vehicles);
+}
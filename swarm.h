@@ -0,0 +1,66 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SWARM_H_
+#define _SWARM_H_
+
+#define SWARM_MAX_VEHICLES REMOTE_MAX_DESTINATIONS
+
+struct swarm_vehicle {
+    struct joystick joystick;
+    /* the joystick is gone, its failsafe state is sent until it is back */
+    uint8_t disconnected;
+};
+
+/*
+ * Drives several vehicles, each from its own joystick, from a single
+ * thread : one epoll, one timerfd for all the vehicles and one sendmmsg
+ * per tick for all the packets.
+ */
+struct swarm {
+    unsigned int n_vehicles;
+    struct swarm_vehicle *vehicles;
+    char *remote_hosts[SWARM_MAX_VEHICLES];
+    struct remote remote;
+    const struct mixer *mixer;
+    uint32_t period_usec;
+    /* TIMEBASE_CLOCK and packet timestamp clock times of swarm_run */
+    uint64_t start_usec;
+    uint64_t stamp_start_usec;
+    int epoll_fd;
+    int tick_fd;
+
+    /* stats */
+    uint64_t ticks;
+    uint64_t wakeups;
+};
+
+int swarm_init(struct swarm *swarm, const struct mixer *mixer,
+               uint32_t period_usec);
+/* spec is your_device,joystick_type,remote_address:remote_port */
+int swarm_add_vehicle(struct swarm *swarm, char *spec,
+                      enum joystick_backend backend);
+/* fd is an already opened, non blocking, fd streaming js_events */
+int swarm_add_vehicle_fd(struct swarm *swarm, int fd, char *type,
+                         char *remote_host);
+int swarm_start(struct swarm *swarm);
+/* runs for duration_usec, or forever if 0 */
+int swarm_run(struct swarm *swarm, uint64_t duration_usec);
+void swarm_stop(struct swarm *swarm);
+
+#endif // _SWARM_H_
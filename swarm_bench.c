@@ -0,0 +1,215 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Measures the cpu cost of the swarm mode : N fake joysticks fed through
+ * pipes, all sending at 100Hz to a local udp sink, for N = 1, 2, 4, ...
+ * The cpu time is the one of the swarm thread only, the feeder and the
+ * sink run in their own threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/joystick.h>
+
+#include "joystick.h"
+#include "remote.h"
+#include "mixer.h"
+#include "swarm.h"
+
+#define BENCH_PERIOD_USEC 10000
+/* each fake joystick moves an axis every 2ms */
+#define BENCH_EVENT_PERIOD_USEC 2000
+
+static int feeder_fds[SWARM_MAX_VEHICLES];
+static volatile unsigned int n_feeder_fds;
+static volatile int feeder_running;
+static uint64_t sink_packets;
+
+static void *feeder_thread(void *arg)
+{
+    struct timespec ts = {0, BENCH_EVENT_PERIOD_USEC * 1000};
+    struct js_event event;
+    unsigned int i, n = 0;
+
+    (void) arg;
+    memset(&event, 0, sizeof(event));
+    event.type = JS_EVENT_AXIS;
+    while (feeder_running) {
+        event.number = n % 5;
+        event.value = (n * 997) % 65535 - 32767;
+        for (i = 0; i < n_feeder_fds; i++) {
+            if (write(feeder_fds[i], &event, sizeof(event)) == -1 &&
+                errno != EAGAIN)
+                perror("feeder_thread - write");
+        }
+        n++;
+        nanosleep(&ts, NULL);
+    }
+
+    return NULL;
+}
+
+static void *sink_thread(void *arg)
+{
+    struct rc_udp_packet packets[64];
+    struct mmsghdr msgs[64];
+    struct iovec iovs[64];
+    int fd = *(int *) arg;
+    int i, ret;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < 64; i++) {
+        iovs[i].iov_base = &packets[i];
+        iovs[i].iov_len = sizeof(packets[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (1) {
+        ret = recvmmsg(fd, msgs, 64, MSG_WAITFORONE, NULL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("sink_thread - recvmmsg");
+            break;
+        }
+        __atomic_fetch_add(&sink_packets, ret, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+static uint64_t thread_cpu_usec(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_THREAD, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static int run(unsigned int n_vehicles, unsigned int seconds,
+               const struct mixer *mixer, const char *sink_host)
+{
+    char hosts[SWARM_MAX_VEHICLES][64];
+    uint64_t cpu_usec, packets;
+    struct swarm swarm;
+    unsigned int i;
+    int fds[2];
+
+    if (swarm_init(&swarm, mixer, BENCH_PERIOD_USEC) == -1)
+        return -1;
+    for (i = 0; i < n_vehicles; i++) {
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("run - pipe2");
+            return -1;
+        }
+        strcpy(hosts[i], sink_host);
+        if (swarm_add_vehicle_fd(&swarm, fds[0], "xbox360", hosts[i]) == -1)
+            return -1;
+        feeder_fds[i] = fds[1];
+    }
+    if (swarm_start(&swarm) == -1)
+        return -1;
+    n_feeder_fds = n_vehicles;
+
+    packets = __atomic_load_n(&sink_packets, __ATOMIC_RELAXED);
+    cpu_usec = thread_cpu_usec();
+    swarm_run(&swarm, seconds * 1000000ULL);
+    cpu_usec = thread_cpu_usec() - cpu_usec;
+    /* let the sink drain */
+    usleep(20000);
+    packets = __atomic_load_n(&sink_packets, __ATOMIC_RELAXED) - packets;
+
+    n_feeder_fds = 0;
+    usleep(2 * BENCH_EVENT_PERIOD_USEC);
+    printf("%8u %8" PRIu64 " %8" PRIu64 " %10" PRIu64 " %10.1f %10.3f %10.1f\n",
+           n_vehicles, swarm.ticks, swarm.wakeups, packets,
+           cpu_usec / 1000.0, 100.0 * cpu_usec / (seconds * 1e6) / n_vehicles,
+           (double) swarm.wakeups / seconds);
+    for (i = 0; i < n_vehicles; i++)
+        close(feeder_fds[i]);
+    swarm_stop(&swarm);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int max_vehicles = 16, seconds = 2, n;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    pthread_t feeder, sink;
+    char sink_host[64];
+    struct mixer mixer;
+    int sink_fd;
+
+    if (argc > 1)
+        max_vehicles = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        seconds = strtoul(argv[2], NULL, 10);
+    if (max_vehicles == 0 || max_vehicles > SWARM_MAX_VEHICLES || seconds == 0) {
+        fprintf(stderr, "usage: swarm_bench [max_vehicles (1-%d)] [seconds]\n",
+                SWARM_MAX_VEHICLES);
+        return EXIT_FAILURE;
+    }
+
+    sink_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink_fd == -1 ||
+        bind(sink_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        getsockname(sink_fd, (struct sockaddr *) &addr, &addrlen) == -1) {
+        perror("swarm_bench - sink socket");
+        return EXIT_FAILURE;
+    }
+    snprintf(sink_host, sizeof(sink_host), "127.0.0.1:%d", ntohs(addr.sin_port));
+
+    mixer_init(&mixer);
+    feeder_running = 1;
+    pthread_create(&feeder, NULL, feeder_thread, NULL);
+    pthread_create(&sink, NULL, sink_thread, &sink_fd);
+
+    printf("%d Hz, %u s per run, sink %s\n", 1000000 / BENCH_PERIOD_USEC,
+           seconds, sink_host);
+    printf("%8s %8s %8s %10s %10s %10s %10s\n", "vehicles", "ticks", "wakeups",
+           "packets", "cpu ms", "cpu %/veh", "wakeups/s");
+    for (n = 1; n <= max_vehicles; n *= 2) {
+        if (run(n, seconds, &mixer, sink_host) == -1)
+            return EXIT_FAILURE;
+        if (n < max_vehicles && n * 2 > max_vehicles)
+            n = max_vehicles / 2;
+    }
+    feeder_running = 0;
+    pthread_join(feeder, NULL);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,70 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "timebase.h"
+
+static clockid_t stamp_clock = TIMEBASE_CLOCK;
+
+int timebase_sleep_until(uint64_t usec)
+{
+    struct timespec ts;
+    int ret;
+
+    timebase_usec_to_timespec(usec, &ts);
+    do {
+        ret = clock_nanosleep(TIMEBASE_CLOCK, TIMER_ABSTIME, &ts, NULL);
+    } while (ret == EINTR);
+    if (ret != 0) {
+        errno = ret;
+        perror("timebase_sleep_until - clock_nanosleep");
+        return -1;
+    }
+
+    return 0;
+}
+
+int timebase_set_stamp_clock(const char *name)
+{
+    if (!strcmp(name, "monotonic")) {
+        stamp_clock = TIMEBASE_CLOCK;
+    } else if (!strcmp(name, "raw")) {
+        stamp_clock = CLOCK_MONOTONIC_RAW;
+    } else {
+        fprintf(stderr, "timebase_set_stamp_clock : unknown clock %s\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+uint64_t timebase_stamp_usec(uint64_t now_usec)
+{
+    struct timespec ts;
+
+    if (stamp_clock == TIMEBASE_CLOCK)
+        return now_usec;
+    clock_gettime(stamp_clock, &ts);
+
+    return timebase_timespec_to_usec(&ts);
+}
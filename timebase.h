@@ -0,0 +1,70 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Integer time base shared by all the modules, in us or ns since the boot.
+ * The deadlines (timerfd, clock_nanosleep) and the evdev events are on
+ * CLOCK_MONOTONIC, which is read from the vDSO without a syscall. Each tick
+ * reads it once and passes the value down.
+ */
+#define TIMEBASE_CLOCK CLOCK_MONOTONIC
+
+static inline uint64_t timebase_timespec_to_usec(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000ULL + ts->tv_nsec / 1000;
+}
+
+static inline void timebase_usec_to_timespec(uint64_t usec, struct timespec *ts)
+{
+    ts->tv_sec = usec / 1000000;
+    ts->tv_nsec = (usec % 1000000) * 1000;
+}
+
+static inline uint64_t timebase_now_nsec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(TIMEBASE_CLOCK, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t timebase_now_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(TIMEBASE_CLOCK, &ts);
+    return timebase_timespec_to_usec(&ts);
+}
+
+/* sleeps until the absolute time usec, returns -1 on error */
+int timebase_sleep_until(uint64_t usec);
+/*
+ * "monotonic" (default) or "raw" for the packet timestamps. Unlike
+ * CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW is not slewed by ntp, but it can't
+ * be used for the deadlines, so it costs a second read per tick.
+ */
+int timebase_set_stamp_clock(const char *name);
+/* the packet timestamp matching now_usec, a TIMEBASE_CLOCK time */
+uint64_t timebase_stamp_usec(uint64_t now_usec);
+
+#endif // _TIMEBASE_H_
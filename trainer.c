@@ -0,0 +1,174 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#include "joystick.h"
+#include "trainer.h"
+#include "log.h"
+
+static void trainer_update_used(struct trainer *trainer)
+{
+    unsigned int i;
+
+    /* the instructor is always read, for its takeover button */
+    trainer->used = 1;
+    for (i = 0; i < TRAINER_NUM_CHANNELS; i++)
+        trainer->used |= 1U << trainer->sources[i];
+}
+
+void trainer_init(struct trainer *trainer, struct joystick *instructor)
+{
+    memset(trainer, 0, sizeof(*trainer));
+    trainer->controllers[0] = instructor;
+    trainer->n_controllers = 1;
+    trainer->takeover_button = TRAINER_NO_TAKEOVER;
+    trainer_update_used(trainer);
+}
+
+int trainer_add(struct trainer *trainer, struct joystick *controller)
+{
+    if (trainer->n_controllers == TRAINER_MAX_CONTROLLERS) {
+        fprintf(stderr, "trainer_add : too many controllers, max %d\n",
+                TRAINER_MAX_CONTROLLERS);
+        return -1;
+    }
+    if (trainer->n_controllers == 1) {
+        memset(trainer->sources, 1, sizeof(trainer->sources));
+        trainer_update_used(trainer);
+    }
+    trainer->controllers[trainer->n_controllers] = controller;
+
+    return trainer->n_controllers++;
+}
+
+int trainer_set_channels(struct trainer *trainer, char *spec)
+{
+    static const char *channels[TRAINER_NUM_CHANNELS] = {
+        "roll", "pitch", "throttle", "yaw", "mode", "raw"
+    };
+    uint8_t sources[TRAINER_NUM_CHANNELS];
+    char *token, *saveptr, *value;
+    unsigned long controller;
+    int i, channel;
+
+    memcpy(sources, trainer->sources, sizeof(sources));
+    for (token = strtok_r(spec, ",", &saveptr); token != NULL;
+         token = strtok_r(NULL, ",", &saveptr)) {
+        value = strchr(token, '=');
+        if (value == NULL)
+            goto err;
+        *value++ = '\0';
+        controller = strtoul(value, NULL, 10);
+        if (controller >= trainer->n_controllers)
+            goto err;
+        channel = -1;
+        for (i = 0; i < TRAINER_NUM_CHANNELS; i++) {
+            if (!strcmp(token, channels[i]))
+                channel = i;
+        }
+        if (!strcmp(token, "all"))
+            memset(sources, controller, sizeof(sources));
+        else if (channel != -1)
+            sources[channel] = controller;
+        else
+            goto err;
+    }
+    memcpy(trainer->sources, sources, sizeof(sources));
+    trainer_update_used(trainer);
+
+    return 0;
+err:
+    fprintf(stderr, "trainer_set_channels : bad channel %s, "
+            "channel=controller with controller < %u expected\n",
+            token, trainer->n_controllers);
+    return -1;
+}
+
+int trainer_set_takeover(struct trainer *trainer, unsigned int button)
+{
+    if (button >= JOYSTICK_NUM_RAW_BUTTONS) {
+        fprintf(stderr, "trainer_set_takeover : button %u, max %d\n",
+                button, JOYSTICK_NUM_RAW_BUTTONS - 1);
+        return -1;
+    }
+    trainer->takeover_button = button;
+
+    return 0;
+}
+
+void trainer_merge(struct trainer *trainer, struct joystick_state *state)
+{
+    struct joystick_state states[TRAINER_MAX_CONTROLLERS];
+    const struct joystick_state *source;
+    uint16_t *pwms = (uint16_t *) &state->pwms;
+    uint32_t used = trainer->used;
+    unsigned int i;
+
+    joystick_get_state(trainer->controllers[0], &states[0]);
+    if (trainer->takeover_button != TRAINER_NO_TAKEOVER &&
+        (states[0].buttons >> trainer->takeover_button) & 1) {
+        if (!trainer->taken_over) {
+            trainer->taken_over = 1;
+            trainer->takeovers++;
+            log_printf(LOG_TRAINER, LOG_INFO, "trainer : instructor takes over\n");
+        }
+        *state = states[0];
+        return;
+    }
+    if (trainer->taken_over) {
+        trainer->taken_over = 0;
+        log_printf(LOG_TRAINER, LOG_INFO, "trainer : instructor hands over\n");
+    }
+    for (i = 1; i < trainer->n_controllers; i++) {
+        if (used & (1U << i))
+            joystick_get_state(trainer->controllers[i], &states[i]);
+    }
+
+    source = &states[trainer->sources[TRAINER_CHANNEL_RAW]];
+    memcpy(state->axes, source->axes, sizeof(state->axes));
+    state->buttons = source->buttons;
+    state->event_usec = source->event_usec;
+    for (i = 0; i < TRAINER_CHANNEL_RAW; i++) {
+        source = &states[trainer->sources[i]];
+        pwms[i] = ((const uint16_t *) &source->pwms)[i];
+        if (i < JOYSTICK_NUM_AXIS) {
+            state->rates[i] = source->rates[i];
+            state->axis_usec[i] = source->axis_usec[i];
+            state->pwm_min[i] = source->pwm_min[i];
+            state->pwm_max[i] = source->pwm_max[i];
+        }
+        /* the latest change of the sources */
+        if (source->event_usec > state->event_usec)
+            state->event_usec = source->event_usec;
+    }
+}
+
+void trainer_print(const struct trainer *trainer, FILE *file)
+{
+    if (trainer->n_controllers <= 1)
+        return;
+    fprintf(file, "trainer : %u controllers, %" PRIu64 " takeovers, "
+            "taken over %s\n", trainer->n_controllers, trainer->takeovers,
+            trainer->taken_over ? "yes" : "no");
+}
@@ -0,0 +1,70 @@
+/*
+    This file is part of joystick_remote.
+
+    joystick_remote is free software: you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation, either version 3 of the
+    License, or any later version.
+
+    joystick_remote is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with joystick_remote.  
+    If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _TRAINER_H_
+#define _TRAINER_H_
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Several controllers driving one vehicle, e.g. an instructor and a
+ * student. Each controller has its own reader thread publishing in its
+ * own seqlock, the sender merges them once per tick without any lock.
+ * Controller 0 is the instructor : while it holds the takeover button, it
+ * drives all the channels, otherwise each channel comes from the
+ * controller it was assigned to. Only the controllers assigned to a
+ * channel are read, so the merge costs at most one state copy per channel
+ * whatever the number of controllers.
+ */
+#define TRAINER_MAX_CONTROLLERS 4
+#define TRAINER_NO_TAKEOVER 0xff
+
+/* the pwms channels in the struct joystick_pwms order, then the raw ones */
+enum {
+    TRAINER_CHANNEL_MODE = JOYSTICK_NUM_AXIS,
+    /* the raw axes and buttons, used by the mixer */
+    TRAINER_CHANNEL_RAW,
+    TRAINER_NUM_CHANNELS
+};
+
+struct trainer {
+    struct joystick *controllers[TRAINER_MAX_CONTROLLERS];
+    unsigned int n_controllers;
+    /* controller of each channel */
+    uint8_t sources[TRAINER_NUM_CHANNELS];
+    /* bit n is set if controller n is the source of a channel */
+    uint32_t used;
+    /* button of the instructor, TRAINER_NO_TAKEOVER if none */
+    uint8_t takeover_button;
+
+    /* only accessed by the sender */
+    uint8_t taken_over;
+    uint64_t takeovers;
+};
+
+/* instructor is controller 0 and drives all the channels */
+void trainer_init(struct trainer *trainer, struct joystick *instructor);
+/* the first controller added gets all the channels, returns its index */
+int trainer_add(struct trainer *trainer, struct joystick *controller);
+/* channel=controller list, e.g. roll=1,pitch=1,raw=1 or all=1 */
+int trainer_set_channels(struct trainer *trainer, char *spec);
+int trainer_set_takeover(struct trainer *trainer, unsigned int button);
+void trainer_merge(struct trainer *trainer, struct joystick_state *state);
+void trainer_print(const struct trainer *trainer, FILE *file);
+
+#endif // _TRAINER_H_